@@ -0,0 +1,208 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Generator of synthetic inputs for the converter, each stressing one kind
+ * of construct at a given size:
+ *
+ *   table <n>    an n entry enum-indexed table of designated initializers,
+ *                like pix_fmt_info, with the entries out of order
+ *   nested <d>   arrays of structs in structs, initialized to depth d
+ *   literals <k> a function with k compound literals
+ *   mixed <n>    a block of n mixed declarations and statements
+ *
+ *   bench/gencorpus table 1000 bench/corpus/table-1000.c
+ *
+ * The output is preprocessed already and depends on nothing but the
+ * arguments, so runs can be compared. clang allows brackets to nest 256
+ * deep, which limits nested to a depth of about 120.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// entries of the nested table, whatever its depth
+#define NESTED_ENTRIES 64
+// the stride of the table entry order, coprime to most sizes
+#define TABLE_STRIDE 7919
+
+static void gen_table(FILE *f, unsigned n)
+{
+    unsigned i, k;
+    int stride = n % TABLE_STRIDE != 0;
+
+    fprintf(f, "enum BenchFmt {\n");
+    for (i = 0; i < n; i++)
+        fprintf(f, "    BENCH_FMT_%u,\n", i);
+    fprintf(f, "    BENCH_FMT_NB,\n};\n\n");
+
+    fprintf(f, "struct BenchComp {\n    int plane, step, shift;\n};\n\n");
+    fprintf(f, "struct BenchFmtInfo {\n"
+               "    const char *name;\n"
+               "    int nb_channels;\n"
+               "    int depth;\n"
+               "    struct BenchComp comp[4];\n"
+               "    unsigned flags;\n"
+               "};\n\n");
+
+    fprintf(f, "static const struct BenchFmtInfo bench_fmt_info[] = {\n");
+    for (i = 0; i < n; i++) {
+        k = stride ? (unsigned) ((unsigned long long) i * TABLE_STRIDE % n)
+                   : n - 1 - i;
+        fprintf(f, "    [BENCH_FMT_%u] = {\n", k);
+        fprintf(f, "        .depth       = %u,\n", 8 + k % 25);
+        fprintf(f, "        .name        = \"fmt%u\",\n", k);
+        fprintf(f, "        .comp        = {\n"
+                   "            [1] = { .step = %u, .shift = %u },\n"
+                   "            { 2, .shift = %u },\n"
+                   "        },\n", 1 + k % 4, k % 8, k % 16);
+        if (k & 1)
+            fprintf(f, "        .flags       = %uU,\n", k & 7);
+        fprintf(f, "        .nb_channels = %u,\n", 1 + k % 4);
+        fprintf(f, "    },\n");
+    }
+    fprintf(f, "};\n\n");
+
+    fprintf(f, "int bench_fmt_depth(enum BenchFmt fmt)\n{\n"
+               "    return bench_fmt_info[fmt].depth;\n}\n");
+}
+
+static void gen_nested(FILE *f, unsigned depth)
+{
+    unsigned i, level;
+
+    fprintf(f, "struct Nest0 {\n    int v;\n    int w[2];\n};\n\n");
+    // one element arrays, so the size stays linear in the depth
+    for (level = 1; level <= depth; level++)
+        fprintf(f, "struct Nest%u {\n    int v;\n    struct Nest%u s[1];\n"
+                   "    int t[2];\n};\n\n", level, level - 1);
+
+    fprintf(f, "static const struct Nest%u nested[] = {\n", depth);
+    for (i = 0; i < NESTED_ENTRIES; i++) {
+        fprintf(f, "    [%u] = {\n", NESTED_ENTRIES - 1 - i);
+        for (level = depth; level > 0; level--)
+            fprintf(f, "%*s.t = { [1] = %u }, .s = { [0] = { .v = %u,\n",
+                    2 * (depth - level) + 8, "", i + level, level);
+        fprintf(f, "%*s.w = { [1] = %u }", 2 * depth + 8, "", i);
+        for (level = 0; level < depth; level++)
+            fprintf(f, " } }");
+        fprintf(f, ",\n        .v = %u,\n    },\n", i);
+    }
+    fprintf(f, "};\n\n");
+
+    fprintf(f, "int bench_nested(int i)\n{\n"
+               "    return nested[i].v;\n}\n");
+}
+
+static void gen_literals(FILE *f, unsigned k)
+{
+    unsigned i;
+
+    fprintf(f, "struct BenchRect {\n    int x, y, w, h;\n};\n\n");
+    fprintf(f, "int bench_area(const struct BenchRect *r);\n");
+    fprintf(f, "int bench_sum(const int *v, int n);\n\n");
+    fprintf(f, "int bench_literals(int a)\n{\n    int total = 0;\n\n");
+    for (i = 0; i < k; i++) {
+        switch (i % 3) {
+        case 0:
+            fprintf(f, "    total += bench_area(&(struct BenchRect)"
+                       "{ .w = a, .h = %u });\n", i);
+            break;
+        case 1:
+            fprintf(f, "    total += bench_sum((int[]){ a, total, %u }, 3);\n",
+                    i);
+            break;
+        case 2:
+            fprintf(f, "    total += bench_area(&(const struct BenchRect)"
+                       "{ a + %u, .w = total, 2 });\n", i);
+            break;
+        }
+    }
+    fprintf(f, "\n    return total;\n}\n");
+}
+
+static void gen_mixed(FILE *f, unsigned n)
+{
+    unsigned i;
+
+    fprintf(f, "struct BenchPair {\n    int a, b;\n};\n\n");
+    fprintf(f, "int bench_mixed(int a)\n{\n    int total = a;\n");
+    for (i = 0; i < n; i++) {
+        switch (i % 4) {
+        case 0:
+            fprintf(f, "    int v%u = total + %u;\n", i, i);
+            break;
+        case 1:
+            fprintf(f, "    total += v%u * 3;\n", i - 1);
+            break;
+        case 2:
+            fprintf(f, "    for (int i = 0; i < v%u; i++)\n"
+                       "        total ^= i;\n", i - 2);
+            break;
+        case 3:
+            fprintf(f, "    struct BenchPair p%u = { .b = total, .a = v%u };\n",
+                    i, i - 3);
+            fprintf(f, "    total -= p%u.a;\n", i);
+            break;
+        }
+    }
+    fprintf(f, "\n    return total;\n}\n");
+}
+
+static const struct {
+    const char *name;
+    void (*gen)(FILE *f, unsigned size);
+} kinds[] = {
+    { "table",    gen_table },
+    { "nested",   gen_nested },
+    { "literals", gen_literals },
+    { "mixed",    gen_mixed },
+};
+
+int main(int argc, char **argv)
+{
+    FILE *f = stdout;
+    unsigned n;
+    int size;
+
+    if (argc < 3 || (size = atoi(argv[2])) <= 0) {
+        fprintf(stderr, "%s <kind> <size> [<output>]\n", argv[0]);
+        fprintf(stderr, "kinds: table, nested, literals, mixed\n");
+        return 1;
+    }
+    for (n = 0; n < sizeof(kinds) / sizeof(kinds[0]); n++)
+        if (!strcmp(argv[1], kinds[n].name))
+            break;
+    if (n == sizeof(kinds) / sizeof(kinds[0])) {
+        fprintf(stderr, "Unknown kind %s\n", argv[1]);
+        return 1;
+    }
+    if (argc > 3 && !(f = fopen(argv[3], "w"))) {
+        perror(argv[3]);
+        return 1;
+    }
+    kinds[n].gen(f, size);
+    if (f != stdout && fclose(f)) {
+        perror(argv[3]);
+        return 1;
+    }
+
+    return 0;
+}
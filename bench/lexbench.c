@@ -0,0 +1,189 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Throughput of the native lexer against clang_tokenize(), building what
+ * the converter's token table needs (spellings and locations), over
+ * preprocessed sources given on the command line:
+ *
+ *   bench/lexbench [-ms] convert.prev.c unit.prev.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <clang-c/Index.h>
+
+#include "lex.h"
+
+#define MIN_SECONDS 0.5
+
+static char *read_file(const char *filename, size_t *len)
+{
+    FILE *f = fopen(filename, "rb");
+    char *buf = NULL;
+    size_t size = 0, n;
+
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    *len = 0;
+    do {
+        if (*len + 65536 > size) {
+            size = size * 2 + 65536;
+            buf = (char *) realloc(buf, size);
+            if (!buf) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        n = fread(&buf[*len], 1, size - *len, f);
+        *len += n;
+    } while (n > 0);
+    fclose(f);
+
+    return buf;
+}
+
+static double elapsed(clock_t start)
+{
+    return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+// the number of tokens, spelling each of them
+static unsigned long native_tokens(const char *buf, size_t len, int ms_compat,
+                                   char *spelling)
+{
+    Lexer l;
+    LexToken tok;
+    unsigned long count = 0;
+
+    init_lexer(&l, buf, len, ms_compat);
+    while (lex_token(&l, &tok)) {
+        get_token_spelling(&l, &tok, spelling);
+        count++;
+    }
+
+    return count;
+}
+
+// the same with clang_tokenize(), as the converter used to build its table
+static unsigned long clang_tokens(CXTranslationUnit TU)
+{
+    CXCursor cursor = clang_getTranslationUnitCursor(TU);
+    CXSourceRange range = clang_getCursorExtent(cursor);
+    CXToken *tokens = NULL;
+    unsigned n, n_tokens = 0;
+
+    clang_tokenize(TU, range, &tokens, &n_tokens);
+    for (n = 0; n < n_tokens; n++) {
+        CXSourceLocation l = clang_getTokenLocation(TU, tokens[n]);
+        CXString str = clang_getTokenSpelling(TU, tokens[n]);
+        unsigned line, col, offset;
+        CXFile file;
+
+        clang_getSpellingLocation(l, &file, &line, &col, &offset);
+        clang_disposeString(str);
+    }
+    clang_disposeTokens(TU, tokens, n_tokens);
+
+    return n_tokens;
+}
+
+int main(int argc, char **argv)
+{
+    const char *ms_argv[] = { "-fms-extensions", "-target", "i386-pc-win32" };
+    CXIndex index = clang_createIndex(1, 1);
+    int ms_compat = 0, arg = 1, res = 0;
+
+    if (arg < argc && !strcmp(argv[arg], "-ms")) {
+        ms_compat = 1;
+        arg++;
+    }
+    if (arg == argc) {
+        fprintf(stderr, "%s [-ms] <preprocessed source>...\n", argv[0]);
+        return 1;
+    }
+
+    for (; arg < argc; arg++) {
+        CXTranslationUnit TU;
+        unsigned long runs, native_count = 0, clang_count = 0;
+        double secs, native_rate, clang_rate;
+        clock_t start;
+        size_t len;
+        char *buf = read_file(argv[arg], &len), *spelling;
+
+        if (len > (unsigned) -1) {
+            fprintf(stderr, "%s: files larger than 4 GB aren't supported\n",
+                    argv[arg]);
+            return 1;
+        }
+        spelling = (char *) malloc(len + 1);
+        if (!spelling) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+
+        runs = 0;
+        start = clock();
+        do {
+            native_count = native_tokens(buf, len, ms_compat, spelling);
+            runs++;
+        } while ((secs = elapsed(start)) < MIN_SECONDS);
+        native_rate = len * (double) runs / secs / 1e6;
+
+        TU = clang_createTranslationUnitFromSourceFile(index, argv[arg],
+                                                       ms_compat ? 3 : 0,
+                                                       ms_argv, 0, NULL);
+        if (!TU) {
+            fprintf(stderr, "Unable to parse %s\n", argv[arg]);
+            return 1;
+        }
+        runs = 0;
+        start = clock();
+        do {
+            clang_count = clang_tokens(TU);
+            runs++;
+        } while ((secs = elapsed(start)) < MIN_SECONDS);
+        clang_rate = len * (double) runs / secs / 1e6;
+        clang_disposeTranslationUnit(TU);
+
+        printf("%s: %lu bytes, %lu tokens\n", argv[arg], (unsigned long) len,
+               native_count);
+        printf("  %-6s %8.1f MB/s %8.2f Mtokens/s  %.1fx\n", "native",
+               native_rate, native_rate * native_count / len,
+               native_rate / clang_rate);
+        printf("  %-6s %8.1f MB/s %8.2f Mtokens/s\n", "clang", clang_rate,
+               clang_rate * clang_count / len);
+        if (native_count != clang_count) {
+            fprintf(stderr, "%s: the native lexer found %lu tokens, "
+                    "clang %lu\n", argv[arg], native_count, clang_count);
+            res = 1;
+        }
+
+        free(spelling);
+        free(buf);
+    }
+
+    clang_disposeIndex(index);
+
+    return res;
+}
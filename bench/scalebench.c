@@ -0,0 +1,214 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Time and peak memory of the converter over inputs of growing size, such
+ * as the ones bench/gencorpus writes:
+ *
+ *   bench/scalebench [-runs 3] ./c99conv bench/corpus/table-1000.c ...
+ *
+ * Inputs named <series>-<size>.c given one after the other form a series,
+ * and each is compared to the one before it: the growth exponent is how
+ * the time grows with the input size, 1 for linear. It is below 1 for
+ * small inputs, where starting the converter dominates, and anything well
+ * above 1 for large ones is superlinear behavior worth a look.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// in milliseconds
+static double now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return count.QuadPart * 1000.0 / freq.QuadPart;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+#endif
+}
+
+/*
+ * Run argv and store the peak resident memory of the process, in KB, in
+ * rss. Returns the exit status of argv[0], or -1 if it couldn't be run.
+ */
+static int run(char **argv, long *rss)
+{
+#ifdef _WIN32
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    PROCESS_MEMORY_COUNTERS pmc;
+    DWORD status;
+    char cmdline[32768];
+    size_t len = 0;
+    int i;
+
+    for (i = 0; argv[i]; i++) {
+        size_t n = strlen(argv[i]);
+
+        if (len + n + 4 > sizeof(cmdline))
+            return -1;
+        if (i)
+            cmdline[len++] = ' ';
+        cmdline[len++] = '"';
+        memcpy(&cmdline[len], argv[i], n);
+        len += n;
+        cmdline[len++] = '"';
+    }
+    cmdline[len] = '\0';
+
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    if (!CreateProcessA(NULL, cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &si,
+                        &pi))
+        return -1;
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    GetExitCodeProcess(pi.hProcess, &status);
+    *rss = 0;
+    if (GetProcessMemoryInfo(pi.hProcess, &pmc, sizeof(pmc)))
+        *rss = (long) (pmc.PeakWorkingSetSize / 1024);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+
+    return status;
+#else
+    struct rusage ru;
+    pid_t pid = fork();
+    int status;
+
+    if (pid < 0)
+        return -1;
+    if (!pid) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status))
+        return -1;
+#ifdef __APPLE__
+    *rss = ru.ru_maxrss / 1024; // in bytes there
+#else
+    *rss = ru.ru_maxrss;
+#endif
+
+    return WEXITSTATUS(status);
+#endif
+}
+
+// the length of the series part of the file name, 0 if there is none
+static size_t series_len(const char *filename)
+{
+    const char *dash = strrchr(filename, '-');
+
+    return dash ? dash - filename : 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *conv_argv[4];
+    const char *prev = NULL;
+    double prev_size = 0, prev_time = 0;
+    int runs = 3, arg = 1;
+
+    if (argc > 2 && !strcmp(argv[1], "-runs")) {
+        runs = atoi(argv[2]);
+        arg += 2;
+    }
+    if (argc - arg < 2 || runs <= 0) {
+        fprintf(stderr, "%s [-runs <n>] <converter> <input>...\n", argv[0]);
+        return 1;
+    }
+    conv_argv[0] = argv[arg++];
+    conv_argv[3] = NULL;
+
+    printf("%-32s %10s %10s %10s %10s %8s\n", "input", "size (KB)",
+           "time (ms)", "us/KB", "peak (KB)", "growth");
+    for (; arg < argc; arg++) {
+        const char *input = argv[arg];
+        char output[1024];
+        struct stat st;
+        double size, best = 0;
+        long peak = 0;
+        int n;
+
+        if (stat(input, &st)) {
+            perror(input);
+            return 1;
+        }
+        size = st.st_size / 1024.0;
+        if (strlen(input) + 5 > sizeof(output)) {
+            fprintf(stderr, "%s: name too long\n", input);
+            return 1;
+        }
+        sprintf(output, "%s.out", input);
+        conv_argv[1] = (char *) input;
+        conv_argv[2] = output;
+
+        for (n = 0; n < runs; n++) {
+            double start = now(), time;
+            long rss;
+            int res = run(conv_argv, &rss);
+
+            if (res) {
+                fprintf(stderr, "%s failed on %s (%d)\n", conv_argv[0], input,
+                        res);
+                return 1;
+            }
+            time = now() - start;
+            if (!n || time < best)
+                best = time;
+            if (rss > peak)
+                peak = rss;
+        }
+        remove(output);
+
+        printf("%-32s %10.1f %10.2f %10.2f %10ld", input, size, best,
+               best * 1000 / size, peak);
+        if (prev && series_len(input) == series_len(prev) &&
+            !strncmp(input, prev, series_len(input)) && size > prev_size &&
+            prev_time > 0)
+            printf(" %8.2f", log(best / prev_time) / log(size / prev_size));
+        printf("\n");
+        fflush(stdout);
+
+        prev = input;
+        prev_size = size;
+        prev_time = best;
+    }
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Throughput of the candidate scanner implementations and of the whole
+ * pre-scan, over preprocessed sources given on the command line:
+ *
+ *   bench/scanbench convert.prev.c unit.prev.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "prescan.h"
+#include "scan.h"
+
+#define MIN_SECONDS 0.5
+#define CHUNK 1024
+
+static const char *impl_names[] = { "auto", "scalar", "sse2", "avx2" };
+
+static char *read_inputs(int argc, char **argv, size_t *len)
+{
+    char *buf = NULL;
+    size_t size = 0;
+    int i;
+
+    *len = 0;
+    for (i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        size_t n;
+
+        if (!f) {
+            perror(argv[i]);
+            exit(1);
+        }
+        do {
+            if (*len + 65536 > size) {
+                size = size * 2 + 65536;
+                buf = (char *) realloc(buf, size);
+                if (!buf) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(1);
+                }
+            }
+            n = fread(&buf[*len], 1, size - *len, f);
+            *len += n;
+        } while (n > 0);
+        fclose(f);
+        // keep the files apart
+        buf[(*len)++] = '\n';
+    }
+
+    return buf;
+}
+
+static double elapsed(clock_t start)
+{
+    return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+// the number of candidates, and a hash of their offsets in *hash
+static unsigned long count_candidates(const char *buf, size_t len,
+                                      enum ScanImpl impl, unsigned *offsets,
+                                      unsigned *hash)
+{
+    Scanner s;
+    unsigned long count = 0;
+    unsigned n, i;
+
+    *hash = 0;
+    init_scanner(&s, buf, len, impl);
+    while ((n = scan_candidates(&s, offsets, CHUNK))) {
+        for (i = 0; i < n; i++)
+            *hash = *hash * 31 + offsets[i];
+        count += n;
+    }
+
+    return count;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned offsets[CHUNK];
+    unsigned long ref_count = 0;
+    unsigned ref_hash = 0;
+    double scalar_rate = 0;
+    char *buf;
+    size_t len;
+    int impl, res = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "%s <preprocessed source>...\n", argv[0]);
+        return 1;
+    }
+    buf = read_inputs(argc, argv, &len);
+    if (len > (unsigned) -1) {
+        fprintf(stderr, "Inputs larger than 4 GB aren't supported\n");
+        return 1;
+    }
+    printf("%lu bytes\n", (unsigned long) len);
+
+    for (impl = SCAN_SCALAR; impl <= SCAN_AVX2; impl++) {
+        Scanner s;
+        unsigned long count = 0, runs = 0;
+        unsigned hash;
+        double secs, rate;
+        clock_t start;
+
+        if (init_scanner(&s, buf, len, (enum ScanImpl) impl)) {
+            printf("%-8s not available\n", impl_names[impl]);
+            continue;
+        }
+        start = clock();
+        do {
+            count = count_candidates(buf, len, (enum ScanImpl) impl, offsets,
+                                     &hash);
+            runs++;
+        } while ((secs = elapsed(start)) < MIN_SECONDS);
+        rate = len * (double) runs / secs / 1e9;
+
+        if (impl == SCAN_SCALAR) {
+            ref_count = count;
+            ref_hash = hash;
+            scalar_rate = rate;
+        } else if (count != ref_count || hash != ref_hash) {
+            fprintf(stderr, "%s candidates differ from the scalar ones\n",
+                    impl_names[impl]);
+            res = 1;
+        }
+        printf("%-8s %6.2f GB/s  %.1fx  %lu candidates\n", impl_names[impl],
+               rate, rate / scalar_rate, count);
+    }
+
+    {
+        unsigned long runs = 0;
+        int needs = 0;
+        double secs;
+        clock_t start = clock();
+
+        do {
+            needs = prescan_needs_conversion(buf, len);
+            runs++;
+        } while ((secs = elapsed(start)) < MIN_SECONDS);
+        printf("%-8s %6.2f GB/s  needs conversion: %s\n", "prescan",
+               len * (double) runs / secs / 1e9, needs ? "yes" : "no");
+    }
+
+    free(buf);
+
+    return res;
+}
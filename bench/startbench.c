@@ -0,0 +1,148 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Wall clock time of running a command over and over, for comparing the
+ * startup time of converter builds:
+ *
+ *   bench/startbench 200 ./c99conv bench/passthrough.c bench/passthrough.out.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// in milliseconds
+static double now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return count.QuadPart * 1000.0 / freq.QuadPart;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+#endif
+}
+
+// returns the exit status of argv[0], or -1 if it couldn't be run
+static int run(char **argv)
+{
+#ifdef _WIN32
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    DWORD status;
+    char cmdline[32768];
+    size_t len = 0;
+    int i;
+
+    for (i = 0; argv[i]; i++) {
+        size_t n = strlen(argv[i]);
+
+        if (len + n + 4 > sizeof(cmdline))
+            return -1;
+        if (i)
+            cmdline[len++] = ' ';
+        cmdline[len++] = '"';
+        memcpy(&cmdline[len], argv[i], n);
+        len += n;
+        cmdline[len++] = '"';
+    }
+    cmdline[len] = '\0';
+
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    if (!CreateProcessA(NULL, cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &si,
+                        &pi))
+        return -1;
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    GetExitCodeProcess(pi.hProcess, &status);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+
+    return status;
+#else
+    pid_t pid = fork();
+    int status;
+
+    if (pid < 0)
+        return -1;
+    if (!pid) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+        return -1;
+
+    return WEXITSTATUS(status);
+#endif
+}
+
+static int compare_times(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    double *times, total = 0;
+    int runs, n;
+
+    if (argc < 3 || (runs = atoi(argv[1])) <= 0) {
+        fprintf(stderr, "%s <runs> <command> [<args>...]\n", argv[0]);
+        return 1;
+    }
+    times = (double *) malloc(sizeof(*times) * runs);
+    if (!times) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (n = 0; n < runs; n++) {
+        double start = now();
+        int res = run(&argv[2]);
+
+        if (res) {
+            fprintf(stderr, "%s failed (%d)\n", argv[2], res);
+            return 1;
+        }
+        times[n] = now() - start;
+        total += times[n];
+    }
+    qsort(times, runs, sizeof(*times), compare_times);
+    printf("%s: %d runs, min %.2f ms, median %.2f ms, mean %.2f ms\n",
+           argv[2], runs, times[0], times[runs / 2], total / runs);
+    free(times);
+
+    return 0;
+}
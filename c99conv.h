@@ -0,0 +1,124 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter library
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef C99CONV_H
+#define C99CONV_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A conversion context holds the converter state. It can be reused for
+ * any number of conversions, which saves setting up libclang each time,
+ * but must not be used by more than one thread at a time. Separate
+ * contexts can be used in parallel.
+ */
+typedef struct C99ConvContext C99ConvContext;
+
+typedef struct C99ConvOptions {
+    int ms_compat;   /* parse with MSVC extensions, like c99conv -ms */
+    int trace_level; /* like c99conv --trace=<level>, 0 for none */
+    int no_prescan;  /* parse even sources that need no conversion */
+    int clang_lexer; /* tokenize with libclang instead of the native lexer */
+    int check_lexer; /* fail unless both lexers give the same tokens */
+} C99ConvOptions;
+
+/* returns NULL if out of memory */
+C99ConvContext *c99conv_create_context(void);
+void c99conv_free_context(C99ConvContext *ctx);
+
+/*
+ * All conversion functions return 0 on success. On failure, an error has
+ * been printed to stderr, nothing is returned and the context can still
+ * be used for other conversions. opts can be NULL for the defaults.
+ */
+
+/* convert infile to outfile; either can be "-" for stdin/stdout */
+int c99conv_convert_file(C99ConvContext *ctx, const char *infile,
+                         const char *outfile, const C99ConvOptions *opts);
+
+/*
+ * Convert len bytes of preprocessed source at in. The result is returned
+ * in *out, which must be released with c99conv_free(), and its length in
+ * *outlen.
+ */
+int c99conv_convert_buffer(C99ConvContext *ctx, const char *in, size_t len,
+                           const C99ConvOptions *opts,
+                           char **out, size_t *outlen);
+
+void c99conv_free(void *ptr);
+
+/*
+ * Describe the libclang that conversions use, by the file it was loaded
+ * from and its version, in buf. Loads libclang first if needed. Returns
+ * 0 on success, and nonzero with an error printed to stderr if libclang
+ * can't be loaded or the description doesn't fit.
+ */
+int c99conv_describe_libclang(char *buf, size_t size);
+
+/*
+ * Conversion statistics. Each context adds up the time spent in each phase
+ * of its conversions, and counts what they did.
+ */
+enum C99ConvPhase {
+    C99CONV_PHASE_PRESCAN,  /* looking for anything to convert */
+    C99CONV_PHASE_PARSE,    /* loading libclang and parsing */
+    C99CONV_PHASE_TOKENIZE, /* building the token table */
+    C99CONV_PHASE_WALK,     /* visiting the syntax tree */
+    C99CONV_PHASE_EMIT,     /* printing the converted source */
+    C99CONV_PHASE_CLEANUP,  /* releasing everything */
+    C99CONV_N_PHASES
+};
+
+/* the kinds of rewrites of compound literals and declarations */
+#define C99CONV_N_LITERAL_TYPES 6
+
+typedef struct C99ConvStats {
+    double wall[C99CONV_N_PHASES]; /* seconds */
+    double cpu[C99CONV_N_PHASES];  /* seconds on the converting thread */
+    unsigned long files;           /* conversions */
+    unsigned long passed_through;  /* sources copied after the pre-scan */
+    unsigned long long bytes_in, bytes_out;
+    unsigned long long tokens;
+    unsigned long long cursors;    /* visited in the syntax tree */
+    unsigned long clang_tokenize_calls;
+    unsigned long struct_array_lists; /* initializer lists */
+    unsigned long literals[C99CONV_N_LITERAL_TYPES];
+    unsigned long end_scopes;
+    unsigned long gap_fillers;     /* zeros emitted for missing initializers */
+} C99ConvStats;
+
+/* the statistics of all conversions with ctx so far */
+void c99conv_get_stats(const C99ConvContext *ctx, C99ConvStats *stats);
+
+/* add the statistics in add to sum */
+void c99conv_add_stats(C99ConvStats *sum, const C99ConvStats *add);
+
+/* print stats readably, or as one line of JSON */
+void c99conv_print_stats(FILE *f, const C99ConvStats *stats, int json);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* C99CONV_H */
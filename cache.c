@@ -0,0 +1,480 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#define getpid _getpid
+#define make_dir(path) _mkdir(path)
+#define utime _utime
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#define make_dir(path) mkdir(path, 0777)
+#endif
+
+#include "cache.h"
+
+// the cache shrinks to this share of its limit when cleaned
+#define CACHE_CLEAN_RATIO 0.9
+// leftovers of writers that died are removed after an hour
+#define CACHE_STALE_TMP_AGE 3600
+
+typedef struct Sha256 {
+    unsigned int state[8];
+    unsigned char buf[64];
+    unsigned long long len;
+} Sha256;
+
+static const unsigned int sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(Sha256 *s, const unsigned char *block)
+{
+    unsigned int w[64], v[8];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((unsigned int) block[4 * i] << 24) |
+               ((unsigned int) block[4 * i + 1] << 16) |
+               ((unsigned int) block[4 * i + 2] << 8) | block[4 * i + 3];
+    for (; i < 64; i++) {
+        unsigned int s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^
+                          (w[i - 15] >> 3);
+        unsigned int s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^
+                          (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(v, s->state, sizeof(v));
+    for (i = 0; i < 64; i++) {
+        unsigned int t1 = v[7] + (ROR32(v[4], 6) ^ ROR32(v[4], 11) ^
+                                  ROR32(v[4], 25)) +
+                          ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+        unsigned int t2 = (ROR32(v[0], 2) ^ ROR32(v[0], 13) ^
+                           ROR32(v[0], 22)) +
+                          ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(&v[1], &v[0], 7 * sizeof(*v));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (i = 0; i < 8; i++)
+        s->state[i] += v[i];
+}
+
+static void sha256_init(Sha256 *s)
+{
+    static const unsigned int init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(s->state, init, sizeof(init));
+    s->len = 0;
+}
+
+static void sha256_update(Sha256 *s, const void *data, size_t len)
+{
+    const unsigned char *ptr = (const unsigned char *) data;
+    unsigned used = (unsigned) (s->len & 63);
+
+    s->len += len;
+    if (used) {
+        unsigned n = 64 - used < len ? 64 - used : (unsigned) len;
+        memcpy(&s->buf[used], ptr, n);
+        ptr += n;
+        len -= n;
+        if (used + n < 64)
+            return;
+        sha256_block(s, s->buf);
+    }
+    for (; len >= 64; ptr += 64, len -= 64)
+        sha256_block(s, ptr);
+    memcpy(s->buf, ptr, len);
+}
+
+static void sha256_final(Sha256 *s, unsigned char digest[32])
+{
+    unsigned long long bits = s->len * 8;
+    unsigned char pad[72];
+    unsigned n = 64 - (unsigned) (s->len & 63), i;
+
+    // 0x80, zeroes, then the length, ending on a block boundary
+    if (n < 9)
+        n += 64;
+    memset(pad, 0, n);
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        pad[n - 1 - i] = (unsigned char) (bits >> (8 * i));
+    sha256_update(s, pad, n);
+
+    for (i = 0; i < 32; i++)
+        digest[i] = (unsigned char) (s->state[i / 4] >> (24 - 8 * (i & 3)));
+}
+
+void cache_key(const char *in, size_t len, const char *options,
+               const char *build_id, char key[CACHE_KEY_SIZE])
+{
+    static const char version[] = "c99conv cache 2";
+    unsigned char digest[32];
+    Sha256 s;
+    int i;
+
+    // each part is terminated, so that they can't run into each other
+    sha256_init(&s);
+    sha256_update(&s, version, sizeof(version));
+    sha256_update(&s, build_id, strlen(build_id) + 1);
+    sha256_update(&s, options, strlen(options) + 1);
+    sha256_update(&s, in, len);
+    sha256_final(&s, digest);
+
+    for (i = 0; i < 32; i++)
+        sprintf(&key[2 * i], "%02x", digest[i]);
+}
+
+int cache_open(Cache *cache)
+{
+    const char *dir = getenv(CACHE_DIR_ENV);
+    const char *size = getenv(CACHE_SIZE_ENV);
+    char path[sizeof(cache->dir) + 16];
+    unsigned long megs = CACHE_DEFAULT_SIZE;
+
+    if (!dir || !dir[0] || strlen(dir) >= sizeof(cache->dir))
+        return 1;
+    strcpy(cache->dir, dir);
+    if (size && size[0])
+        megs = strtoul(size, NULL, 10);
+    cache->max_size = (unsigned long long) megs << 20;
+
+    make_dir(cache->dir);
+    sprintf(path, "%s/stats", cache->dir);
+    make_dir(path);
+
+    return 0;
+}
+
+/* dir/ab/cdef... for key abcdef... */
+static void entry_path(const Cache *cache, const char *key, char *path)
+{
+    sprintf(path, "%s/%.2s/%s", cache->dir, key, key + 2);
+}
+
+/*
+ * Hits and misses are counted by appending a byte to a file per counter,
+ * which needs no locking between parallel c99wrap runs.
+ */
+static void count_stat(const Cache *cache, const char *name)
+{
+    char path[sizeof(cache->dir) + 32];
+    FILE *f;
+
+    sprintf(path, "%s/stats/%s", cache->dir, name);
+    f = fopen(path, "ab");
+    if (f) {
+        fputc('.', f);
+        fclose(f);
+    }
+}
+
+static unsigned long long read_stat(const Cache *cache, const char *name)
+{
+    char path[sizeof(cache->dir) + 32];
+    struct stat st;
+
+    sprintf(path, "%s/stats/%s", cache->dir, name);
+
+    return stat(path, &st) ? 0 : (unsigned long long) st.st_size;
+}
+
+static int copy_file(const char *from, const char *to)
+{
+    char buf[65536];
+    FILE *in, *out;
+    size_t n;
+    int res = 0;
+
+    in = fopen(from, "rb");
+    if (!in)
+        return 1;
+    out = fopen(to, "wb");
+    if (!out) {
+        fclose(in);
+        return 1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) {
+            res = 1;
+            break;
+        }
+    }
+    if (ferror(in))
+        res = 1;
+    fclose(in);
+    if (fclose(out))
+        res = 1;
+
+    return res;
+}
+
+int cache_get(const Cache *cache, const char *key, const char *outfile)
+{
+    char path[sizeof(cache->dir) + CACHE_KEY_SIZE + 8];
+
+    entry_path(cache, key, path);
+    if (copy_file(path, outfile)) {
+        count_stat(cache, "misses");
+        return 1;
+    }
+    // the modification time is the last use, for evicting old entries
+    utime(path, NULL);
+    count_stat(cache, "hits");
+
+    return 0;
+}
+
+typedef struct CacheEntry {
+    char *path;
+    unsigned long long size;
+    time_t mtime;
+} CacheEntry;
+
+typedef struct CacheEntryList {
+    CacheEntry *entries;
+    unsigned n_entries;
+    unsigned n_allocated_entries;
+    unsigned long long size;
+} CacheEntryList;
+
+/* list the entries in all of the cache's subdirectories */
+static int list_entries(const Cache *cache, CacheEntryList *list)
+{
+    char dir[sizeof(cache->dir) + 8];
+    int i;
+
+    memset(list, 0, sizeof(*list));
+    for (i = 0; i < 256; i++) {
+#ifdef _WIN32
+        WIN32_FIND_DATAA data;
+        HANDLE h;
+        char pattern[sizeof(dir) + 4];
+
+        sprintf(dir, "%s/%02x", cache->dir, i);
+        sprintf(pattern, "%s/*", dir);
+        h = FindFirstFileA(pattern, &data);
+        if (h == INVALID_HANDLE_VALUE)
+            continue;
+        do {
+            const char *name = data.cFileName;
+#else
+        DIR *d;
+        struct dirent *ent;
+
+        sprintf(dir, "%s/%02x", cache->dir, i);
+        d = opendir(dir);
+        if (!d)
+            continue;
+        while ((ent = readdir(d))) {
+            const char *name = ent->d_name;
+#endif
+            CacheEntry *e;
+            struct stat st;
+
+            if (!strcmp(name, ".") || !strcmp(name, ".."))
+                continue;
+            if (list->n_entries == list->n_allocated_entries) {
+                unsigned num = list->n_allocated_entries ?
+                               list->n_allocated_entries * 2 : 256;
+                void *mem = realloc(list->entries, sizeof(*e) * num);
+                if (!mem)
+                    break;
+                list->entries = (CacheEntry *) mem;
+                list->n_allocated_entries = num;
+            }
+            e = &list->entries[list->n_entries];
+            e->path = (char *) malloc(strlen(dir) + strlen(name) + 2);
+            if (!e->path)
+                break;
+            sprintf(e->path, "%s/%s", dir, name);
+            if (stat(e->path, &st)) {
+                free(e->path);
+                continue;
+            }
+            e->size = st.st_size;
+            e->mtime = st.st_mtime;
+            list->size += e->size;
+            list->n_entries++;
+#ifdef _WIN32
+        } while (FindNextFileA(h, &data));
+        FindClose(h);
+#else
+        }
+        closedir(d);
+#endif
+    }
+
+    return 0;
+}
+
+static void free_entries(CacheEntryList *list)
+{
+    unsigned n;
+
+    for (n = 0; n < list->n_entries; n++)
+        free(list->entries[n].path);
+    free(list->entries);
+}
+
+static int compare_entry_times(const void *a, const void *b)
+{
+    const CacheEntry *ea = (const CacheEntry *) a, *eb = (const CacheEntry *) b;
+
+    return ea->mtime < eb->mtime ? -1 : ea->mtime > eb->mtime;
+}
+
+static int is_tmp_entry(const CacheEntry *e)
+{
+    const char *name = strrchr(e->path, '/');
+
+    return name && name[1] == '.';
+}
+
+/* evict the least recently used entries until below the size limit */
+static void clean_cache(const Cache *cache)
+{
+    CacheEntryList list;
+    unsigned long long target = (unsigned long long)
+                                (cache->max_size * CACHE_CLEAN_RATIO);
+    time_t now = time(NULL);
+    unsigned n;
+
+    list_entries(cache, &list);
+    qsort(list.entries, list.n_entries, sizeof(*list.entries),
+          compare_entry_times);
+    for (n = 0; n < list.n_entries; n++) {
+        CacheEntry *e = &list.entries[n];
+
+        if (is_tmp_entry(e)) {
+            if (now - e->mtime > CACHE_STALE_TMP_AGE && !remove(e->path))
+                list.size -= e->size;
+        } else if (list.size > target && !remove(e->path)) {
+            list.size -= e->size;
+        }
+    }
+    free_entries(&list);
+}
+
+int cache_put(const Cache *cache, const char *key, const char *file)
+{
+    char path[sizeof(cache->dir) + CACHE_KEY_SIZE + 8];
+    char tmp[sizeof(cache->dir) + 64];
+    static unsigned cntr;
+    int res;
+
+    sprintf(tmp, "%s/%.2s", cache->dir, key);
+    make_dir(tmp);
+    sprintf(tmp, "%s/%.2s/.tmp.%d.%u", cache->dir, key, (int) getpid(),
+            cntr++);
+    entry_path(cache, key, path);
+
+    // readers only ever see complete entries
+    if (copy_file(file, tmp)) {
+        remove(tmp);
+        return 1;
+    }
+#ifdef _WIN32
+    res = !MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    res = rename(tmp, path);
+#endif
+    if (res) {
+        remove(tmp);
+        return 1;
+    }
+
+    // scanning the whole cache is slow, so only check its size now and then
+    if (!strncmp(key, "00", 2))
+        clean_cache(cache);
+
+    return 0;
+}
+
+void cache_print_stats(const Cache *cache, FILE *f)
+{
+    CacheEntryList list;
+    unsigned long long hits = read_stat(cache, "hits");
+    unsigned long long misses = read_stat(cache, "misses");
+    unsigned n, n_entries = 0;
+
+    list_entries(cache, &list);
+    for (n = 0; n < list.n_entries; n++)
+        n_entries += !is_tmp_entry(&list.entries[n]);
+
+    fprintf(f, "cache directory  %s\n", cache->dir);
+    fprintf(f, "hits             %llu\n", hits);
+    fprintf(f, "misses           %llu\n", misses);
+    fprintf(f, "hit rate         %.1f %%\n",
+            hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+    fprintf(f, "entries          %u\n", n_entries);
+    fprintf(f, "size             %.1f MB\n", list.size / 1048576.0);
+    fprintf(f, "size limit       %.1f MB\n", cache->max_size / 1048576.0);
+    free_entries(&list);
+}
+
+int cache_clear(const Cache *cache)
+{
+    char path[sizeof(cache->dir) + 32];
+    CacheEntryList list;
+    unsigned n;
+    int res = 0;
+
+    list_entries(cache, &list);
+    for (n = 0; n < list.n_entries; n++) {
+        if (remove(list.entries[n].path))
+            res = 1;
+    }
+    free_entries(&list);
+
+    sprintf(path, "%s/stats/hits", cache->dir);
+    remove(path);
+    sprintf(path, "%s/stats/misses", cache->dir);
+    remove(path);
+
+    return res;
+}
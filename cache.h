@@ -0,0 +1,61 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef C99CONV_CACHE_H
+#define C99CONV_CACHE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Cache of converted sources, shared by c99wrap and c99conv. Entries are
+ * keyed by a SHA-256 of the preprocessed input, the converter options and
+ * the build ID that c99conv --build-id reports, which covers both the
+ * converter and the libclang it loads, so a stale entry can never be hit.
+ *
+ * The cache is enabled by pointing $C99CONV_CACHE_DIR at a directory, and
+ * $C99CONV_CACHE_SIZE sets its size limit in megabytes.
+ */
+#define CACHE_DIR_ENV       "C99CONV_CACHE_DIR"
+#define CACHE_SIZE_ENV      "C99CONV_CACHE_SIZE"
+#define CACHE_DEFAULT_SIZE  1024 // MB
+
+#define CACHE_KEY_SIZE 65 // hex digest and terminator
+
+typedef struct Cache {
+    char dir[512];
+    unsigned long long max_size; // bytes
+} Cache;
+
+/* returns nonzero if the cache is disabled */
+int cache_open(Cache *cache);
+
+#define CACHE_BUILD_ID_SIZE 1024
+
+void cache_key(const char *in, size_t len, const char *options,
+               const char *build_id, char key[CACHE_KEY_SIZE]);
+
+/* copy the entry for key to outfile; returns nonzero on a miss */
+int cache_get(const Cache *cache, const char *key, const char *outfile);
+
+/* store the contents of file as the entry for key */
+int cache_put(const Cache *cache, const char *key, const char *file);
+
+void cache_print_stats(const Cache *cache, FILE *f);
+int cache_clear(const Cache *cache);
+
+#endif /* C99CONV_CACHE_H */
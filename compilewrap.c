@@ -18,15 +18,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #define getpid GetCurrentProcessId
 #else
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include "server.h"
 #endif
 
+#include "cache.h"
+#include "trace.h"
+
 #define CONVERTER "c99conv"
 
 static char* create_cmdline(char **argv)
@@ -124,6 +132,23 @@ static int exec_argv_out(char **argv, const char *out)
     }
 }
 #else
+/* Wait for pid to finish. Returns its exit code, or 128 + the signal that
+ * killed it, so that a crash never passes for success. */
+static int wait_exit_code(pid_t pid)
+{
+    int status;
+
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        return 1;
+    }
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 1;
+}
+
 static int exec_argv_out(char **argv, const char *out)
 {
     int fds[2];
@@ -161,11 +186,380 @@ static int exec_argv_out(char **argv, const char *out)
     }
     close(fds[0]);
     fclose(fp);
-    waitpid(pid, &ret, 0);
-    return WEXITSTATUS(ret);
+    return wait_exit_code(pid);
+}
+
+/* Run argv1 | argv2, i.e. with the output of the first piped to the second
+ * one, concurrently. Returns the exit code of the first command that
+ * failed. */
+static int exec_pipeline(char **argv1, char **argv2)
+{
+    int fds[2];
+    pid_t pid1, pid2;
+    int ret1 = 0, ret2 = 0;
+
+    if (pipe(fds)) {
+        perror("pipe");
+        return 1;
+    }
+
+    if (!(pid1 = fork())) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        if (execvp(argv1[0], argv1)) {
+            perror("execvp");
+            exit(1);
+        }
+    }
+    if (!(pid2 = fork())) {
+        close(fds[1]);
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        if (execvp(argv2[0], argv2)) {
+            perror("execvp");
+            exit(1);
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    if (pid1 < 0 || pid2 < 0) {
+        perror("fork");
+        if (pid1 > 0)
+            waitpid(pid1, NULL, 0);
+        if (pid2 > 0)
+            waitpid(pid2, NULL, 0);
+        return 1;
+    }
+
+    // if the converter crashes, the preprocessor dies of SIGPIPE
+    ret1 = wait_exit_code(pid1);
+    ret2 = wait_exit_code(pid2);
+    return ret1 ? ret1 : ret2;
+}
+
+/* Run argv, returning its output in *buf (to be freed) and *len. */
+static int exec_argv_capture(char **argv, char **buf, size_t *len)
+{
+    int fds[2];
+    pid_t pid;
+    int ret = 0;
+    size_t size = 0;
+
+    *buf = NULL;
+    *len = 0;
+    if (pipe(fds)) {
+        perror("pipe");
+        return 1;
+    }
+    if (!(pid = fork())) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        if (execvp(argv[0], argv)) {
+            perror("execvp");
+            exit(1);
+        }
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        return 1;
+    }
+    while (1) {
+        int n;
+        if (size - *len < 8192) {
+            char *mem;
+            size = size ? size * 2 : 65536;
+            mem = realloc(*buf, size);
+            if (!mem) {
+                fprintf(stderr, "Out of memory\n");
+                ret = 1;
+                break;
+            }
+            *buf = mem;
+        }
+        n = read(fds[0], *buf + *len, size - *len);
+        if (n <= 0)
+            break;
+        *len += n;
+    }
+    close(fds[0]);
+    if (ret) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+    return wait_exit_code(pid);
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    char *ptr = buf;
+
+    while (len) {
+        ssize_t n = read(fd, ptr, len);
+        if (n <= 0)
+            return 1;
+        ptr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *ptr = buf;
+
+    while (len) {
+        ssize_t n = write(fd, ptr, len);
+        if (n <= 0)
+            return 1;
+        ptr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Find the socket of a c99conv --server run by this user, if any. */
+static int find_server(struct sockaddr_un *addr)
+{
+    const char *env = getenv(SERVER_SOCKET_ENV);
+    struct stat st;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (env && env[0]) {
+        if (strlen(env) >= sizeof(addr->sun_path))
+            return 1;
+        strcpy(addr->sun_path, env);
+    } else {
+        snprintf(addr->sun_path, sizeof(addr->sun_path),
+                 SERVER_DEFAULT_SOCKET, (unsigned) getuid());
+    }
+
+    /* Don't hand our sources to a socket someone else created */
+    if (stat(addr->sun_path, &st) || !S_ISSOCK(st.st_mode) ||
+        st.st_uid != getuid())
+        return 1;
+    return 0;
+}
+
+/* Convert the preprocessed source in to out with the conversion server at
+ * addr. Returns -1 if the server couldn't do the conversion. */
+static int server_convert(const struct sockaddr_un *addr, const char *in,
+                          size_t len, int ms, const char *out)
+{
+    unsigned char header[SERVER_RESPONSE_SIZE];
+    char *res = NULL;
+    unsigned status, outlen, diaglen;
+    int fd, ret = -1;
+    FILE *fp;
+
+    if (len > SERVER_MAX_INPUT)
+        return -1;
+
+    signal(SIGPIPE, SIG_IGN);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        goto fail;
+    if (connect(fd, (const struct sockaddr *) addr, sizeof(*addr)))
+        goto fail;
+
+    put_u32(header, SERVER_MAGIC);
+    put_u32(header + 4, ms ? SERVER_FLAG_MS : 0);
+    put_u32(header + 8, len);
+    if (write_full(fd, header, SERVER_REQUEST_SIZE) ||
+        write_full(fd, in, len) ||
+        read_full(fd, header, SERVER_RESPONSE_SIZE))
+        goto fail;
+    status  = get_u32(header);
+    outlen  = get_u32(header + 4);
+    diaglen = get_u32(header + 8);
+    res = malloc(outlen + diaglen + 1);
+    if (!res || read_full(fd, res, outlen + diaglen))
+        goto fail;
+
+    fwrite(res + outlen, 1, diaglen, stderr);
+    if (status) {
+        ret = 1;
+        goto fail;
+    }
+    fp = fopen(out, "wb");
+    if (!fp) {
+        perror(out);
+        ret = 1;
+        goto fail;
+    }
+    if (fwrite(res, 1, outlen, fp) != outlen) {
+        perror(out);
+        ret = 1;
+    } else {
+        ret = 0;
+    }
+    if (fclose(fp))
+        ret = 1;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    free(res);
+    return ret;
+}
+
+/* Preprocess and convert to out with a conversion server. Returns -1 if
+ * no server could do the conversion, so that the caller can run the
+ * converter itself instead. */
+static int convert_with_server(char **cpp_argv, int ms, const char *out,
+                               const Trace *trace)
+{
+    struct sockaddr_un addr;
+    char *in;
+    size_t len;
+    double start;
+    int ret;
+
+    if (find_server(&addr))
+        return -1;
+
+    start = trace_now();
+    ret = exec_argv_capture(cpp_argv, &in, &len);
+    trace_event(trace, "preprocess", start, ret, NULL);
+    if (!ret) {
+        start = trace_now();
+        ret = server_convert(&addr, in, len, ms, out);
+        trace_event(trace, "convert", start, ret, "server");
+    }
+    free(in);
+    return ret;
+}
+#endif
+
+static int read_file(const char *path, char **buf, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    size_t size = 0;
+
+    *buf = NULL;
+    *len = 0;
+    if (!fp) {
+        perror(path);
+        return 1;
+    }
+    while (1) {
+        size_t n;
+        if (size - *len < 8192) {
+            char *mem;
+            size = size ? size * 2 : 65536;
+            mem = realloc(*buf, size);
+            if (!mem) {
+                fprintf(stderr, "Out of memory\n");
+                fclose(fp);
+                return 1;
+            }
+            *buf = mem;
+        }
+        n = fread(*buf + *len, 1, size - *len, fp);
+        if (!n)
+            break;
+        *len += n;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* Ask the converter for its build ID, using temp_file for its output on
+ * Windows. Returns nonzero if it has none, which leaves the cache unused. */
+static int get_build_id(char *conv_tool, const char *temp_file,
+                        char build_id[CACHE_BUILD_ID_SIZE])
+{
+    char *argv[3];
+    char *out = NULL;
+    size_t len = 0;
+    int ret;
+
+    argv[0] = conv_tool;
+    argv[1] = "--build-id";
+    argv[2] = NULL;
+#ifdef _WIN32
+    ret = exec_argv_out(argv, temp_file);
+    if (!ret)
+        ret = read_file(temp_file, &out, &len);
+    unlink(temp_file);
+#else
+    ret = exec_argv_capture(argv, &out, &len);
+#endif
+    while (len && (out[len - 1] == '\n' || out[len - 1] == '\r'))
+        len--;
+    if (!ret && (!len || len >= CACHE_BUILD_ID_SIZE))
+        ret = 1;
+    if (!ret) {
+        memcpy(build_id, out, len);
+        build_id[len] = '\0';
+    }
+    free(out);
+    return ret;
 }
+
+/* Preprocess to temp_file_1 and convert it to temp_file_2, through the
+ * conversion cache. On a miss, the converted source is added to it. */
+static int convert_cached(const Cache *cache, char **cpp_argv,
+                          char **conv_argv, int conv_argc,
+                          const char *convert_options, const char *build_id,
+                          char *temp_file_1, char *temp_file_2,
+                          const Trace *trace)
+{
+    char key[CACHE_KEY_SIZE];
+    char *in;
+    size_t len;
+    double start;
+    int exit_code;
+    const char *via = "c99conv";
+#ifndef _WIN32
+    struct sockaddr_un addr;
 #endif
 
+    start = trace_now();
+    exit_code = exec_argv_out(cpp_argv, temp_file_1);
+    trace_event(trace, "preprocess", start, exit_code, NULL);
+    if (exit_code)
+        return exit_code;
+
+    start = trace_now();
+    if (read_file(temp_file_1, &in, &len))
+        return 1;
+    cache_key(in, len, convert_options, build_id, key);
+    if (!cache_get(cache, key, temp_file_2)) {
+        free(in);
+        trace_event(trace, "convert", start, 0, "cache");
+        return 0;
+    }
+
+    exit_code = -1;
+#ifndef _WIN32
+    if (!find_server(&addr)) {
+        exit_code = server_convert(&addr, in, len, convert_options[0] != '\0',
+                                   temp_file_2);
+        via = "server";
+    }
+#endif
+    free(in);
+    if (exit_code < 0) {
+        conv_argv[conv_argc++] = temp_file_1;
+        conv_argv[conv_argc++] = temp_file_2;
+        conv_argv[conv_argc++] = NULL;
+
+        exit_code = exec_argv_out(conv_argv, NULL);
+        via = "c99conv";
+    }
+    if (!exit_code)
+        cache_put(cache, key, temp_file_2);
+    trace_event(trace, "convert", start, exit_code, via);
+    return exit_code;
+}
+
 int main(int argc, char *argv[])
 {
     int i = 1;
@@ -178,9 +572,14 @@ int main(int argc, char *argv[])
          fi_buffer[200];
     char **cpp_argv, **cc_argv, **pass_argv;
     char *conv_argv[5], *conv_tool;
+    int conv_argc = 0;
     const char *source_file = NULL;
     const char *outname = NULL;
     char convert_options[20] = "";
+    Cache cache;
+    char build_id[CACHE_BUILD_ID_SIZE];
+    Trace trace;
+    double start, wrap_start = 0;
 
     conv_tool = malloc(strlen(argv[0]) + strlen(CONVERTER) + 1);
     strcpy(conv_tool, argv[0]);
@@ -348,7 +747,74 @@ int main(int argc, char *argv[])
         goto exit;
     }
 
+    conv_argv[conv_argc++] = conv_tool;
+    if (convert_options[0])
+        conv_argv[conv_argc++] = convert_options;
+
+    trace_open(&trace, source_file, outname);
+    wrap_start = trace_now();
+
+    if (!cache_open(&cache) &&
+        !get_build_id(conv_tool, temp_file_1, build_id)) {
+        exit_code = convert_cached(&cache, cpp_argv, conv_argv, conv_argc,
+                                   convert_options, build_id, temp_file_1,
+                                   temp_file_2, &trace);
+        if (!keep)
+            unlink(temp_file_1);
+        if (exit_code) {
+            if (!keep)
+                unlink(temp_file_2);
+            goto exit;
+        }
+
+        start = trace_now();
+        exit_code = exec_argv_out(cc_argv, NULL);
+        trace_event(&trace, "compile", start, exit_code, NULL);
+        if (!keep)
+            unlink(temp_file_2);
+
+        goto exit;
+    }
+
+#ifndef _WIN32
+    if (!keep) {
+        /* Use a running c99conv --server if there is one, which saves
+         * starting the converter and setting up libclang. */
+        exit_code = convert_with_server(cpp_argv, convert_options[0] != '\0',
+                                        temp_file_2, &trace);
+
+        /* Otherwise feed the preprocessor output straight into the
+         * converter, so that they run concurrently and the preprocessed
+         * source never hits the disk. With -keep, the preprocessed file
+         * is written out as before. */
+        if (exit_code < 0) {
+            conv_argv[conv_argc++] = "-";
+            conv_argv[conv_argc++] = temp_file_2;
+            conv_argv[conv_argc++] = NULL;
+
+            // the two stages overlap, so they're traced as one
+            start = trace_now();
+            exit_code = exec_pipeline(cpp_argv, conv_argv);
+            trace_event(&trace, "preprocess+convert", start, exit_code,
+                        "pipe");
+        }
+        if (exit_code) {
+            unlink(temp_file_2);
+            goto exit;
+        }
+
+        start = trace_now();
+        exit_code = exec_argv_out(cc_argv, NULL);
+        trace_event(&trace, "compile", start, exit_code, NULL);
+        unlink(temp_file_2);
+
+        goto exit;
+    }
+#endif
+
+    start = trace_now();
     exit_code = exec_argv_out(cpp_argv, temp_file_1);
+    trace_event(&trace, "preprocess", start, exit_code, NULL);
     if (exit_code) {
         if (!keep)
             unlink(temp_file_1);
@@ -356,13 +822,13 @@ int main(int argc, char *argv[])
         goto exit;
     }
 
-    conv_argv[0] = conv_tool;
-    conv_argv[1] = convert_options;
-    conv_argv[2] = temp_file_1;
-    conv_argv[3] = temp_file_2;
-    conv_argv[4] = NULL;
+    conv_argv[conv_argc++] = temp_file_1;
+    conv_argv[conv_argc++] = temp_file_2;
+    conv_argv[conv_argc++] = NULL;
 
+    start = trace_now();
     exit_code = exec_argv_out(conv_argv, NULL);
+    trace_event(&trace, "convert", start, exit_code, "c99conv");
     if (exit_code) {
         if (!keep) {
             unlink(temp_file_1);
@@ -375,12 +841,16 @@ int main(int argc, char *argv[])
     if (!keep)
         unlink(temp_file_1);
 
+    start = trace_now();
     exit_code = exec_argv_out(cc_argv, NULL);
+    trace_event(&trace, "compile", start, exit_code, NULL);
 
     if (!keep)
         unlink(temp_file_2);
 
 exit:
+    if (wrap_start) // not traced if just passed through
+        trace_event(&trace, "c99wrap", wrap_start, exit_code, NULL);
     free(cc_argv);
     free(cpp_argv);
     free(pass_argv);
@@ -17,17 +17,36 @@
  * limitations under the License.
  */
 
-#include <assert.h>
+#include <limits.h>
 #include <stdio.h>
-#include <clang-c/Index.h>
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <setjmp.h>
+
+#include "c99conv.h"
+#include "lex.h"
+#include "libclang.h"
+#include "prescan.h"
+#include "stats.h"
 
 #ifdef _MSC_VER
 #define strtoll _strtoi64
+#define THREAD_LOCAL __declspec(thread)
+#define NORETURN __declspec(noreturn)
+#else
+#define THREAD_LOCAL __thread
+#define NORETURN __attribute__((noreturn))
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
 #endif
 
+/* abort the current conversion, after printing an error message */
+static NORETURN void fail(void);
+
 /*
  * The basic idea of the token parser is to "stack" ordered tokens
  * (i.e. ordering is done by libclang) in such a way that we can
@@ -114,9 +133,6 @@ typedef struct {
     CXCursor cursor;
     int is_union;
 } StructDeclaration;
-static StructDeclaration *structs = NULL;
-static unsigned n_structs = 0;
-static unsigned n_allocated_structs = 0;
 
 typedef struct {
     char *name;
@@ -131,9 +147,6 @@ typedef struct {
     char *name;
     CXCursor cursor;
 } EnumDeclaration;
-static EnumDeclaration *enums = NULL;
-static unsigned n_enums = 0;
-static unsigned n_allocated_enums = 0;
 
 /* FIXME we're not taking pointers or array sizes into account here,
  * in large part because Libav doesn't use those in combination with
@@ -145,9 +158,142 @@ typedef struct {
     unsigned enum_decl_idx;
     CXCursor cursor;
 } TypedefDeclaration;
-static TypedefDeclaration *typedefs = NULL;
-static unsigned n_typedefs = 0;
-static unsigned n_allocated_typedefs = 0;
+
+/*
+ * Open-addressing hash index from a name (or cursor) to an index in one
+ * of the arrays above. For names, 'scope' is part of the key, so that
+ * e.g. members of different structs can share one index. If a name is
+ * registered twice, the first registration wins, like it did for the
+ * linear scans these replace. Cursor entries have no name; since two
+ * cursors can share a hash, callers confirm a match themselves.
+ */
+typedef struct {
+    const char *name;
+    unsigned hash;
+    unsigned scope;
+    unsigned idx; // (unsigned) -1 if the slot is empty
+    unsigned sub;
+} HashEntry;
+
+typedef struct {
+    HashEntry *entries;
+    unsigned n_entries;
+    unsigned n_allocated_entries; // 0 or a power of two
+} HashIndex;
+
+static unsigned hash_name(const char *name, unsigned scope)
+{
+    // FNV-1a
+    unsigned hash = 2166136261U ^ scope;
+
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char) *name) * 16777619U;
+
+    return hash;
+}
+
+static void grow_hash_index(HashIndex *h)
+{
+    unsigned num = h->n_allocated_entries ? h->n_allocated_entries * 2 : 64;
+    unsigned n, pos;
+    HashEntry *mem = (HashEntry *) malloc(sizeof(*mem) * num);
+
+    if (!mem) {
+        fprintf(stderr, "Out of memory while growing hash index\n");
+        fail();
+    }
+    for (n = 0; n < num; n++)
+        mem[n].idx = (unsigned) -1;
+
+    for (n = 0; n < h->n_allocated_entries; n++) {
+        if (h->entries[n].idx == (unsigned) -1)
+            continue;
+        for (pos = h->entries[n].hash & (num - 1);
+             mem[pos].idx != (unsigned) -1; pos = (pos + 1) & (num - 1));
+        mem[pos] = h->entries[n];
+    }
+
+    free(h->entries);
+    h->entries = mem;
+    h->n_allocated_entries = num;
+}
+
+/*
+ * Iterate over all entries with the given hash. Set *pos to (unsigned) -1
+ * to start; returns NULL once there are no more entries.
+ */
+static HashEntry *probe_hash_index(HashIndex *h, unsigned hash, unsigned *pos)
+{
+    unsigned mask = h->n_allocated_entries - 1;
+
+    if (!h->n_allocated_entries)
+        return NULL;
+
+    *pos = *pos == (unsigned) -1 ? hash & mask : (*pos + 1) & mask;
+    for (; h->entries[*pos].idx != (unsigned) -1; *pos = (*pos + 1) & mask) {
+        if (h->entries[*pos].hash == hash)
+            return &h->entries[*pos];
+    }
+
+    return NULL;
+}
+
+static HashEntry *find_hash_entry(HashIndex *h, const char *name,
+                                  unsigned scope)
+{
+    unsigned hash = hash_name(name, scope), pos = (unsigned) -1;
+    HashEntry *e;
+
+    while ((e = probe_hash_index(h, hash, &pos))) {
+        if (e->scope == scope &&
+            (e->name == name || !strcmp(e->name, name)))
+            return e;
+    }
+
+    return NULL;
+}
+
+static void add_hash_entry(HashIndex *h, const char *name, unsigned hash,
+                           unsigned scope, unsigned idx, unsigned sub)
+{
+    unsigned pos, mask;
+
+    if (name && find_hash_entry(h, name, scope))
+        return;
+
+    if ((h->n_entries + 1) * 4 > h->n_allocated_entries * 3)
+        grow_hash_index(h);
+
+    mask = h->n_allocated_entries - 1;
+    for (pos = hash & mask; h->entries[pos].idx != (unsigned) -1;
+         pos = (pos + 1) & mask);
+    h->entries[pos].name  = name;
+    h->entries[pos].hash  = hash;
+    h->entries[pos].scope = scope;
+    h->entries[pos].idx   = idx;
+    h->entries[pos].sub   = sub;
+    h->n_entries++;
+}
+
+static void add_name_to_hash_index(HashIndex *h, const char *name,
+                                   unsigned scope, unsigned idx, unsigned sub)
+{
+    add_hash_entry(h, name, hash_name(name, scope), scope, idx, sub);
+}
+
+static unsigned find_idx_by_name(HashIndex *h, const char *name,
+                                 unsigned scope)
+{
+    HashEntry *e = find_hash_entry(h, name, scope);
+
+    return e ? e->idx : (unsigned) -1;
+}
+
+static void free_hash_index(HashIndex *h)
+{
+    free(h->entries);
+    memset(h, 0, sizeof(*h));
+}
 
 enum StructArrayType {
     TYPE_IRRELEVANT = 0,
@@ -175,75 +321,665 @@ typedef struct {
     int convert_to_assignment;
     char *name;
 } StructArrayList;
-static StructArrayList *struct_array_lists = NULL;
-static unsigned n_struct_array_lists = 0;
-static unsigned n_allocated_struct_array_lists = 0;
 
 typedef struct {
     int end;
     int n_scopes;
 } EndScope;
-static EndScope *end_scopes = NULL;
-static unsigned n_end_scopes = 0;
-static unsigned n_allocated_end_scopes = 0;
 
-static FILE *out;
+/*
+ * Output sink. The emitter writes small pieces (tokens, single spaces and
+ * newlines), so these are collected in a buffer. If the sink has a file,
+ * the buffer is written out whenever it fills up; otherwise, it grows to
+ * hold the whole output in memory.
+ */
+typedef struct {
+    char *buf;
+    size_t len, size;
+    FILE *file;
+    size_t written; // in total, including what was flushed
+} OutputSink;
+
+#define SINK_BUFFER_SIZE (64 * 1024)
+
+static void flush_sink(OutputSink *sink)
+{
+    if (sink->file && sink->len) {
+        if (fwrite(sink->buf, 1, sink->len, sink->file) != sink->len) {
+            fprintf(stderr, "Failed to write output\n");
+            fail();
+        }
+        sink->len = 0;
+    }
+}
+
+static void reserve_sink(OutputSink *sink, size_t len)
+{
+    if (sink->size - sink->len >= len)
+        return;
+
+    flush_sink(sink);
+    if (sink->size - sink->len < len) {
+        size_t num = sink->size ? sink->size : SINK_BUFFER_SIZE;
+        void *mem;
+
+        while (num - sink->len < len)
+            num *= 2;
+        mem = realloc(sink->buf, num);
+        if (!mem) {
+            fprintf(stderr, "Out of memory while writing output\n");
+            fail();
+        }
+        sink->buf = (char *) mem;
+        sink->size = num;
+    }
+}
+
+static void write_sink(OutputSink *sink, const char *str, size_t len)
+{
+    sink->written += len;
+    if (sink->file && len >= SINK_BUFFER_SIZE) {
+        // large spans go straight to the file
+        flush_sink(sink);
+        if (fwrite(str, 1, len, sink->file) != len) {
+            fprintf(stderr, "Failed to write output\n");
+            fail();
+        }
+        return;
+    }
+
+    reserve_sink(sink, len);
+    memcpy(&sink->buf[sink->len], str, len);
+    sink->len += len;
+}
+
+static void fill_sink(OutputSink *sink, char c, size_t n)
+{
+    sink->written += n;
+    reserve_sink(sink, n);
+    memset(&sink->buf[sink->len], c, n);
+    sink->len += n;
+}
+
+/*
+ * Names, types and other strings live as long as the conversion, so they
+ * are allocated from an arena and released all at once in cleanup().
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    size_t size, used;
+} ArenaBlock;
+
+/*
+ * Grow a dynamic array geometrically, so that appending n elements costs
+ * O(n) copying in total. Returns NULL (leaving the array untouched) if out
+ * of memory.
+ */
+static void *grow_array(void *array, unsigned *n_allocated, size_t size)
+{
+    unsigned num = *n_allocated ? *n_allocated * 2 : 16;
+    void *mem = realloc(array, size * num);
+
+    if (mem)
+        *n_allocated = num;
+
+    return mem;
+}
+
+/*
+ * Contents of the input file. Unchanged stretches of tokens are copied
+ * from here verbatim; if the file can't be read, everything is printed
+ * token by token instead.
+ */
+typedef struct {
+    char *buf;
+    size_t size;
+} SourceBuffer;
+
+/* read f until EOF; source->buf is NULL on errors */
+static void read_source(FILE *f, SourceBuffer *source)
+{
+    size_t n_allocated = 0;
+
+    memset(source, 0, sizeof(*source));
+    for (;;) {
+        size_t n;
+
+        if (source->size == n_allocated) {
+            size_t num = n_allocated ? n_allocated * 2 : 64 * 1024;
+            void *mem = realloc(source->buf, num);
+            if (!mem) {
+                fprintf(stderr, "Out of memory while reading input\n");
+                free(source->buf);
+                memset(source, 0, sizeof(*source));
+                return;
+            }
+            source->buf = (char *) mem;
+            n_allocated = num;
+        }
+        n = fread(&source->buf[source->size], 1,
+                  n_allocated - source->size, f);
+        source->size += n;
+        if (n == 0)
+            break;
+    }
+    if (ferror(f)) {
+        free(source->buf);
+        memset(source, 0, sizeof(*source));
+    }
+}
+
+/*
+ * Trace output for debugging the converter, selected with --trace=<level>.
+ * Each level includes the ones below it. When tracing is off, nothing is
+ * computed just to be traced.
+ */
+enum TraceLevel {
+    TRACE_NONE     = 0,
+    TRACE_REGISTRY = 1, // dump all registered declarations and edits
+    TRACE_CURSORS  = 2, // every visited cursor
+    TRACE_TOKENS   = 3, // every token of every visited cursor
+};
+
+#define trace(level, ...) \
+    do { \
+        if (ctx->trace_level >= (level)) \
+            fprintf(stderr, __VA_ARGS__); \
+    } while (0)
+
+/*
+ * Flat token table. Spelling and location of each token are queried from
+ * libclang exactly once, when the table is built; all helpers below read
+ * from the table instead of going back to libclang for every lookup.
+ *
+ * Spellings are interned, so two tokens with the same spelling share the
+ * same pointer, and each token is classified into an atom so that checks
+ * for punctuation and the few keywords we care about are integer compares.
+ */
+enum TokenAtom {
+    ATOM_OTHER = 0, // identifiers, literals and anything not listed below
+    ATOM_SEMICOLON,
+    ATOM_COMMA,
+    ATOM_DOT,
+    ATOM_COLON,
+    ATOM_EQUAL,
+    ATOM_PLUS,
+    ATOM_MINUS,
+    ATOM_STAR,
+    ATOM_SLASH,
+    ATOM_LPAREN,
+    ATOM_RPAREN,
+    ATOM_LBRACKET,
+    ATOM_RBRACKET,
+    ATOM_LBRACE,
+    ATOM_RBRACE,
+    ATOM_STRUCT,
+    ATOM_CONST,
+    ATOM_DOUBLE,
+};
+
+typedef struct {
+    const char *spelling;
+    unsigned len;
+    unsigned offset;
+    unsigned line, col; // 0-based, unlike clang
+    enum TokenAtom atom;
+} Token;
+
+typedef struct {
+    Token *tokens;
+    unsigned n_tokens;
+    char *strings; // backing storage for all spellings
+    HashIndex interned; // spelling -> its copy in strings
+} TokenTable;
+
+/*
+ * All state of a conversion. Converter code refers to the context of the
+ * conversion running on the current thread through ctx, which is set up
+ * by the c99conv_convert_*() entry points.
+ */
+struct C99ConvContext {
+    StructDeclaration *structs;
+    unsigned n_structs;
+    unsigned n_allocated_structs;
+    EnumDeclaration *enums;
+    unsigned n_enums;
+    unsigned n_allocated_enums;
+    TypedefDeclaration *typedefs;
+    unsigned n_typedefs;
+    unsigned n_allocated_typedefs;
+    HashIndex struct_names, struct_cursors, struct_members;
+    HashIndex enum_names, enum_cursors, enum_values;
+    HashIndex typedef_names;
+
+    StructArrayList *struct_array_lists;
+    unsigned n_struct_array_lists;
+    unsigned n_allocated_struct_array_lists;
+    EndScope *end_scopes;
+    unsigned n_end_scopes;
+    unsigned n_allocated_end_scopes;
+    struct CompoundLiteralList *comp_literal_lists;
+    unsigned n_comp_literal_lists;
+    unsigned n_allocated_comp_literal_lists;
+    struct EditEvent *edit_events;
+    unsigned n_edit_events;
+    unsigned n_allocated_edit_events;
+    unsigned unique_cntr;
+
+    ArenaBlock *arena;
+    size_t arena_block_size;
+
+    CXIndex index; // kept across conversions
+    CXTranslationUnit TU;
+    CXFile tu_file;
+    TokenTable tu_tokens; // the translation unit's tokens, sorted by offset
+    SourceBuffer src;
+    OutputSink out;
+
+    enum TraceLevel trace_level;
+    jmp_buf *error; // where fail() jumps to, see visit_children()
+    int failed;
+
+    C99ConvStats stats; // kept across conversions, like the index
+};
+
+static THREAD_LOCAL C99ConvContext *ctx;
+
+static NORETURN void fail(void)
+{
+    ctx->failed = 1;
+    longjmp(*ctx->error, 1);
+}
+
+/* fail() with a message unless an assumption about the input holds */
+#define CHECK_INPUT(cond) \
+    do { if (!(cond)) unsupported_input(#cond, __LINE__); } while (0)
+
+static NORETURN void unsupported_input(const char *cond, int line)
+{
+    fprintf(stderr, "Unsupported input, %s doesn't hold (convert.c:%d)\n",
+            cond, line);
+    fail();
+}
+
+typedef struct GuardedVisit {
+    CXCursorVisitor visitor;
+    CXClientData client_data;
+} GuardedVisit;
+
+/*
+ * fail() must not jump across the libclang frames between a visitor and
+ * the clang_visitChildren() that called it, so each visitor runs with a
+ * jump target of its own. A failure there stops the visit, and
+ * visit_children() fails again once clang_visitChildren() has returned.
+ */
+static enum CXChildVisitResult guarded_visit(CXCursor cursor, CXCursor parent,
+                                             CXClientData client_data)
+{
+    GuardedVisit *g = (GuardedVisit *) client_data;
+    jmp_buf *outer = ctx->error;
+    jmp_buf error;
+    enum CXChildVisitResult res;
+
+    if (setjmp(error)) {
+        ctx->error = outer;
+        return CXChildVisit_Break;
+    }
+    ctx->error = &error;
+    res = g->visitor(cursor, parent, g->client_data);
+    ctx->error = outer;
+
+    return res;
+}
+
+static void visit_children(CXCursor cursor, CXCursorVisitor visitor,
+                           CXClientData client_data)
+{
+    GuardedVisit g;
+
+    g.visitor = visitor;
+    g.client_data = client_data;
+    clang_visitChildren(cursor, guarded_visit, &g);
+    if (ctx->failed)
+        fail();
+}
+
+static void *arena_alloc(size_t size)
+{
+    char *ptr;
+
+    size = (size + 7) & ~(size_t) 7;
+    if (!ctx->arena || ctx->arena->size - ctx->arena->used < size) {
+        size_t num = ctx->arena_block_size;
+        ArenaBlock *block;
+
+        while (num < size)
+            num *= 2;
+        block = (ArenaBlock *) malloc(sizeof(*block) + num);
+        if (!block) {
+            fprintf(stderr, "Out of memory\n");
+            fail();
+        }
+        block->prev = ctx->arena;
+        block->size = num;
+        block->used = 0;
+        ctx->arena = block;
+        ctx->arena_block_size = num * 2;
+    }
+
+    ptr = (char *) (ctx->arena + 1) + ctx->arena->used;
+    ctx->arena->used += size;
+
+    return ptr;
+}
+
+static char *arena_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    return (char *) memcpy(arena_alloc(len), str, len);
+}
+
+static void free_arena(void)
+{
+    while (ctx->arena) {
+        ArenaBlock *prev = ctx->arena->prev;
+        free(ctx->arena);
+        ctx->arena = prev;
+    }
+    ctx->arena_block_size = 4096;
+}
+
+static enum TokenAtom classify_token(const char *str, unsigned len)
+{
+    static const char punctuators[] = ";,.:=+-*/()[]{}";
+    static const struct {
+        const char *str;
+        enum TokenAtom atom;
+    } keywords[] = {
+        { "struct", ATOM_STRUCT },
+        { "const",  ATOM_CONST  },
+        { "double", ATOM_DOUBLE },
+    };
+    unsigned n;
+
+    if (len == 1) {
+        const char *p = strchr(punctuators, str[0]);
+        return p && str[0] ? (enum TokenAtom) (ATOM_SEMICOLON +
+                                               (p - punctuators)) : ATOM_OTHER;
+    }
+    for (n = 0; n < sizeof(keywords) / sizeof(keywords[0]); n++) {
+        if (!strcmp(str, keywords[n].str))
+            return keywords[n].atom;
+    }
+
+    return ATOM_OTHER;
+}
+
+/*
+ * Make spelling, which is NUL-terminated and t->len characters long, the
+ * spelling of t. Unless an identical one is interned already, it's copied
+ * to str, where it may be already. Returns where the next copy goes.
+ */
+static char *intern_spelling(TokenTable *table, unsigned n,
+                             const char *spelling, char *str)
+{
+    Token *t = &table->tokens[n];
+    HashEntry *e = find_hash_entry(&table->interned, spelling, 0);
+
+    if (e) {
+        t->spelling = e->name;
+    } else {
+        if (spelling != str)
+            memcpy(str, spelling, t->len + 1);
+        t->spelling = str;
+        add_name_to_hash_index(&table->interned, str, 0, n, 0);
+        str += t->len + 1;
+    }
+    t->atom = classify_token(t->spelling, t->len);
+
+    return str;
+}
+
+static void build_token_table(CXSourceRange range, TokenTable *table)
+{
+    CXToken *cxtokens = NULL;
+    CXString *spellings;
+    unsigned n, n_tokens = 0;
+    size_t size = 0;
+    char *str;
+
+    clang_tokenize(ctx->TU, range, &cxtokens, &n_tokens);
+    ctx->stats.clang_tokenize_calls++;
+    table->n_tokens = n_tokens;
+    table->tokens = (Token *) malloc(sizeof(*table->tokens) * (n_tokens + 1));
+    spellings = (CXString *) malloc(sizeof(*spellings) * (n_tokens + 1));
+    if (!table->tokens || !spellings) {
+        fprintf(stderr, "Out of memory while building token table\n");
+        fail();
+    }
+
+    for (n = 0; n < n_tokens; n++) {
+        Token *t = &table->tokens[n];
+        CXSourceLocation l = clang_getTokenLocation(ctx->TU, cxtokens[n]);
+        CXFile file;
+
+        spellings[n] = clang_getTokenSpelling(ctx->TU, cxtokens[n]);
+        t->len = strlen(clang_getCString(spellings[n]));
+        clang_getSpellingLocation(l, &file, &t->line, &t->col, &t->offset);
+        // clang starts counting at 1 for some reason
+        t->line--;
+        t->col--;
+        size += t->len + 1;
+    }
+
+    str = table->strings = (char *) malloc(size + 1);
+    if (!str) {
+        fprintf(stderr, "Out of memory while building token table\n");
+        fail();
+    }
+    memset(&table->interned, 0, sizeof(table->interned));
+    for (n = 0; n < n_tokens; n++) {
+        str = intern_spelling(table, n, clang_getCString(spellings[n]), str);
+        clang_disposeString(spellings[n]);
+    }
+
+    free(spellings);
+    clang_disposeTokens(ctx->TU, cxtokens, n_tokens);
+}
+
+/*
+ * Build the token table of src with the native lexer, which gives the same
+ * tokens as clang_tokenize() in a fraction of the time.
+ */
+static void lex_token_table(const SourceBuffer *src, int ms_compat,
+                            TokenTable *table)
+{
+    LexToken *lexed = NULL;
+    unsigned n, n_tokens = 0, n_allocated = 0;
+    size_t size = 0;
+    Lexer l;
+    char *str;
+
+    init_lexer(&l, src->buf, src->size, ms_compat);
+    for (;;) {
+        if (n_tokens == n_allocated) {
+            void *mem = grow_array(lexed, &n_allocated, sizeof(*lexed));
+            if (!mem) {
+                free(lexed);
+                fprintf(stderr, "Out of memory while building token table\n");
+                fail();
+            }
+            lexed = (LexToken *) mem;
+        }
+        if (!lex_token(&l, &lexed[n_tokens]))
+            break;
+        size += lexed[n_tokens++].size + 1;
+    }
+
+    table->n_tokens = n_tokens;
+    table->tokens = (Token *) malloc(sizeof(*table->tokens) * (n_tokens + 1));
+    str = table->strings = (char *) malloc(size + 1);
+    if (!table->tokens || !str) {
+        free(lexed);
+        fprintf(stderr, "Out of memory while building token table\n");
+        fail();
+    }
+    memset(&table->interned, 0, sizeof(table->interned));
+    for (n = 0; n < n_tokens; n++) {
+        Token *t = &table->tokens[n];
+
+        t->offset = lexed[n].offset;
+        t->line = lexed[n].line;
+        t->col = lexed[n].col;
+        str[get_token_spelling(&l, &lexed[n], str)] = '\0';
+        // clang's spellings end at a NUL in the token too
+        t->len = strlen(str);
+        str = intern_spelling(table, n, str, str);
+    }
+
+    free(lexed);
+}
+
+/* returns 1 and reports the first difference if the tables differ */
+static int compare_token_tables(const TokenTable *lexed,
+                                const TokenTable *clang, const char *filename)
+{
+    unsigned n;
+
+    for (n = 0; n < lexed->n_tokens && n < clang->n_tokens; n++) {
+        const Token *a = &lexed->tokens[n], *b = &clang->tokens[n];
+
+        if (a->offset != b->offset || a->len != b->len ||
+            a->line != b->line || a->col != b->col ||
+            strcmp(a->spelling, b->spelling)) {
+            fprintf(stderr, "%s:%u:%u: lexer token %u is '%s', clang's is "
+                    "'%s' at %u:%u\n", filename, a->line + 1, a->col + 1, n,
+                    a->spelling, b->spelling, b->line + 1, b->col + 1);
+            return 1;
+        }
+    }
+    if (lexed->n_tokens != clang->n_tokens) {
+        fprintf(stderr, "%s: lexer found %u tokens, clang %u\n", filename,
+                lexed->n_tokens, clang->n_tokens);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void free_token_table(TokenTable *table)
+{
+    free(table->tokens);
+    free(table->strings);
+    free_hash_index(&table->interned);
+}
+
+/*
+ * Returns the interned copy of str, or NULL if no token is spelled like
+ * that. Token spellings can be compared against the result by pointer.
+ */
+static const char *find_interned_spelling(const char *str)
+{
+    HashEntry *e = find_hash_entry(&ctx->tu_tokens.interned, str, 0);
+
+    return e ? e->name : NULL;
+}
+
+/*
+ * Names of declarations usually also appear as a token, so share the
+ * token's spelling; otherwise, copy it to the arena.
+ */
+static char *intern_name(const char *str)
+{
+    const char *interned = find_interned_spelling(str);
+
+    return interned ? (char *) interned : arena_strdup(str);
+}
+
+static unsigned find_first_token_at(Token *tokens, unsigned n_tokens,
+                                    unsigned off)
+{
+    unsigned lo = 0, hi = n_tokens;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (tokens[mid].offset < off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/*
+ * Get the tokens of a cursor as a slice of the translation unit's token
+ * table, instead of re-lexing the cursor's extent with clang_tokenize().
+ * Like clang_tokenize(), the slice includes the token that follows the
+ * extent (see get_n_tokens()).
+ */
+static void get_cursor_tokens(CXCursor cursor, Token **tokens,
+                              unsigned *n_tokens)
+{
+    CXSourceRange range = clang_getCursorExtent(cursor);
+    CXFile file;
+    unsigned line, col, start, end, first, last;
+
+    clang_getSpellingLocation(clang_getRangeStart(range),
+                              &file, &line, &col, &start);
+    if (!file || file != ctx->tu_file) {
+        *tokens = ctx->tu_tokens.tokens;
+        *n_tokens = 0;
+        return;
+    }
+    clang_getSpellingLocation(clang_getRangeEnd(range),
+                              &file, &line, &col, &end);
 
-static CXTranslationUnit TU;
+    first = find_first_token_at(ctx->tu_tokens.tokens, ctx->tu_tokens.n_tokens, start);
+    last  = find_first_token_at(ctx->tu_tokens.tokens, ctx->tu_tokens.n_tokens, end);
+    if (last < ctx->tu_tokens.n_tokens)
+        last++;
 
-#define DEBUG 0
-#define dprintf(...) \
-    if (DEBUG) \
-        printf(__VA_ARGS__)
+    *tokens = &ctx->tu_tokens.tokens[first];
+    *n_tokens = last - first;
+}
 
-static unsigned find_token_index(CXToken *tokens, unsigned n_tokens,
+static unsigned find_token_index(Token *tokens, unsigned n_tokens,
                                  const char *str)
 {
+    const char *spelling = find_interned_spelling(str);
     unsigned n;
 
-    for (n = n_tokens - 1; n != (unsigned) -1; n--) {
-        CXString tstr = clang_getTokenSpelling(TU, tokens[n]);
-        const char *cstr = clang_getCString(tstr);
-        int res = strcmp(str, cstr);
-        clang_disposeString(tstr);
-        if (!res)
+    for (n = n_tokens - 1; spelling && n != (unsigned) -1; n--) {
+        if (tokens[n].spelling == spelling)
             return n;
     }
 
     fprintf(stderr, "Could not find token %s in set\n", str);
-    exit(1);
+    fail();
 }
 
-static char *concat_name(CXToken *tokens, unsigned int from, unsigned to)
+static char *concat_name(Token *tokens, unsigned int from, unsigned to)
 {
     unsigned int cnt = 0, n;
     char *str;
 
-    for (n = from; n <= to; n++) {
-        CXString tstr = clang_getTokenSpelling(TU, tokens[n]);
-        const char *cstr = clang_getCString(tstr);
-        cnt += strlen(cstr) + 1;
-        clang_disposeString(tstr);
-    }
+    for (n = from; n <= to; n++)
+        cnt += tokens[n].len + 1;
 
-    str = (char *) malloc(cnt);
-    if (!str) {
-        fprintf(stderr, "Out of memory\n");
-        exit(1);
-    }
+    str = (char *) arena_alloc(cnt);
 
     for (cnt = 0, n = from; n <= to; n++) {
-        CXString tstr = clang_getTokenSpelling(TU, tokens[n]);
-        const char *cstr = clang_getCString(tstr);
-        int len = strlen(cstr);
-        memcpy(&str[cnt], cstr, len);
+        unsigned len = tokens[n].len;
+        memcpy(&str[cnt], tokens[n].spelling, len);
         if (n == to) {
             str[cnt + len] = 0;
         } else {
             str[cnt + len] = ' ';
         }
         cnt += len + 1;
-        clang_disposeString(tstr);
     }
 
     return str;
@@ -291,16 +1027,15 @@ static enum CXChildVisitResult fill_struct_members(CXCursor cursor,
                                                    CXClientData client_data)
 {
     unsigned decl_idx = (unsigned) client_data;
-    StructDeclaration *decl = &structs[decl_idx];
+    StructDeclaration *decl = &ctx->structs[decl_idx];
     CXString cstr = clang_getCursorSpelling(cursor);
     const char *str = clang_getCString(cstr);
 
     switch (cursor.kind) {
     case CXCursor_FieldDecl: {
         unsigned n = decl->n_entries, idx, m;
-        CXToken *tokens = 0;
-        unsigned int n_tokens = 0;
-        CXSourceRange range = clang_getCursorExtent(cursor);
+        Token *tokens;
+        unsigned int n_tokens;
         TypedefDeclaration td;
 
         // padding bitfields
@@ -309,47 +1044,40 @@ static enum CXChildVisitResult fill_struct_members(CXCursor cursor,
             return CXChildVisit_Continue;
         }
 
-        clang_tokenize(TU, range, &tokens, &n_tokens);
+        get_cursor_tokens(cursor, &tokens, &n_tokens);
 
         if (decl->n_entries == decl->n_allocated_entries) {
-            unsigned num = decl->n_allocated_entries + 16;
-            void *mem = realloc(decl->entries,
-                                sizeof(*decl->entries) * num);
+            void *mem = grow_array(decl->entries, &decl->n_allocated_entries,
+                                   sizeof(*decl->entries));
             if (!mem) {
                 fprintf(stderr,
                         "Ran out of memory while declaring field %s in %s\n",
                         str, decl->name);
-                exit(1);
+                fail();
             }
             decl->entries = (StructMember *) mem;
-            decl->n_allocated_entries = num;
         }
 
-        decl->entries[n].name = strdup(str);
+        decl->entries[n].name = intern_name(str);
         decl->entries[n].cursor = cursor;
         decl->n_entries++;
+        add_name_to_hash_index(&ctx->struct_members, decl->entries[n].name,
+                               decl_idx + 1, n, 0);
 
         idx = find_token_index(tokens, n_tokens, str);
         decl->entries[n].n_ptrs = 0;
         decl->entries[n].array_depth = 0;
         for (m = idx + 1; m < n_tokens; m++) {
-            CXString tstr = clang_getTokenSpelling(TU, tokens[m]);
-            const char *cstr = clang_getCString(tstr);
-            int res = strcmp(cstr, ";") && strcmp(cstr, ",");
-            if (!strcmp(cstr, "["))
+            enum TokenAtom atom = tokens[m].atom;
+            if (atom == ATOM_LBRACKET)
                 decl->entries[n].array_depth++;
-            clang_disposeString(tstr);
-            if (!res)
+            if (atom == ATOM_SEMICOLON || atom == ATOM_COMMA)
                 break;
         }
 
         for (;;) {
             unsigned im1 = idx - 1 - decl->entries[n].n_ptrs;
-            CXString tstr = clang_getTokenSpelling(TU, tokens[im1]);
-            const char *cstr = clang_getCString(tstr);
-            int res = strcmp(cstr, "*");
-            clang_disposeString(tstr);
-            if (!res) {
+            if (tokens[im1].atom == ATOM_STAR) {
                 decl->entries[n].n_ptrs++;
             } else {
                 break;
@@ -358,19 +1086,16 @@ static enum CXChildVisitResult fill_struct_members(CXCursor cursor,
 
         do {
             unsigned im1 = idx - 1 - decl->entries[n].n_ptrs;
-            CXString tstr = clang_getTokenSpelling(TU, tokens[im1]);
-            const char *cstr = clang_getCString(tstr);
-            if (!strcmp(cstr, ",")) {
-                decl->entries[n].type = strdup(decl->entries[n - 1].type);
+            if (tokens[im1].atom == ATOM_COMMA) {
+                decl->entries[n].type = arena_strdup(decl->entries[n - 1].type);
             } else {
                 decl->entries[n].type = concat_name(tokens, 0, im1);
             }
-            clang_disposeString(tstr);
         } while (0);
 
         memset(&td, 0, sizeof(td));
         td.struct_decl_idx = (unsigned) -1;
-        clang_visitChildren(cursor, find_anon_struct, &td);
+        visit_children(cursor, find_anon_struct, &td);
         decl->entries[n].struct_decl_idx = td.struct_decl_idx;
 
         // FIXME it's not hard to find the struct name (either because
@@ -378,8 +1103,6 @@ static enum CXChildVisitResult fill_struct_members(CXCursor cursor,
         // is a typedef for the struct name), and then we can use
         // find_struct_decl() to find the StructDeclaration belonging to
         // that type.
-
-        clang_disposeTokens(TU, tokens, n_tokens);
         break;
     }
     case CXCursor_StructDecl:
@@ -400,55 +1123,74 @@ static enum CXChildVisitResult fill_struct_members(CXCursor cursor,
     return CXChildVisit_Continue;
 }
 
+static unsigned find_struct_decl_idx_by_cursor(CXCursor cursor)
+{
+    unsigned pos = (unsigned) -1, idx = (unsigned) -1;
+    HashEntry *e;
+
+    while ((e = probe_hash_index(&ctx->struct_cursors, clang_hashCursor(cursor),
+                                 &pos))) {
+        if (e->idx < idx &&
+            !memcmp(&cursor, &ctx->structs[e->idx].cursor, sizeof(cursor)))
+            idx = e->idx;
+    }
+
+    return idx;
+}
+
 static void register_struct(const char *str, CXCursor cursor,
                             TypedefDeclaration *decl_ptr, int is_union)
 {
     unsigned n;
     StructDeclaration *decl;
 
-    for (n = 0; n < n_structs; n++) {
-        if ((str[0] != 0 && !strcmp(structs[n].name, str)) ||
-            !memcmp(&cursor, &structs[n].cursor, sizeof(cursor))) {
-            /* already exists */
-            if (decl_ptr)
-                decl_ptr->struct_decl_idx = n;
-            if (structs[n].n_entries == 0) {
-                // Fill in structs that were defined (empty) earlier, i.e.
-                // 'struct AVFilterPad;', followed by the full declaration
-                // 'struct AVFilterPad { ... };'
-                clang_visitChildren(cursor, fill_struct_members, (void *) n);
-            }
-            return;
+    n = find_struct_decl_idx_by_cursor(cursor);
+    if (str[0] != 0) {
+        unsigned idx = find_idx_by_name(&ctx->struct_names, str, 0);
+        if (idx < n)
+            n = idx;
+    }
+    if (n != (unsigned) -1) {
+        /* already exists */
+        if (decl_ptr)
+            decl_ptr->struct_decl_idx = n;
+        if (ctx->structs[n].n_entries == 0) {
+            // Fill in structs that were defined (empty) earlier, i.e.
+            // 'struct AVFilterPad;', followed by the full declaration
+            // 'struct AVFilterPad { ... };'
+            visit_children(cursor, fill_struct_members, (void *) n);
         }
+        return;
     }
 
-    if (n_structs == n_allocated_structs) {
-        unsigned num = n_allocated_structs + 16;
-        void *mem = realloc(structs, sizeof(*structs) * num);
+    if (ctx->n_structs == ctx->n_allocated_structs) {
+        void *mem = grow_array(ctx->structs, &ctx->n_allocated_structs, sizeof(*ctx->structs));
         if (!mem) {
             fprintf(stderr, "Out of memory while registering struct %s\n", str);
-            exit(1);
+            fail();
         }
-        structs = (StructDeclaration *) mem;
-        n_allocated_structs = num;
+        ctx->structs = (StructDeclaration *) mem;
     }
 
     if (decl_ptr)
-        decl_ptr->struct_decl_idx = n_structs;
-    decl = &structs[n_structs++];
-    decl->name = strdup(str);
+        decl_ptr->struct_decl_idx = ctx->n_structs;
+    decl = &ctx->structs[ctx->n_structs++];
+    decl->name = intern_name(str);
     decl->cursor = cursor;
     decl->n_entries = 0;
     decl->n_allocated_entries = 0;
     decl->entries = NULL;
     decl->is_union = is_union;
+    add_name_to_hash_index(&ctx->struct_names, decl->name, 0, ctx->n_structs - 1, 0);
+    add_hash_entry(&ctx->struct_cursors, NULL, clang_hashCursor(cursor), 0,
+                   ctx->n_structs - 1, 0);
 
-    clang_visitChildren(cursor, fill_struct_members, (void *) (n_structs - 1));
+    visit_children(cursor, fill_struct_members, (void *) (ctx->n_structs - 1));
 }
 
 static int arithmetic_expression(int val1, const char *expr, int val2)
 {
-    assert(expr[1] == 0 || expr[2] == 0);
+    CHECK_INPUT(expr[1] == 0 || expr[2] == 0);
 
     if (expr[1] == 0) {
         switch (expr[0]) {
@@ -463,7 +1205,7 @@ static int arithmetic_expression(int val1, const char *expr, int val2)
         default:
             fprintf(stderr, "Arithmetic expression '%c' not handled\n",
                     expr[0]);
-            exit(1);
+            fail();
         }
     } else {
 #define TWOCHARCODE(a, b) ((a << 8) | b)
@@ -478,32 +1220,28 @@ static int arithmetic_expression(int val1, const char *expr, int val2)
         default:
             fprintf(stderr, "Arithmetic expression '%s' not handled\n",
                     expr);
-            exit(1);
+            fail();
         }
     }
 
     fprintf(stderr, "Unknown arithmetic expression %s\n", expr);
-    exit(1);
+    fail();
 }
 
 static int find_enum_value(const char *str)
 {
-    unsigned n, m;
+    HashEntry *e = find_hash_entry(&ctx->enum_values, str, 0);
 
-    for (n = 0; n < n_enums; n++) {
-        for (m = 0; m < enums[n].n_entries; m++) {
-            if (!strcmp(enums[n].entries[m].name, str))
-                return enums[n].entries[m].value;
-        }
-    }
+    if (e)
+        return ctx->enums[e->idx].entries[e->sub].value;
 
     fprintf(stderr, "Unknown enum value %s\n", str);
-    exit(1);
+    fail();
 }
 
 typedef struct FillEnumMemberCache {
     int n[3];
-    char *op;
+    const char *op;
 } FillEnumMemberCache;
 
 static enum CXChildVisitResult fill_enum_value(CXCursor cursor,
@@ -511,91 +1249,71 @@ static enum CXChildVisitResult fill_enum_value(CXCursor cursor,
                                                CXClientData client_data)
 {
     FillEnumMemberCache *cache = (FillEnumMemberCache *) client_data;
-    CXToken *tokens = 0;
-    unsigned int n_tokens = 0;
-    CXSourceRange range = clang_getCursorExtent(cursor);
+    Token *tokens;
+    unsigned int n_tokens;
 
-    clang_tokenize(TU, range, &tokens, &n_tokens);
-    if (parent.kind == CXCursor_BinaryOperator && cache->n[0] == 0) {
-        CXString str = clang_getTokenSpelling(TU, tokens[n_tokens - 1]);
-        cache->op = strdup(clang_getCString(str));
-        clang_disposeString(str);
-    }
+    get_cursor_tokens(cursor, &tokens, &n_tokens);
+    if (parent.kind == CXCursor_BinaryOperator && cache->n[0] == 0)
+        cache->op = tokens[n_tokens - 1].spelling;
 
     switch (cursor.kind) {
     case CXCursor_UnaryOperator: {
-        CXString tsp = clang_getTokenSpelling(TU, tokens[0]);
-        const char *str = clang_getCString(tsp);
-        clang_visitChildren(cursor, fill_enum_value, client_data);
-        assert(str[1] == 0 && (str[0] == '+' || str[0] == '-' || str[0] == '~'));
-        assert(cache->n[0] == 1);
+        const char *str = tokens[0].spelling;
+        visit_children(cursor, fill_enum_value, client_data);
+        CHECK_INPUT(str[1] == 0 && (str[0] == '+' || str[0] == '-' || str[0] == '~'));
+        CHECK_INPUT(cache->n[0] == 1);
         if (str[0] == '-') {
             cache->n[1] = -cache->n[1];
         } else if (str[0] == '~') {
             cache->n[1] = ~cache->n[1];
         }
-        clang_disposeString(tsp);
         break;
     }
     case CXCursor_BinaryOperator: {
         FillEnumMemberCache cache2;
 
         memset(&cache2, 0, sizeof(cache2));
-        assert(n_tokens >= 4);
-        clang_visitChildren(cursor, fill_enum_value, &cache2);
-        assert(cache2.n[0] == 2);
-        assert(cache2.op != NULL);
+        CHECK_INPUT(n_tokens >= 4);
+        visit_children(cursor, fill_enum_value, &cache2);
+        CHECK_INPUT(cache2.n[0] == 2);
+        CHECK_INPUT(cache2.op != NULL);
         cache->n[++cache->n[0]] = arithmetic_expression(cache2.n[1],
                                                         cache2.op,
                                                         cache2.n[2]);
-        free(cache2.op);
         break;
     }
     case CXCursor_IntegerLiteral: {
-        CXString tsp;
         const char *str;
         char *end;
 
-        assert(n_tokens == 2);
-        tsp = clang_getTokenSpelling(TU, tokens[0]);
-        str = clang_getCString(tsp);
+        CHECK_INPUT(n_tokens == 2);
+        str = tokens[0].spelling;
         cache->n[++cache->n[0]] = strtol(str, &end, 0);
-        assert(end - str == strlen(str) ||
-               (end - str == strlen(str) - 1 && // str may have a suffix like 'U' that strtol doesn't consume
-                (*end == 'U' || *end == 'u')));
-        clang_disposeString(tsp);
+        CHECK_INPUT(end - str == tokens[0].len ||
+                    (end - str == tokens[0].len - 1 && // str may have a suffix like 'U' that strtol doesn't consume
+                     (*end == 'U' || *end == 'u')));
         break;
     }
-    case CXCursor_DeclRefExpr: {
-        CXString tsp;
-
-        assert(n_tokens == 2);
-        tsp = clang_getTokenSpelling(TU, tokens[0]);
-        cache->n[++cache->n[0]] = find_enum_value(clang_getCString(tsp));
-        clang_disposeString(tsp);
+    case CXCursor_DeclRefExpr:
+        CHECK_INPUT(n_tokens == 2);
+        cache->n[++cache->n[0]] = find_enum_value(tokens[0].spelling);
         break;
-    }
     case CXCursor_CharacterLiteral: {
-        CXString spelling;
         const char *str;
 
-        assert(n_tokens == 2);
-        spelling = clang_getTokenSpelling(TU, tokens[0]);
-        str = clang_getCString(spelling);
-        assert(strlen(str) == 3 && str[0] == '\'' && str[2] == '\'');
+        CHECK_INPUT(n_tokens == 2);
+        str = tokens[0].spelling;
+        CHECK_INPUT(tokens[0].len == 3 && str[0] == '\'' && str[2] == '\'');
         cache->n[++cache->n[0]] = str[1];
-        clang_disposeString(spelling);
         break;
     }
     case CXCursor_ParenExpr:
-        clang_visitChildren(cursor, fill_enum_value, client_data);
+        visit_children(cursor, fill_enum_value, client_data);
         break;
     default:
         break;
     }
 
-    clang_disposeTokens(TU, tokens, n_tokens);
-
     return CXChildVisit_Continue;
 }
 
@@ -613,23 +1331,21 @@ static enum CXChildVisitResult fill_enum_members(CXCursor cursor,
 
         memset(&cache, 0, sizeof(cache));
         if (decl->n_entries == decl->n_allocated_entries) {
-            unsigned num = decl->n_allocated_entries + 16;
-            void *mem = realloc(decl->entries,
-                                sizeof(*decl->entries) * num);
+            void *mem = grow_array(decl->entries, &decl->n_allocated_entries,
+                                   sizeof(*decl->entries));
             if (!mem) {
                 fprintf(stderr,
                         "Ran out of memory while declaring field %s in %s\n",
                         str, decl->name);
-                exit(1);
+                fail();
             }
             decl->entries = (EnumMember *) mem;
-            decl->n_allocated_entries = num;
         }
 
-        decl->entries[n].name = strdup(str);
+        decl->entries[n].name = intern_name(str);
         decl->entries[n].cursor = cursor;
-        clang_visitChildren(cursor, fill_enum_value, &cache);
-        assert(cache.n[0] <= 1);
+        visit_children(cursor, fill_enum_value, &cache);
+        CHECK_INPUT(cache.n[0] <= 1);
         if (cache.n[0] == 1) {
             decl->entries[n].value = cache.n[1];
         } else if (n == 0) {
@@ -638,6 +1354,8 @@ static enum CXChildVisitResult fill_enum_members(CXCursor cursor,
             decl->entries[n].value = decl->entries[n - 1].value + 1;
         }
         decl->n_entries++;
+        add_name_to_hash_index(&ctx->enum_values, decl->entries[n].name, 0,
+                               decl - ctx->enums, n);
 
         clang_disposeString(cstr);
     }
@@ -645,102 +1363,103 @@ static enum CXChildVisitResult fill_enum_members(CXCursor cursor,
     return CXChildVisit_Continue;
 }
 
+static unsigned find_enum_decl_idx_by_cursor(CXCursor cursor)
+{
+    unsigned pos = (unsigned) -1, idx = (unsigned) -1;
+    HashEntry *e;
+
+    while ((e = probe_hash_index(&ctx->enum_cursors, clang_hashCursor(cursor),
+                                 &pos))) {
+        if (e->idx < idx &&
+            !memcmp(&cursor, &ctx->enums[e->idx].cursor, sizeof(cursor)))
+            idx = e->idx;
+    }
+
+    return idx;
+}
+
 static void register_enum(const char *str, CXCursor cursor,
                           TypedefDeclaration *decl_ptr)
 {
     unsigned n;
     EnumDeclaration *decl;
 
-    for (n = 0; n < n_enums; n++) {
-        if ((str[0] != 0 && !strcmp(enums[n].name, str)) ||
-            !memcmp(&cursor, &enums[n].cursor, sizeof(cursor))) {
-            /* already exists */
-            if (decl_ptr)
-                decl_ptr->enum_decl_idx = n;
-            return;
-        }
+    n = find_enum_decl_idx_by_cursor(cursor);
+    if (str[0] != 0) {
+        unsigned idx = find_idx_by_name(&ctx->enum_names, str, 0);
+        if (idx < n)
+            n = idx;
+    }
+    if (n != (unsigned) -1) {
+        /* already exists */
+        if (decl_ptr)
+            decl_ptr->enum_decl_idx = n;
+        return;
     }
 
-    if (n_enums == n_allocated_enums) {
-        unsigned num = n_allocated_enums + 16;
-        void *mem = realloc(enums, sizeof(*enums) * num);
+    if (ctx->n_enums == ctx->n_allocated_enums) {
+        void *mem = grow_array(ctx->enums, &ctx->n_allocated_enums, sizeof(*ctx->enums));
         if (!mem) {
             fprintf(stderr, "Out of memory while registering enum %s\n", str);
-            exit(1);
+            fail();
         }
-        enums = (EnumDeclaration *) mem;
-        n_allocated_enums = num;
+        ctx->enums = (EnumDeclaration *) mem;
     }
 
     if (decl_ptr)
-        decl_ptr->enum_decl_idx = n_enums;
-    decl = &enums[n_enums++];
-    decl->name = strdup(str);
+        decl_ptr->enum_decl_idx = ctx->n_enums;
+    decl = &ctx->enums[ctx->n_enums++];
+    decl->name = intern_name(str);
     decl->cursor = cursor;
     decl->n_entries = 0;
     decl->n_allocated_entries = 0;
     decl->entries = NULL;
+    add_name_to_hash_index(&ctx->enum_names, decl->name, 0, ctx->n_enums - 1, 0);
+    add_hash_entry(&ctx->enum_cursors, NULL, clang_hashCursor(cursor), 0,
+                   ctx->n_enums - 1, 0);
 
-    clang_visitChildren(cursor, fill_enum_members, decl);
+    visit_children(cursor, fill_enum_members, decl);
 }
 
 static void register_typedef(const char *name,
-                             CXToken *tokens, unsigned n_tokens,
+                             Token *tokens, unsigned n_tokens,
                              TypedefDeclaration *decl, CXCursor cursor)
 {
     unsigned n;
 
-    if (n_typedefs == n_allocated_typedefs) {
-        unsigned num = n_allocated_typedefs + 16;
-        void *mem = realloc(typedefs, sizeof(*typedefs) * num);
+    if (ctx->n_typedefs == ctx->n_allocated_typedefs) {
+        void *mem = grow_array(ctx->typedefs, &ctx->n_allocated_typedefs,
+                               sizeof(*ctx->typedefs));
         if (!mem) {
             fprintf(stderr, "Ran out of memory while declaring typedef %s\n",
                     name);
-            exit(1);
+            fail();
         }
-        n_allocated_typedefs = num;
-        typedefs = (TypedefDeclaration *) mem;
+        ctx->typedefs = (TypedefDeclaration *) mem;
     }
 
-    n = n_typedefs++;
-    typedefs[n].name = strdup(name);
+    n = ctx->n_typedefs++;
+    ctx->typedefs[n].name = intern_name(name);
+    add_name_to_hash_index(&ctx->typedef_names, ctx->typedefs[n].name, 0, n, 0);
     if (decl->struct_decl_idx != (unsigned) -1) {
-        typedefs[n].struct_decl_idx = decl->struct_decl_idx;
-        typedefs[n].proxy = NULL;
-        typedefs[n].enum_decl_idx = (unsigned) -1;
+        ctx->typedefs[n].struct_decl_idx = decl->struct_decl_idx;
+        ctx->typedefs[n].proxy = NULL;
+        ctx->typedefs[n].enum_decl_idx = (unsigned) -1;
     } else if (decl->enum_decl_idx != (unsigned) -1) {
-        typedefs[n].enum_decl_idx = decl->enum_decl_idx;
-        typedefs[n].struct_decl_idx = (unsigned) -1;
-        typedefs[n].proxy = NULL;
+        ctx->typedefs[n].enum_decl_idx = decl->enum_decl_idx;
+        ctx->typedefs[n].struct_decl_idx = (unsigned) -1;
+        ctx->typedefs[n].proxy = NULL;
     } else {
-        typedefs[n].enum_decl_idx = (unsigned) -1;
-        typedefs[n].struct_decl_idx = (unsigned) -1;
-        typedefs[n].proxy = concat_name(tokens, 1, n_tokens - 3);
+        ctx->typedefs[n].enum_decl_idx = (unsigned) -1;
+        ctx->typedefs[n].struct_decl_idx = (unsigned) -1;
+        ctx->typedefs[n].proxy = concat_name(tokens, 1, n_tokens - 3);
     }
-    memcpy(&typedefs[n].cursor, &cursor, sizeof(cursor));
-}
-
-static unsigned get_token_offset(CXToken token)
-{
-    CXSourceLocation l = clang_getTokenLocation(TU, token);
-    CXFile file;
-    unsigned line, col, off;
-
-    clang_getSpellingLocation(l, &file, &line, &col, &off);
-
-    return off;
+    memcpy(&ctx->typedefs[n].cursor, &cursor, sizeof(cursor));
 }
 
 static unsigned find_struct_decl_idx_by_name(const char *name)
 {
-    unsigned n;
-
-    for (n = 0; n < n_structs; n++) {
-        if (!strcmp(name, structs[n].name))
-            return n;
-    }
-
-    return (unsigned) -1;
+    return find_idx_by_name(&ctx->struct_names, name, 0);
 }
 
 static void resolve_proxy(TypedefDeclaration *decl)
@@ -756,21 +1475,18 @@ static void resolve_proxy(TypedefDeclaration *decl)
 
 static TypedefDeclaration *find_typedef_decl_by_name(const char *name)
 {
-    unsigned n;
+    unsigned n = find_idx_by_name(&ctx->typedef_names, name, 0);
 
-    for (n = 0; n < n_typedefs; n++) {
-        if (!strcmp(name, typedefs[n].name)) {
-            resolve_proxy(&typedefs[n]);
-            return &typedefs[n];
-        }
-    }
+    if (n == (unsigned) -1)
+        return NULL;
 
-    return NULL;
+    resolve_proxy(&ctx->typedefs[n]);
+    return &ctx->typedefs[n];
 }
 
 // FIXME this function has some duplicate functionality compared to
 // fill_struct_members() further up.
-static unsigned find_struct_decl_idx(const char *var, CXToken *tokens,
+static unsigned find_struct_decl_idx(const char *var, Token *tokens,
                                      unsigned n_tokens, unsigned *depth)
 {
     /*
@@ -782,14 +1498,12 @@ static unsigned find_struct_decl_idx(const char *var, CXToken *tokens,
      * D) if type is a struct, return that type's StructDeclaration;
      *    if type is not a struct and not a typedef, return NULL.
      */
+    const char *var_spelling = find_interned_spelling(var);
     unsigned n, var_tok_idx;
 
     *depth = 0;
     for (n = 0; n < n_tokens; n++) {
-        CXString spelling = clang_getTokenSpelling(TU, tokens[n]);
-        int res = strcmp(clang_getCString(spelling), var);
-        clang_disposeString(spelling);
-        if (!res)
+        if (tokens[n].spelling == var_spelling)
             break;
     }
     if (n == n_tokens)
@@ -797,44 +1511,21 @@ static unsigned find_struct_decl_idx(const char *var, CXToken *tokens,
 
     var_tok_idx = n;
     for (n = var_tok_idx + 1; n < n_tokens; n++) {
-        CXString spelling = clang_getTokenSpelling(TU, tokens[n]);
-        int res = strcmp(clang_getCString(spelling), "=");
-        if (!strcmp(clang_getCString(spelling), "["))
+        if (tokens[n].atom == ATOM_LBRACKET)
             (*depth)++;
-        clang_disposeString(spelling);
-        if (!res)
+        if (tokens[n].atom == ATOM_EQUAL)
             break;
     }
 
     // is it a struct?
-    if (var_tok_idx > 1) {
-        CXString spelling;
-        int res;
-
-        spelling = clang_getTokenSpelling(TU, tokens[var_tok_idx - 2]);
-        res = strcmp(clang_getCString(spelling), "struct");
-        clang_disposeString(spelling);
-
-        if (!res) {
-            unsigned str_decl;
-
-            spelling = clang_getTokenSpelling(TU, tokens[var_tok_idx - 1]);
-            str_decl = find_struct_decl_idx_by_name(clang_getCString(spelling));
-            clang_disposeString(spelling);
-
-            return str_decl;
-        }
-    }
+    if (var_tok_idx > 1 && tokens[var_tok_idx - 2].atom == ATOM_STRUCT)
+        return find_struct_decl_idx_by_name(tokens[var_tok_idx - 1].spelling);
 
     // is it a typedef?
     if (var_tok_idx > 0) {
-        CXString spelling;
         TypedefDeclaration *td_decl;
 
-        spelling = clang_getTokenSpelling(TU, tokens[var_tok_idx - 1]);
-        td_decl = find_typedef_decl_by_name(clang_getCString(spelling));
-        clang_disposeString(spelling);
-
+        td_decl = find_typedef_decl_by_name(tokens[var_tok_idx - 1].spelling);
         if (td_decl && td_decl->struct_decl_idx != (unsigned) -1)
             return td_decl->struct_decl_idx;
     }
@@ -845,14 +1536,8 @@ static unsigned find_struct_decl_idx(const char *var, CXToken *tokens,
 static unsigned find_member_index_in_struct(StructDeclaration *str_decl,
                                             const char *member)
 {
-    unsigned n;
-
-    for (n = 0; n < str_decl->n_entries; n++) {
-        if (!strcmp(str_decl->entries[n].name, member))
-            return n;
-    }
-
-    return -1;
+    return find_idx_by_name(&ctx->struct_members, member,
+                            (unsigned) (str_decl - ctx->structs) + 1);
 }
 
 static unsigned find_struct_decl_idx_for_type_name(const char *name)
@@ -874,7 +1559,7 @@ static unsigned find_struct_decl_idx_for_type_name(const char *name)
  * Structure to keep track of compound literals that we eventually want
  * to replace with something else.
  */
-enum CLType {
+enum CLType { // counted in this order in C99ConvStats.literals
     TYPE_UNKNOWN = 0,
     TYPE_OMIT_CAST,     // AVRational x = (AVRational) { y, z }
                         // -> AVRational x = { y, z }
@@ -888,7 +1573,7 @@ enum CLType {
     TYPE_LOOP_CONTEXT,  // for(int i = 0; ... -> { int i = 0; for (; ... }
 };
 
-typedef struct {
+typedef struct CompoundLiteralList {
     enum CLType type;
     struct {
         unsigned start, end; // to get the values
@@ -904,9 +1589,6 @@ typedef struct {
         } t_c_d;
     } data;
 } CompoundLiteralList;
-static CompoundLiteralList *comp_literal_lists = NULL;
-static unsigned n_comp_literal_lists = 0;
-static unsigned n_allocated_comp_literal_lists = 0;
 
 /*
  * Helper struct for traversing the tree. This allows us to keep state
@@ -918,7 +1600,7 @@ struct CursorRecursion {
     CursorRecursion *parent;
     unsigned child_cntr;
     unsigned allow_var_decls;
-    CXToken *tokens;
+    Token *tokens;
     unsigned n_tokens;
     union {
         void *opaque;
@@ -949,42 +1631,42 @@ static unsigned find_encompassing_struct_decl(unsigned start, unsigned end,
 
     *depth = 0;
     *ptr = NULL;
-    for (n = n_struct_array_lists - 1; n != (unsigned) -1; n--) {
-        if (start >= struct_array_lists[n].value_offset.start &&
-            end   <= struct_array_lists[n].value_offset.end &&
-            !(start == struct_array_lists[n].value_offset.start &&
-              end   == struct_array_lists[n].value_offset.end)) {
-            if (struct_array_lists[n].type == TYPE_ARRAY) {
+    for (n = ctx->n_struct_array_lists - 1; n != (unsigned) -1; n--) {
+        if (start >= ctx->struct_array_lists[n].value_offset.start &&
+            end   <= ctx->struct_array_lists[n].value_offset.end &&
+            !(start == ctx->struct_array_lists[n].value_offset.start &&
+              end   == ctx->struct_array_lists[n].value_offset.end)) {
+            if (ctx->struct_array_lists[n].type == TYPE_ARRAY) {
                 /* { <- parent
                  *   [..] = { .. }, <- us
                  * } */
-                assert((rec->parent->kind == CXCursor_UnexposedExpr &&
-                        rec->parent->parent->kind == CXCursor_InitListExpr) ||
-                       rec->parent->kind == CXCursor_InitListExpr);
+                CHECK_INPUT((rec->parent->kind == CXCursor_UnexposedExpr &&
+                             rec->parent->parent->kind == CXCursor_InitListExpr) ||
+                            rec->parent->kind == CXCursor_InitListExpr);
 
-                *ptr = &struct_array_lists[n];
-                assert(struct_array_lists[n].array_depth > 0);
-                *depth = struct_array_lists[n].array_depth - 1;
+                *ptr = &ctx->struct_array_lists[n];
+                CHECK_INPUT(ctx->struct_array_lists[n].array_depth > 0);
+                *depth = ctx->struct_array_lists[n].array_depth - 1;
 
-                return struct_array_lists[n].struct_decl_idx;
-            } else if (struct_array_lists[n].type == TYPE_STRUCT) {
+                return ctx->struct_array_lists[n].struct_decl_idx;
+            } else if (ctx->struct_array_lists[n].type == TYPE_STRUCT) {
                 /* { <- parent
                  *   .member = { .. }, <- us
                  * } */
                 unsigned m;
-                StructArrayList *l = *ptr = &struct_array_lists[n];
+                StructArrayList *l = *ptr = &ctx->struct_array_lists[n];
 
-                assert((rec->parent->kind == CXCursor_UnexposedExpr &&
-                        rec->parent->parent->kind == CXCursor_InitListExpr) ||
-                       rec->parent->kind == CXCursor_InitListExpr);
-                assert(l->array_depth == 0);
+                CHECK_INPUT((rec->parent->kind == CXCursor_UnexposedExpr &&
+                             rec->parent->parent->kind == CXCursor_InitListExpr) ||
+                            rec->parent->kind == CXCursor_InitListExpr);
+                CHECK_INPUT(l->array_depth == 0);
                 for (m = 0; m <= l->n_entries; m++) {
                     if (start >= l->entries[m].expression_offset.start &&
                         end   <= l->entries[m].expression_offset.end) {
                         unsigned s_idx = l->struct_decl_idx;
                         unsigned m_idx = l->entries[m].index;
-                        *depth = structs[s_idx].entries[m_idx].array_depth;
-                        return structs[s_idx].entries[m_idx].struct_decl_idx;
+                        *depth = ctx->structs[s_idx].entries[m_idx].array_depth;
+                        return ctx->structs[s_idx].entries[m_idx].struct_decl_idx;
                     }
                 }
 
@@ -994,19 +1676,19 @@ static unsigned find_encompassing_struct_decl(unsigned start, unsigned end,
                 /* { <- parent
                  *   { .. }, <- us (so now the question is: array or struct?)
                  * } */
-                StructArrayList *l = *ptr = &struct_array_lists[n];
+                StructArrayList *l = *ptr = &ctx->struct_array_lists[n];
                 unsigned s_idx = l->struct_decl_idx;
                 unsigned m_idx = rec->parent->child_cntr - 1;
 
-                assert(rec->parent->kind == CXCursor_InitListExpr);
+                CHECK_INPUT(rec->parent->kind == CXCursor_InitListExpr);
 
                 if (l->array_depth > 0) {
                     *depth = l->array_depth - 1;
                     return l->struct_decl_idx;
                 } else if (s_idx != (unsigned) -1) {
-                    assert(m_idx < structs[s_idx].n_entries);
-                    *depth = structs[s_idx].entries[m_idx].array_depth;
-                    return structs[s_idx].entries[m_idx].struct_decl_idx;
+                    CHECK_INPUT(m_idx < ctx->structs[s_idx].n_entries);
+                    *depth = ctx->structs[s_idx].entries[m_idx].array_depth;
+                    return ctx->structs[s_idx].entries[m_idx].struct_decl_idx;
                 } else {
                     return (unsigned) -1;
                 }
@@ -1025,13 +1707,10 @@ static int is_const(CompoundLiteralList *l, CursorRecursion *rec)
     unsigned n;
 
     for (n = 0; n < rec->n_tokens - 1; n++) {
-        unsigned off = get_token_offset(rec->tokens[n]);
+        unsigned off = rec->tokens[n].offset;
 
         if (off > l->cast_token.start && off < l->cast_token.end) {
-            CXString spelling = clang_getTokenSpelling(TU, rec->tokens[n]);
-            int res = strcmp(clang_getCString(spelling), "const");
-            clang_disposeString(spelling);
-            if (!res)
+            if (rec->tokens[n].atom == ATOM_CONST)
                 return 1;
         } else if (off >= l->cast_token.end)
             break;
@@ -1090,18 +1769,19 @@ static void analyze_compound_literal_lineage(CompoundLiteralList *l,
 {
     CursorRecursion *p = rec, *p2;
 
-#define DEBUG 0
-    dprintf("CL lineage: ");
-    do {
-        dprintf("%d[%d], ", p->kind, p->child_cntr);
-    } while ((p = p->parent));
-    dprintf("\n");
-#define DEBUG 0
+    if (ctx->trace_level >= TRACE_CURSORS) {
+        trace(TRACE_CURSORS, "CL lineage: ");
+        do {
+            trace(TRACE_CURSORS, "%d[%d], ", p->kind, p->child_cntr);
+        } while ((p = p->parent));
+        trace(TRACE_CURSORS, "\n");
+        p = rec;
+    }
 
     p = rec->parent->parent;
     p2 = find_function_or_top(rec);
     if (p2->parent->kind != CXCursor_FunctionDecl) {
-        l->context.start = get_token_offset(p2->tokens[0]);
+        l->context.start = p2->tokens[0].offset;
         l->type = TYPE_CONST_DECL;
         return;
     }
@@ -1110,16 +1790,16 @@ static void analyze_compound_literal_lineage(CompoundLiteralList *l,
         l->context.start = l->cast_token.start;
     } else if ((p = find_var_decl_context(p))) {
         l->type = TYPE_TEMP_ASSIGN;
-        l->context.start = get_token_offset(p->tokens[0]);
+        l->context.start = p->tokens[0].offset;
         if (p->kind == CXCursor_VarDecl) {
             /* if the parent is a VarDecl, the context.end should be the end
              * of the whole context in which that variable exists, not just
              * the end of the context of this particular statement. */
             p = p->parent;
-            assert(p->kind == CXCursor_DeclStmt);
+            CHECK_INPUT(p->kind == CXCursor_DeclStmt);
             p = p->parent;
         }
-        l->context.end = get_token_offset(p->tokens[p->n_tokens - 1]);
+        l->context.end = p->tokens[p->n_tokens - 1].offset;
     }
 }
 
@@ -1135,21 +1815,21 @@ static void analyze_decl_context(CompoundLiteralList *l,
     // whole thing
     if (p->kind == CXCursor_CompoundStmt) {
         l->type = TYPE_NEW_CONTEXT;
-        l->context.start = get_token_offset(rec->tokens[0]);
-        l->cast_token.start = get_token_offset(rec->tokens[0]);
-        l->context.end = get_token_offset(p->tokens[p->n_tokens - 1]);
+        l->context.start = rec->tokens[0].offset;
+        l->cast_token.start = rec->tokens[0].offset;
+        l->context.end = p->tokens[p->n_tokens - 1].offset;
     } else if (p->kind == CXCursor_ForStmt && rec->parent->child_cntr == 1) {
         l->type = TYPE_LOOP_CONTEXT;
-        l->context.start = get_token_offset(p->tokens[0]);
-        l->context.end = get_token_offset(p->tokens[p->n_tokens - 1]);
-        l->cast_token.start = get_token_offset(rec->tokens[0]);
-        l->cast_token.end = get_token_offset(rec->tokens[rec->n_tokens - 2]);
+        l->context.start = p->tokens[0].offset;
+        l->context.end = p->tokens[p->n_tokens - 1].offset;
+        l->cast_token.start = rec->tokens[0].offset;
+        l->cast_token.end = rec->tokens[rec->n_tokens - 2].offset;
     }
 }
 
 static void get_comp_literal_type_info(StructArrayList *sal,
                                        CompoundLiteralList *cl,
-                                       CXToken *tokens, unsigned n_tokens,
+                                       Token *tokens, unsigned n_tokens,
                                        unsigned start, unsigned end)
 {
     // FIXME also see find_struct_decl_idx()
@@ -1158,7 +1838,7 @@ static void get_comp_literal_type_info(StructArrayList *sal,
     char *type;
 
     for (n = 0; n < n_tokens; n++) {
-        unsigned off = get_token_offset(tokens[n]);
+        unsigned off = tokens[n].offset;
         if (off == cl->cast_token.start) {
             type_tok_idx = n + 1;
         } else if (off == cl->cast_token.end) {
@@ -1168,35 +1848,31 @@ static void get_comp_literal_type_info(StructArrayList *sal,
             array_tok_idx = n;
         }
     }
-    assert(array_tok_idx != (unsigned) -1 &&
-           end_tok_idx != (unsigned) -1 &&
-           type_tok_idx != (unsigned) -1);
+    CHECK_INPUT(array_tok_idx != (unsigned) -1 &&
+                end_tok_idx != (unsigned) -1 &&
+                type_tok_idx != (unsigned) -1);
 
     sal->array_depth = 0;
     for (n = array_tok_idx; n < end_tok_idx; n++) {
-        CXString spelling = clang_getTokenSpelling(TU, tokens[n]);
-        int res = strcmp(clang_getCString(spelling), "[");
-        clang_disposeString(spelling);
-        if (!res)
+        if (tokens[n].atom == ATOM_LBRACKET)
             sal->array_depth++;
     }
     type = concat_name(tokens, type_tok_idx, array_tok_idx - 1);
     sal->struct_decl_idx = find_struct_decl_idx_for_type_name(type);
-    free(type);
 
     sal->level = 0;
-    for (n = n_struct_array_lists - 1; n != (unsigned) -1; n--) {
-        if (start >= struct_array_lists[n].value_offset.start &&
-            end   <= struct_array_lists[n].value_offset.end &&
-            !(start == struct_array_lists[n].value_offset.start &&
-              end   == struct_array_lists[n].value_offset.end)) {
-                sal->level = struct_array_lists[n].level + 1;
+    for (n = ctx->n_struct_array_lists - 1; n != (unsigned) -1; n--) {
+        if (start >= ctx->struct_array_lists[n].value_offset.start &&
+            end   <= ctx->struct_array_lists[n].value_offset.end &&
+            !(start == ctx->struct_array_lists[n].value_offset.start &&
+              end   == ctx->struct_array_lists[n].value_offset.end)) {
+                sal->level = ctx->struct_array_lists[n].level + 1;
                 return;
         }
     }
 }
 
-static unsigned get_n_tokens(CXToken *tokens, unsigned n_tokens)
+static unsigned get_n_tokens(Token *tokens, unsigned n_tokens)
 {
     /* clang will set n_tokens to the number including the start of the
      * next statement, regardless of whether that is part of the next
@@ -1208,9 +1884,7 @@ static unsigned get_n_tokens(CXToken *tokens, unsigned n_tokens)
      * ";", but in the second case is "static"). */
     int res;
     if (n_tokens > 0) {
-        CXString spelling = clang_getTokenSpelling(TU, tokens[n_tokens - 1]);
-        res = strcmp(clang_getCString(spelling), ";");
-        clang_disposeString(spelling);
+        res = tokens[n_tokens - 1].atom != ATOM_SEMICOLON;
     } else {
         res = 1;
     }
@@ -1224,30 +1898,11 @@ static char *find_variable_name(CursorRecursion *rec)
     // typename varname = { ...
     // typename can be a typedef or "union something"
     for (n = 1; n < rec->n_tokens; n++) {
-        CXString spelling = clang_getTokenSpelling(TU, rec->tokens[n]);
-        if (!strcmp(clang_getCString(spelling), "=")) {
-            char *name;
-            clang_disposeString(spelling);
-            spelling = clang_getTokenSpelling(TU, rec->tokens[n - 1]);
-            name = strdup(clang_getCString(spelling));
-            clang_disposeString(spelling);
-            return name;
-        }
-        clang_disposeString(spelling);
+        if (rec->tokens[n].atom == ATOM_EQUAL)
+            return (char *) rec->tokens[n - 1].spelling;
     }
     fprintf(stderr, "Unable to find variable name in assignment\n");
-    abort();
-}
-
-static int index_is_unique(StructArrayList *l, int idx) {
-  unsigned n;
-
-  for (n = 0; n < l->n_entries; n++) {
-    if (l->entries[n].index == idx)
-      return 0;
-  }
-
-  return 1;
+    fail();
 }
 
 static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
@@ -1255,22 +1910,15 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
 {
     enum CXChildVisitResult res = CXChildVisit_Recurse;
     CXString str;
-    CXSourceRange range;
-    CXToken *tokens = 0;
-    unsigned n_tokens = 0;
-    CXSourceLocation pos;
-    CXFile file;
-    unsigned line, col, off, i;
-    CXString filename;
+    Token *tokens;
+    unsigned n_tokens;
+    unsigned i;
     CursorRecursion rec, *rec_ptr;
     int is_union, is_in_function = 0;
 
-    range = clang_getCursorExtent(cursor);
-    pos   = clang_getCursorLocation(cursor);
+    ctx->stats.cursors++;
     str   = clang_getCursorSpelling(cursor);
-    clang_tokenize(TU, range, &tokens, &n_tokens);
-    clang_getSpellingLocation(pos, &file, &line, &col, &off);
-    filename = clang_getFileName(file);
+    get_cursor_tokens(cursor, &tokens, &n_tokens);
 
     memset(&rec, 0, sizeof(rec));
     rec.kind = cursor.kind;
@@ -1293,19 +1941,23 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
         rec_ptr = rec_ptr->parent;
     }
 
-#define DEBUG 0
-    dprintf("DERP: %d [%d:%d] %s @ %d:%d in %s\n", cursor.kind, parent.kind,
-            rec.parent->child_cntr, clang_getCString(str), line, col,
-            clang_getCString(filename));
-    for (i = 0; i < n_tokens; i++)
-    {
-        CXString spelling = clang_getTokenSpelling(TU, tokens[i]);
-        CXSourceLocation l = clang_getTokenLocation(TU, tokens[i]);
-        clang_getSpellingLocation(l, &file, &line, &col, &off);
-        dprintf("token = '%s' @ %d:%d\n", clang_getCString(spelling), line, col);
-        clang_disposeString(spelling);
+    if (ctx->trace_level >= TRACE_CURSORS) {
+        CXFile file;
+        unsigned line, col;
+        CXString filename;
+
+        clang_getSpellingLocation(clang_getCursorLocation(cursor), &file,
+                                  &line, &col, NULL);
+        filename = clang_getFileName(file);
+        trace(TRACE_CURSORS, "cursor: kind=%d parent=%d child=%d "
+              "spelling='%s' @ %u:%u in %s\n", cursor.kind, parent.kind,
+              rec.parent->child_cntr, clang_getCString(str), line, col,
+              clang_getCString(filename));
+        clang_disposeString(filename);
+        for (i = 0; ctx->trace_level >= TRACE_TOKENS && i < n_tokens; i++)
+            trace(TRACE_TOKENS, "  token: '%s' @ %u:%u\n", tokens[i].spelling,
+                  tokens[i].line + 1, tokens[i].col + 1);
     }
-#define DEBUG 0
 
     switch (cursor.kind) {
     case CXCursor_TypedefDecl: {
@@ -1314,7 +1966,7 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
         decl.struct_decl_idx = (unsigned) -1;
         decl.enum_decl_idx = (unsigned) -1;
         rec.data.td_decl = &decl;
-        clang_visitChildren(cursor, callback, &rec);
+        visit_children(cursor, callback, &rec);
         register_typedef(clang_getCString(str), tokens, n_tokens,
                          &decl, cursor);
         break;
@@ -1356,23 +2008,22 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
             //                                           ^^^^^^
             CompoundLiteralList *l;
 
-            if (n_comp_literal_lists == n_allocated_comp_literal_lists) {
-                unsigned num = n_allocated_comp_literal_lists + 16;
-                void *mem = realloc(comp_literal_lists,
-                                    sizeof(*comp_literal_lists) * num);
+            if (ctx->n_comp_literal_lists == ctx->n_allocated_comp_literal_lists) {
+                void *mem = grow_array(ctx->comp_literal_lists,
+                                       &ctx->n_allocated_comp_literal_lists,
+                                       sizeof(*ctx->comp_literal_lists));
                 if (!mem) {
                     fprintf(stderr, "Failed to allocate memory for complitlist\n");
-                    exit(1);
+                    fail();
                 }
-                comp_literal_lists = (CompoundLiteralList *) mem;
-                n_allocated_comp_literal_lists = num;
+                ctx->comp_literal_lists = (CompoundLiteralList *) mem;
             }
-            l = &comp_literal_lists[n_comp_literal_lists++];
+            l = &ctx->comp_literal_lists[ctx->n_comp_literal_lists++];
             memset(l, 0, sizeof(*l));
-            clang_visitChildren(cursor, callback, &rec);
+            visit_children(cursor, callback, &rec);
             analyze_decl_context(l, &rec);
         } else {
-            clang_visitChildren(cursor, callback, &rec);
+            visit_children(cursor, callback, &rec);
         }
         break;
     case CXCursor_VarDecl: {
@@ -1382,48 +2033,43 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
                                             tokens, n_tokens,
                                             &rec.data.var_decl_data.array_depth);
         rec.data.var_decl_data.struct_decl_idx = idx;
-        clang_visitChildren(cursor, callback, &rec);
+        visit_children(cursor, callback, &rec);
         break;
     }
     case CXCursor_CompoundLiteralExpr: {
         CompoundLiteralList *l;
 
-        if (n_comp_literal_lists == n_allocated_comp_literal_lists) {
-            unsigned num = n_allocated_comp_literal_lists + 16;
-            void *mem = realloc(comp_literal_lists,
-                                sizeof(*comp_literal_lists) * num);
+        if (ctx->n_comp_literal_lists == ctx->n_allocated_comp_literal_lists) {
+            void *mem = grow_array(ctx->comp_literal_lists,
+                                   &ctx->n_allocated_comp_literal_lists,
+                                   sizeof(*ctx->comp_literal_lists));
             if (!mem) {
                 fprintf(stderr, "Failed to allocate memory for complitlist\n");
-                exit(1);
+                fail();
             }
-            comp_literal_lists = (CompoundLiteralList *) mem;
-            n_allocated_comp_literal_lists = num;
+            ctx->comp_literal_lists = (CompoundLiteralList *) mem;
         }
-        l = &comp_literal_lists[n_comp_literal_lists++];
+        l = &ctx->comp_literal_lists[ctx->n_comp_literal_lists++];
         memset(l, 0, sizeof(*l));
-        rec.data.cl_idx = n_comp_literal_lists - 1;
-        l->cast_token.start = get_token_offset(tokens[0]);
+        rec.data.cl_idx = ctx->n_comp_literal_lists - 1;
+        l->cast_token.start = tokens[0].offset;
         l->struct_decl_idx = (unsigned) -1;
-        clang_visitChildren(cursor, callback, &rec);
+        visit_children(cursor, callback, &rec);
         analyze_compound_literal_lineage(l, &rec);
         break;
     }
     case CXCursor_InitListExpr:
         if (parent.kind == CXCursor_CompoundLiteralExpr) {
-            CompoundLiteralList *l = &comp_literal_lists[rec.parent->data.cl_idx];
+            CompoundLiteralList *l = &ctx->comp_literal_lists[rec.parent->data.cl_idx];
 
             // (type) { val }
             //        ^^^^^^^
-            l->value_token.start = get_token_offset(tokens[0]);
-            l->value_token.end   = get_token_offset(tokens[n_tokens - 2]);
+            l->value_token.start = tokens[0].offset;
+            l->value_token.end   = tokens[n_tokens - 2].offset;
             if (!l->cast_token.end) {
                 for (i = 0; i < rec.parent->n_tokens - 1; i++) {
-                    CXString spelling = clang_getTokenSpelling(TU,
-                                                        rec.parent->tokens[i]);
-                    unsigned off = get_token_offset(rec.parent->tokens[i]);
-                    int res = strcmp(clang_getCString(spelling), "[");
-                    clang_disposeString(spelling);
-                    if (!res)
+                    unsigned off = rec.parent->tokens[i].offset;
+                    if (rec.parent->tokens[i].atom == ATOM_LBRACKET)
                         l->cast_token_array_start = off;
                     if (off == l->value_token.start)
                         break;
@@ -1439,31 +2085,30 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
             StructArrayList *l;
             unsigned parent_idx = (unsigned) -1;
 
-            if (n_struct_array_lists == n_allocated_struct_array_lists) {
-                unsigned num = n_allocated_struct_array_lists + 16;
-                void *mem = realloc(struct_array_lists,
-                                    sizeof(*struct_array_lists) * num);
+            if (ctx->n_struct_array_lists == ctx->n_allocated_struct_array_lists) {
+                void *mem = grow_array(ctx->struct_array_lists,
+                                       &ctx->n_allocated_struct_array_lists,
+                                       sizeof(*ctx->struct_array_lists));
                 if (!mem) {
                     fprintf(stderr, "Failed to allocate memory for str/arr\n");
-                    exit(1);
+                    fail();
                 }
-                struct_array_lists = (StructArrayList *) mem;
-                n_allocated_struct_array_lists = num;
+                ctx->struct_array_lists = (StructArrayList *) mem;
             }
-            l = &struct_array_lists[n_struct_array_lists++];
+            l = &ctx->struct_array_lists[ctx->n_struct_array_lists++];
             l->type = TYPE_IRRELEVANT;
             l->n_entries = l->n_allocated_entries = 0;
             l->entries = NULL;
             l->name = NULL;
             l->convert_to_assignment = 0;
-            l->value_offset.start = get_token_offset(tokens[0]);
-            l->value_offset.end   = get_token_offset(tokens[n_tokens - 2]);
+            l->value_offset.start = tokens[0].offset;
+            l->value_offset.end   = tokens[n_tokens - 2].offset;
             if (rec.parent->kind == CXCursor_VarDecl) {
                 l->struct_decl_idx = rec.parent->data.var_decl_data.struct_decl_idx;
                 l->array_depth     = rec.parent->data.var_decl_data.array_depth;
                 l->level = 0;
             } else if (rec.parent->kind == CXCursor_CompoundLiteralExpr) {
-                CompoundLiteralList *cl = &comp_literal_lists[rec.parent->data.cl_idx];
+                CompoundLiteralList *cl = &ctx->comp_literal_lists[rec.parent->data.cl_idx];
                 get_comp_literal_type_info(l, cl,
                                            rec.parent->tokens,
                                            rec.parent->n_tokens,
@@ -1493,15 +2138,14 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
                     StructArrayItem *sai;
 
                     if (parent->n_entries == parent->n_allocated_entries) {
-                        unsigned num = parent->n_allocated_entries + 16;
-                        void *mem = realloc(parent->entries,
-                                            sizeof(*parent->entries) * num);
+                        void *mem = grow_array(parent->entries,
+                                               &parent->n_allocated_entries,
+                                               sizeof(*parent->entries));
                         if (!mem) {
                           fprintf(stderr, "Failed to allocate str/arr entry mem\n");
-                          exit(1);
+                          fail();
                         }
                         parent->entries = (StructArrayItem *) mem;
-                        parent->n_allocated_entries = num;
                     }
 
                     sai = &parent->entries[parent->n_entries];
@@ -1512,29 +2156,28 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
                     sai->index = parent->n_entries > 0 ?
                                  parent->entries[parent->n_entries - 1].index + 1 :
                                  rec.parent->child_cntr - 1;
-                    parent_idx = parent - struct_array_lists;
+                    parent_idx = parent - ctx->struct_array_lists;
                 }
             }
 
-            rec.data.sal_idx = n_struct_array_lists - 1;
-            clang_visitChildren(cursor, callback, &rec);
+            rec.data.sal_idx = ctx->n_struct_array_lists - 1;
+            visit_children(cursor, callback, &rec);
             if (rec.parent->kind == CXCursor_InitListExpr &&
                 parent_idx != (unsigned) -1) {
-                struct_array_lists[parent_idx].n_entries++;
+                ctx->struct_array_lists[parent_idx].n_entries++;
             }
-            l = &struct_array_lists[rec.data.sal_idx];
+            l = &ctx->struct_array_lists[rec.data.sal_idx];
             if (l->convert_to_assignment &&
                 rec.parent->kind == CXCursor_VarDecl) {
                 l->value_offset.start -= 2; // Swallow the assignment character
                 l->value_offset.end   += 1; // Swallow the final semicolon
-                free(l->name);
                 l->name = find_variable_name(rec.parent);
                 rec_ptr = (CursorRecursion *) client_data;
                 while (rec_ptr->kind != CXCursor_CompoundStmt)
                     rec_ptr = rec_ptr->parent;
                 if (rec_ptr->kind != CXCursor_CompoundStmt) {
                     fprintf(stderr, "Unable to find enclosing compound statement\n");
-                    exit(1);
+                    fail();
                 }
                 rec_ptr->end_scopes++;
             } else
@@ -1543,15 +2186,13 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
         break;
     case CXCursor_UnexposedExpr:
         if (parent.kind == CXCursor_InitListExpr) {
-            CXString spelling = clang_getTokenSpelling(TU, tokens[0]);
-            CXString spelling2 = clang_getTokenSpelling(TU, tokens[1]);
-            const char *istr = clang_getCString(spelling);
-            const char *istr2 = clang_getCString(spelling2);
-            StructArrayList *l = &struct_array_lists[rec.parent->data.sal_idx];
+            enum TokenAtom iatom = tokens[0].atom;
+            enum TokenAtom iatom2 = tokens[1].atom;
+            StructArrayList *l = &ctx->struct_array_lists[rec.parent->data.sal_idx];
             StructArrayItem *sai;
 
-            if (!strcmp(istr, "[") || !strcmp(istr, ".") || !strcmp(istr2, ":")) {
-                enum StructArrayType exp_type = (istr[0] == '.' || istr2[0] == ':') ?
+            if (iatom == ATOM_LBRACKET || iatom == ATOM_DOT || iatom2 == ATOM_COLON) {
+                enum StructArrayType exp_type = (iatom == ATOM_DOT || iatom2 == ATOM_COLON) ?
                                                 TYPE_STRUCT : TYPE_ARRAY;
                 // [index] = val   or   .member = val   or   member: val
                 // ^^^^^^^^^^^^^        ^^^^^^^^^^^^^        ^^^^^^^^^^^
@@ -1559,53 +2200,45 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
                     l->type = exp_type;
                 } else if (l->type != exp_type) {
                     fprintf(stderr, "Mixed struct/array!\n");
-                    exit(1);
+                    fail();
                 }
             }
 
             if (l->n_entries == l->n_allocated_entries) {
-                unsigned num = l->n_allocated_entries + 16;
-                void *mem = realloc(l->entries, sizeof(*l->entries) * num);
+                void *mem = grow_array(l->entries, &l->n_allocated_entries,
+                                       sizeof(*l->entries));
                 if (!mem) {
                     fprintf(stderr, "Failed to allocate str/arr entry mem\n");
-                    exit(1);
+                    fail();
                 }
                 l->entries = (StructArrayItem *) mem;
-                l->n_allocated_entries = num;
             }
 
             sai = &l->entries[l->n_entries];
             sai->index = l->n_entries ? l->entries[l->n_entries - 1].index + 1 : 0;
-            sai->expression_offset.start = get_token_offset(tokens[0]);
-            sai->expression_offset.end   = get_token_offset(tokens[n_tokens - 2]);
-            if (!strcmp(istr, ".")) {
-                sai->value_offset.start = get_token_offset(tokens[3]);
-            } else if (!strcmp(istr2, ":")) {
-                sai->value_offset.start = get_token_offset(tokens[2]);
-            } else if (!strcmp(istr, "[")) {
+            sai->expression_offset.start = tokens[0].offset;
+            sai->expression_offset.end   = tokens[n_tokens - 2].offset;
+            if (iatom == ATOM_DOT) {
+                sai->value_offset.start = tokens[3].offset;
+            } else if (iatom2 == ATOM_COLON) {
+                sai->value_offset.start = tokens[2].offset;
+            } else if (iatom == ATOM_LBRACKET) {
                 unsigned n;
                 for (n = 2; n < n_tokens - 2; n++) {
-                    CXString spelling = clang_getTokenSpelling(TU, tokens[n]);
-                    int res = strcmp(clang_getCString(spelling), "]");
-                    clang_disposeString(spelling);
-                    if (!res)
+                    if (tokens[n].atom == ATOM_RBRACKET)
                         break;
                 }
-                assert(n < n_tokens - 2);
-                sai->value_offset.start = get_token_offset(tokens[n + 2]);
+                CHECK_INPUT(n < n_tokens - 2);
+                sai->value_offset.start = tokens[n + 2].offset;
             } else {
-                sai->value_offset.start = get_token_offset(tokens[0]);
+                sai->value_offset.start = tokens[0].offset;
             }
-            sai->value_offset.end   = get_token_offset(tokens[n_tokens - 2]);
+            sai->value_offset.end   = tokens[n_tokens - 2].offset;
             rec.data.sal_idx = rec.parent->data.sal_idx;
-            clang_visitChildren(cursor, callback, &rec);
-            assert(index_is_unique(&struct_array_lists[rec.parent->data.sal_idx],
-                                   sai->index));
-            struct_array_lists[rec.parent->data.sal_idx].n_entries++;
-            clang_disposeString(spelling);
-            clang_disposeString(spelling2);
+            visit_children(cursor, callback, &rec);
+            ctx->struct_array_lists[rec.parent->data.sal_idx].n_entries++;
         } else {
-            clang_visitChildren(cursor, callback, &rec);
+            visit_children(cursor, callback, &rec);
         }
         break;
     case CXCursor_MemberRef:
@@ -1614,37 +2247,35 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
             // designated initializer (struct)
             // .member = val
             //  ^^^^^^
-            StructArrayList *l = &struct_array_lists[rec.parent->data.sal_idx];
+            StructArrayList *l = &ctx->struct_array_lists[rec.parent->data.sal_idx];
             StructArrayItem *sai = &l->entries[l->n_entries];
             const char *member = clang_getCString(str);
 
-            assert(sai);
-            assert(l->type == TYPE_STRUCT);
-            assert(l->struct_decl_idx != (unsigned) -1);
-            sai->index = find_member_index_in_struct(&structs[l->struct_decl_idx],
+            CHECK_INPUT(sai);
+            CHECK_INPUT(l->type == TYPE_STRUCT);
+            CHECK_INPUT(l->struct_decl_idx != (unsigned) -1);
+            sai->index = find_member_index_in_struct(&ctx->structs[l->struct_decl_idx],
                                                      member);
-            if (structs[l->struct_decl_idx].is_union && is_in_function)
+            if (ctx->structs[l->struct_decl_idx].is_union && is_in_function)
                 l->convert_to_assignment = 1;
         }
         break;
     case CXCursor_CompoundStmt:
         rec.allow_var_decls = 1;
-        clang_visitChildren(cursor, callback, &rec);
+        visit_children(cursor, callback, &rec);
         if (rec.end_scopes) {
             EndScope *e;
-            if (n_end_scopes == n_allocated_end_scopes) {
-                unsigned num = n_allocated_end_scopes + 16;
-                void *mem = realloc(end_scopes,
-                                    sizeof(*end_scopes) * num);
+            if (ctx->n_end_scopes == ctx->n_allocated_end_scopes) {
+                void *mem = grow_array(ctx->end_scopes, &ctx->n_allocated_end_scopes,
+                                       sizeof(*ctx->end_scopes));
                 if (!mem) {
                     fprintf(stderr, "Failed to allocate memory for str/arr\n");
-                    exit(1);
+                    fail();
                 }
-                end_scopes = (EndScope *) mem;
-                n_allocated_end_scopes = num;
+                ctx->end_scopes = (EndScope *) mem;
             }
-            e = &end_scopes[n_end_scopes++];
-            e->end = get_token_offset(tokens[n_tokens - 2]);
+            e = &ctx->end_scopes[ctx->n_end_scopes++];
+            e->end = tokens[n_tokens - 2].offset;
             e->n_scopes = rec.end_scopes;
         }
         break;
@@ -1653,26 +2284,24 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
     case CXCursor_BinaryOperator:
         if (parent.kind == CXCursor_UnexposedExpr &&
             rec.parent->parent->kind == CXCursor_InitListExpr) {
-            CXString spelling = clang_getTokenSpelling(TU, tokens[n_tokens - 1]);
-            if (!strcmp(clang_getCString(spelling), "]")) {
+            if (tokens[n_tokens - 1].atom == ATOM_RBRACKET) {
                 // [index] = { val }
                 //  ^^^^^
                 FillEnumMemberCache cache;
-                StructArrayList *l = &struct_array_lists[rec.parent->data.sal_idx];
+                StructArrayList *l = &ctx->struct_array_lists[rec.parent->data.sal_idx];
                 StructArrayItem *sai = &l->entries[l->n_entries];
 
                 memset(&cache, 0, sizeof(cache));
                 fill_enum_value(cursor, parent, &cache);
-                assert(cache.n[0] == 1);
-                assert(sai);
-                assert(l->type == TYPE_ARRAY);
+                CHECK_INPUT(cache.n[0] == 1);
+                CHECK_INPUT(sai);
+                CHECK_INPUT(l->type == TYPE_ARRAY);
                 sai->index = cache.n[1];
             }
-            clang_disposeString(spelling);
         } else if (cursor.kind != CXCursor_BinaryOperator)
             break;
     default:
-        clang_visitChildren(cursor, callback, &rec);
+        visit_children(cursor, callback, &rec);
         break;
     }
 
@@ -1680,21 +2309,20 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
     if (rec.parent->kind == CXCursor_InitListExpr &&
         cursor.kind != CXCursor_InitListExpr &&
         cursor.kind != CXCursor_UnexposedExpr) {
-        unsigned s = get_token_offset(tokens[0]);
+        unsigned s = tokens[0].offset;
         StructArrayItem *sai;
-        StructArrayList *parent = &struct_array_lists[rec.parent->data.sal_idx];
+        StructArrayList *parent = &ctx->struct_array_lists[rec.parent->data.sal_idx];
 
         if (parent != NULL) {
             if (parent->n_entries == parent->n_allocated_entries) {
-                unsigned num = parent->n_allocated_entries + 16;
-                void *mem = realloc(parent->entries,
-                                    sizeof(*parent->entries) * num);
+                void *mem = grow_array(parent->entries,
+                                       &parent->n_allocated_entries,
+                                       sizeof(*parent->entries));
                 if (!mem) {
                     fprintf(stderr, "Failed to allocate str/arr entry mem\n");
-                    exit(1);
+                    fail();
                 }
                 parent->entries = (StructArrayItem *) mem;
-                parent->n_allocated_entries = num;
             }
 
             sai = &parent->entries[parent->n_entries];
@@ -1705,73 +2333,49 @@ static enum CXChildVisitResult callback(CXCursor cursor, CXCursor parent,
             sai->index = parent->n_entries > 0 ?
                          parent->entries[parent->n_entries - 1].index + 1 :
                          rec.parent->child_cntr - 1;
-            assert(index_is_unique(parent, sai->index));
             parent->n_entries++;
         }
     }
 
     clang_disposeString(str);
-    clang_disposeTokens(TU, tokens, n_tokens);
-    clang_disposeString(filename);
 
     return CXChildVisit_Continue;
 }
 
-static double eval_expr(CXToken *tokens, unsigned *n, unsigned last);
+static double eval_expr(Token *tokens, unsigned *n, unsigned last);
 
-static double eval_prim(CXToken *tokens, unsigned *n, unsigned last)
+static double eval_prim(Token *tokens, unsigned *n, unsigned last)
 {
-    CXString s;
     const char *str;
     if (*n > last) {
         fprintf(stderr, "Unable to parse an expression primary, no more tokens\n");
-        exit(1);
+        fail();
     }
-    s = clang_getTokenSpelling(TU, tokens[*n]);
-    str = clang_getCString(s);
-    if (!strcmp(str, "-")) {
+    str = tokens[*n].spelling;
+    if (tokens[*n].atom == ATOM_MINUS) {
         (*n)++;
-        clang_disposeString(s);
         return -eval_prim(tokens, n, last);
-    } else if (!strcmp(str, "(")) {
+    } else if (tokens[*n].atom == ATOM_LPAREN) {
         double d;
         (*n)++;
-        clang_disposeString(s);
         if (*n + 1 <= last) {
-            CXString s2;
-            const char *str2;
-            s = clang_getTokenSpelling(TU, tokens[*n]);
-            str = clang_getCString(s);
-            s2 = clang_getTokenSpelling(TU, tokens[*n + 1]);
-            str2 = clang_getCString(s2);
             // This should ideally recognize all built-in types
             // and also check the type name against all typedefs
             // (it also doesn't support two word typnames such as structs.
             // This is enough for handling double casts in DBL_MAX in
             // certain glibc versions though.
-            if (!strcmp(str2, ")") && !strcmp(str, "double")) {
-                clang_disposeString(s);
-                clang_disposeString(s2);
+            if (tokens[*n + 1].atom == ATOM_RPAREN &&
+                tokens[*n].atom == ATOM_DOUBLE) {
                 (*n) += 2;
                 return eval_prim(tokens, n, last);
             }
-            clang_disposeString(s);
-            clang_disposeString(s2);
         }
         d = eval_expr(tokens, n, last);
-        if (*n > last) {
-            fprintf(stderr, "No right parenthesis found\n");
-            exit(1);
-        }
-        s = clang_getTokenSpelling(TU, tokens[*n]);
-        str = clang_getCString(s);
-        if (!strcmp(str, ")")) {
-            clang_disposeString(s);
-            (*n)++;
-        } else {
+        if (*n > last || tokens[*n].atom != ATOM_RPAREN) {
             fprintf(stderr, "No right parenthesis found\n");
-            exit(1);
+            fail();
         }
+        (*n)++;
         return d;
     } else {
         char *end;
@@ -1789,200 +2393,313 @@ static double eval_prim(CXToken *tokens, unsigned *n, unsigned last)
             end++;
         if (*end != '\0') {
             fprintf(stderr, "Unable to parse %s as expression primary\n", str);
-            exit(1);
+            fail();
         }
         (*n)++;
-        clang_disposeString(s);
         return d;
     }
 }
 
-static double eval_term(CXToken *tokens, unsigned *n, unsigned last)
+static double eval_term(Token *tokens, unsigned *n, unsigned last)
 {
     double left = eval_prim(tokens, n, last);
     while (*n <= last) {
-        CXString s = clang_getTokenSpelling(TU, tokens[*n]);
-        const char *str = clang_getCString(s);
-        if (!strcmp(str, "*")) {
+        enum TokenAtom atom = tokens[*n].atom;
+        if (atom == ATOM_STAR) {
             (*n)++;
             left *= eval_prim(tokens, n, last);
-        } else if (!strcmp(str, "/")) {
+        } else if (atom == ATOM_SLASH) {
             (*n)++;
             left /= eval_prim(tokens, n, last);
         } else {
-            clang_disposeString(s);
             return left;
         }
-        clang_disposeString(s);
     }
     return left;
 }
 
-static double eval_expr(CXToken *tokens, unsigned *n, unsigned last)
+static double eval_expr(Token *tokens, unsigned *n, unsigned last)
 {
     double left = eval_term(tokens, n, last);
     while (*n <= last) {
-        CXString s = clang_getTokenSpelling(TU, tokens[*n]);
-        const char *str = clang_getCString(s);
-        if (!strcmp(str, "-")) {
+        enum TokenAtom atom = tokens[*n].atom;
+        if (atom == ATOM_MINUS) {
             (*n)++;
             left -= eval_term(tokens, n, last);
-        } else if (!strcmp(str, "+")) {
+        } else if (atom == ATOM_PLUS) {
             (*n)++;
             left += eval_term(tokens, n, last);
         } else {
-            clang_disposeString(s);
             return left;
         }
-        clang_disposeString(s);
     }
     return left;
 }
 
-static double eval_tokens(CXToken *tokens, unsigned first, unsigned last)
+static double eval_tokens(Token *tokens, unsigned first, unsigned last)
 {
     unsigned n = first;
     double d = eval_expr(tokens, &n, last);
     if (n <= last) {
         fprintf(stderr, "Unable to parse tokens as expression\n");
-        exit(1);
+        fail();
     }
     return d;
 }
 
-static void get_token_position(CXToken token, unsigned *lnum,
+static void get_token_position(Token *token, unsigned *lnum,
                                unsigned *pos, unsigned *off)
 {
-    CXFile file;
-    CXSourceLocation l = clang_getTokenLocation(TU, token);
-    clang_getSpellingLocation(l, &file, lnum, pos, off);
-
-    // clang starts counting at 1 for some reason
-    (*lnum)--;
-    (*pos)--;
+    *lnum = token->line;
+    *pos  = token->col;
+    *off  = token->offset;
 }
 
-static void indent_for_token(CXToken token, unsigned *lnum,
+static void indent_for_token(Token *token, unsigned *lnum,
                              unsigned *pos, unsigned *off)
 {
     unsigned l, p;
     get_token_position(token, &l, &p, off);
-    for (; *lnum < l; (*lnum)++, *pos = 0)
-        fprintf(out, "\n");
-    for (; *pos < p; (*pos)++)
-        fprintf(out, " ");
+    if (*lnum < l) {
+        fill_sink(&ctx->out, '\n', l - *lnum);
+        *lnum = l;
+        *pos = 0;
+    }
+    if (*pos < p) {
+        fill_sink(&ctx->out, ' ', p - *pos);
+        *pos = p;
+    }
 }
 
 static void print_literal_text(const char *str, unsigned *lnum,
                                unsigned *pos)
 {
-    fprintf(out, "%s", str);
-    (*pos) += strlen(str);
+    size_t len = strlen(str);
+
+    write_sink(&ctx->out, str, len);
+    (*pos) += len;
 }
 
-static void print_token(CXToken token, unsigned *lnum,
+static void print_token(Token *token, unsigned *lnum,
                         unsigned *pos)
 {
-    CXString s = clang_getTokenSpelling(TU, token);
-    print_literal_text(clang_getCString(s), lnum, pos);
-    clang_disposeString(s);
+    write_sink(&ctx->out, token->spelling, token->len);
+    (*pos) += token->len;
 }
 
-static unsigned find_token_for_offset(CXToken *tokens, unsigned n_tokens,
+static unsigned find_token_for_offset(Token *tokens, unsigned n_tokens,
                                       unsigned n, unsigned off)
 {
-    for (; n < n_tokens; n++) {
-        unsigned l, p, o;
-        get_token_position(tokens[n], &l, &p, &o);
-        if (o == off)
-            return n;
-    }
+    // token offsets are sorted, so search [n, n_tokens) instead of
+    // walking it - initializer rewrites call this for every entry
+    n += find_first_token_at(&tokens[n], n_tokens - n, off);
+    if (n < n_tokens && tokens[n].offset == off)
+        return n;
 
-    abort();
+    fail();
 }
 
-static unsigned find_value_index(StructArrayList *l, unsigned i)
+/*
+ * Map the indices of l to the entries holding their values, (unsigned) -1
+ * for gaps, in an array of *n_indices. Looking the entry up for each
+ * index instead would make printing a list quadratic in its size.
+ */
+static unsigned *map_value_indices(StructArrayList *l, unsigned *n_indices)
 {
-    unsigned n;
+    unsigned *map, n, max = 0;
 
     if (l->type == TYPE_IRRELEVANT) {
-        return i;
-    } else {
-        for (n = 0; n < l->n_entries; n++) {
-            if (l->entries[n].index == i)
-                return n;
-        }
+        *n_indices = l->n_entries;
+        map = (unsigned *) arena_alloc(*n_indices * sizeof(*map) + 1);
+        for (n = 0; n < l->n_entries; n++)
+            map[n] = n;
+        return map;
+    }
+
+    for (n = 0; n < l->n_entries; n++) {
+        if (l->entries[n].index > max)
+            max = l->entries[n].index;
+    }
+    *n_indices = l->n_entries ? max + 1 : 0;
+    map = (unsigned *) arena_alloc(*n_indices * sizeof(*map) + 1);
+    memset(map, 0xff, *n_indices * sizeof(*map));
+    for (n = 0; n < l->n_entries; n++) {
+        // the same index given twice, e.g. [1] = x, [1] = y
+        CHECK_INPUT(map[l->entries[n].index] == (unsigned) -1);
+        map[l->entries[n].index] = n;
     }
 
-    return -1;
+    return map;
 }
 
-static unsigned find_index_for_level(unsigned level, unsigned index,
-                                     unsigned start)
+/*
+ * The emitter consumes the rewrites found during analysis as a queue of
+ * edit events sorted by offset: the start of each struct/array
+ * initializer list, the current context of each compound literal, and
+ * the points where extra scopes are closed. Since tokens are almost
+ * always printed in order, finding the events for a token is a matter of
+ * stepping the queue cursor forward; only values printed out of order
+ * (see replace_struct_array()) make it seek.
+ *
+ * A compound literal's context.start moves while it is being replaced,
+ * but only ever to its cast_token.start or its context.end. So rather
+ * than re-sorting the queue (or keeping a heap) whenever it moves, the
+ * queue holds an event for each of these offsets up front, and an event
+ * only applies while the literal's context.start is at its offset. The
+ * events at context.end sort first, so that a literal that was moved
+ * there is handled before any literal whose context starts there.
+ */
+enum EditEventType {
+    EVENT_STRUCT_ARRAY      = 0,
+    EVENT_COMP_LITERAL_END  = 1,
+    EVENT_COMP_LITERAL_CAST = 2,
+    EVENT_COMP_LITERAL      = 3,
+    EVENT_END_SCOPE         = 4,
+};
+
+#define IS_COMP_LITERAL_EVENT(type) \
+    ((type) >= EVENT_COMP_LITERAL_END && (type) <= EVENT_COMP_LITERAL)
+
+typedef struct EditEvent {
+    unsigned offset;
+    enum EditEventType type;
+    unsigned idx;
+} EditEvent;
+
+typedef struct {
+    unsigned ev; // first event at or after the last looked up offset
+    unsigned es; // next event to check for end scopes
+} EditQueue;
+
+static void add_edit_event(unsigned offset, enum EditEventType type,
+                           unsigned idx)
 {
-    unsigned n, cnt = 0;
+    EditEvent *e;
 
-    for (n = start; n < n_struct_array_lists; n++) {
-        if (struct_array_lists[n].level < level) {
-            return n;
-        } else if (struct_array_lists[n].level == level) {
-            if (cnt++ == index)
-                return n;
+    if (ctx->n_edit_events == ctx->n_allocated_edit_events) {
+        void *mem = grow_array(ctx->edit_events, &ctx->n_allocated_edit_events,
+                               sizeof(*ctx->edit_events));
+        if (!mem) {
+            fprintf(stderr, "Failed to allocate memory for edit events\n");
+            fail();
         }
+        ctx->edit_events = (EditEvent *) mem;
     }
 
-    return n_struct_array_lists;
+    e = &ctx->edit_events[ctx->n_edit_events++];
+    e->offset = offset;
+    e->type   = type;
+    e->idx    = idx;
 }
 
-static void reorder_compound_literal_list(unsigned n)
+static int compare_edit_events(const void *a, const void *b)
 {
-    if (!n_comp_literal_lists)
-        return;
+    const EditEvent *e1 = (const EditEvent *) a;
+    const EditEvent *e2 = (const EditEvent *) b;
+
+    if (e1->offset != e2->offset)
+        return e1->offset < e2->offset ? -1 : 1;
+    if (e1->type != e2->type)
+        return e1->type < e2->type ? -1 : 1;
+    if (e1->idx != e2->idx)
+        return e1->idx < e2->idx ? -1 : 1;
+    return 0;
+}
 
-    // FIXME probably slow - quicksort?
-    for (; n < n_comp_literal_lists - 1; n++) {
-        unsigned l, lowest = n;
+static void build_edit_queue(EditQueue *q)
+{
+    unsigned n;
 
-        // find the lowest
-        for (l = n + 1; l < n_comp_literal_lists; l++) {
-            if (comp_literal_lists[l].context.start <
-                comp_literal_lists[lowest].context.start) {
-                lowest = l;
-            }
-        }
+    for (n = 0; n < ctx->n_struct_array_lists; n++)
+        add_edit_event(ctx->struct_array_lists[n].value_offset.start,
+                       EVENT_STRUCT_ARRAY, n);
+    for (n = 0; n < ctx->n_comp_literal_lists; n++) {
+        CompoundLiteralList *l = &ctx->comp_literal_lists[n];
+
+        if (l->type == TYPE_UNKNOWN)
+            continue;
+        add_edit_event(l->context.start, EVENT_COMP_LITERAL, n);
+        if (l->cast_token.start != l->context.start)
+            add_edit_event(l->cast_token.start, EVENT_COMP_LITERAL_CAST, n);
+        if (l->context.end != l->context.start &&
+            l->context.end != l->cast_token.start)
+            add_edit_event(l->context.end, EVENT_COMP_LITERAL_END, n);
+    }
+    for (n = 0; n < ctx->n_end_scopes; n++)
+        add_edit_event(ctx->end_scopes[n].end > 0 ? ctx->end_scopes[n].end - 1 : 0,
+                       EVENT_END_SCOPE, n);
+    qsort(ctx->edit_events, ctx->n_edit_events, sizeof(*ctx->edit_events),
+          compare_edit_events);
+
+    q->ev = q->es = 0;
+}
 
-        // move it in place
-        if (lowest != n) {
-            CompoundLiteralList bak = comp_literal_lists[lowest];
-            memmove(&comp_literal_lists[n + 1], &comp_literal_lists[n],
-                    sizeof(comp_literal_lists[0]) * (lowest - n));
-            comp_literal_lists[n] = bak;
+/* first event in [lo, hi) sorting at or after (offset, type) */
+static unsigned find_edit_event(unsigned lo, unsigned hi, unsigned offset,
+                                enum EditEventType type)
+{
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (ctx->edit_events[mid].offset < offset ||
+            (ctx->edit_events[mid].offset == offset &&
+             ctx->edit_events[mid].type < type)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
+
+    return lo;
+}
+
+static void seek_edit_queue(EditQueue *q, unsigned off)
+{
+    if (q->ev > 0 && ctx->edit_events[q->ev - 1].offset >= off) {
+        // printing values out of order, seek back
+        q->ev = find_edit_event(0, q->ev - 1, off, EVENT_STRUCT_ARRAY);
+    } else if (q->ev < ctx->n_edit_events && ctx->edit_events[q->ev].offset < off) {
+        q->ev = find_edit_event(q->ev + 1, ctx->n_edit_events, off,
+                                EVENT_STRUCT_ARRAY);
+    }
 }
 
-static void print_token_wrapper(CXToken *tokens, unsigned n_tokens,
+/*
+ * The replacements print the values they move around through
+ * print_token_wrapper(), so that the edits inside a value apply wherever it
+ * ends up: a designated value printed at the position of its member, or a
+ * compound literal's value printed where its temporary is declared. This
+ * recursion is kept rather than flattened into the loop of print_tokens(),
+ * as the nesting of the values is what orders their edits, and a single
+ * forward cursor can't follow values that are printed out of order anyway.
+ *
+ * It doesn't cost more than a forward loop would: a replacement skips the
+ * tokens it printed in their original place, so each token is printed
+ * once, wherever its value ends up. Each print seeks the queue, which
+ * steps forward in order and takes a binary search after a jump, and the
+ * token and value lookups are binary searches or table lookups, so
+ * printing is O(tokens log events), plus the zeros filling gaps in the
+ * lists.
+ */
+static void print_token_wrapper(Token *tokens, unsigned n_tokens,
                                 unsigned *n, unsigned *lnum, unsigned *cpos,
-                                unsigned *saidx, unsigned *clidx, unsigned *esidx,
-                                unsigned off);
+                                EditQueue *q, unsigned off);
 
 static void declare_variable(CompoundLiteralList *l, unsigned cur_tok_off,
-                             unsigned *clidx, unsigned *_saidx, unsigned *esidx,
-                             CXToken *tokens, unsigned n_tokens,
+                             EditQueue *q, Token *tokens, unsigned n_tokens,
                              const char *var_name, unsigned *lnum,
                              unsigned *cpos)
 {
-    unsigned idx1, idx2, off, n, saidx = *_saidx;
+    unsigned idx1, idx2, off, n;
 
     /* type information, e.g. 'int' or 'struct AVRational' */
     idx1 = find_token_for_offset(tokens, n_tokens, cur_tok_off,
                                  l->cast_token.start);
     idx2 = find_token_for_offset(tokens, n_tokens, cur_tok_off,
                                  l->cast_token_array_start);
-    get_token_position(tokens[idx1 + 1], lnum, cpos, &off);
+    get_token_position(&tokens[idx1 + 1], lnum, cpos, &off);
     for (n = idx1 + 1; n <= idx2 - 1; n++) {
-        indent_for_token(tokens[n], lnum, cpos, &off);
-        print_token(tokens[n], lnum, cpos);
+        indent_for_token(&tokens[n], lnum, cpos, &off);
+        print_token(&tokens[n], lnum, cpos);
     }
 
     /* variable name and array tokens, e.g. 'tmp[]' */
@@ -1991,8 +2708,8 @@ static void declare_variable(CompoundLiteralList *l, unsigned cur_tok_off,
     idx1 = find_token_for_offset(tokens, n_tokens, cur_tok_off,
                                  l->cast_token.end);
     for (n = idx2; n <= idx1 - 1; n++) {
-        indent_for_token(tokens[n], lnum, cpos, &off);
-        print_token(tokens[n], lnum, cpos);
+        indent_for_token(&tokens[n], lnum, cpos, &off);
+        print_token(&tokens[n], lnum, cpos);
     }
     print_literal_text(" = ", lnum, cpos);
 
@@ -2001,31 +2718,23 @@ static void declare_variable(CompoundLiteralList *l, unsigned cur_tok_off,
                                  l->value_token.start);
     idx2 = find_token_for_offset(tokens, n_tokens, cur_tok_off,
                                  l->value_token.end);
-    get_token_position(tokens[idx1], lnum, cpos, &off);
-    while (saidx < n_struct_array_lists &&
-           struct_array_lists[saidx].value_offset.start < off)
-        saidx++;
+    get_token_position(&tokens[idx1], lnum, cpos, &off);
     for (n = idx1; n <= idx2; n++) {
-        indent_for_token(tokens[n], lnum, cpos, &off);
-        print_token_wrapper(tokens, n_tokens, &n, lnum, cpos,
-                            &saidx, clidx, esidx, off);
+        indent_for_token(&tokens[n], lnum, cpos, &off);
+        print_token_wrapper(tokens, n_tokens, &n, lnum, cpos, q, off);
     }
 }
 
-static void replace_comp_literal(CompoundLiteralList *l,
-                                 unsigned *clidx, unsigned *saidx, unsigned *esidx,
+static void replace_comp_literal(CompoundLiteralList *l, EditQueue *q,
                                  unsigned *lnum, unsigned *cpos, unsigned *_n,
-                                 CXToken *tokens, unsigned n_tokens)
+                                 Token *tokens, unsigned n_tokens)
 {
-    static unsigned unique_cntr = 0;
-
     if (l->type == TYPE_OMIT_CAST) {
         unsigned off;
 
         *_n = find_token_for_offset(tokens, n_tokens, *_n,
                                     l->cast_token.end);
-        get_token_position(tokens[*_n + 1], lnum, cpos, &off);
-        (*clidx)++;
+        get_token_position(&tokens[*_n + 1], lnum, cpos, &off);
     } else if (l->type == TYPE_TEMP_ASSIGN) {
         if (l->context.start < l->cast_token.start) {
             unsigned off;
@@ -2033,35 +2742,32 @@ static void replace_comp_literal(CompoundLiteralList *l,
 
             // open a new context, so we can declare a new variable
             print_literal_text("{ ", lnum, cpos);
-            snprintf(tmp, sizeof(tmp), "tmp__%u", unique_cntr++);
-            l->data.t_c_d.tmp_var_name = strdup(tmp);
-            declare_variable(l, *_n, clidx, saidx, esidx,
-                             tokens, n_tokens, tmp, lnum, cpos);
+            snprintf(tmp, sizeof(tmp), "tmp__%u", ctx->unique_cntr++);
+            l->data.t_c_d.tmp_var_name = arena_strdup(tmp);
+            declare_variable(l, *_n, q, tokens, n_tokens, tmp, lnum, cpos);
             print_literal_text("; ", lnum, cpos);
 
-            // re-insert in list now for replacement of the variable
+            // move on to the cast token now for replacement of the variable
             // reference (instead of the actual CL)
             l->context.start = l->cast_token.start;
-            reorder_compound_literal_list(l - comp_literal_lists);
-            get_token_position(tokens[*_n], lnum, cpos, &off);
+            get_token_position(&tokens[*_n], lnum, cpos, &off);
             (*_n)--;
         } else if (l->context.start == l->cast_token.start) {
             // FIXME duplicate of code in TYPE_CONST_DECL
             unsigned off;
-            char *tmp_var_name = l->data.t_c_d.tmp_var_name;
 
             // replace original CL with a reference to the
             // newly declared static const variable
-            print_literal_text(tmp_var_name, lnum, cpos);
+            print_literal_text(l->data.t_c_d.tmp_var_name, lnum, cpos);
             l->data.t_c_d.tmp_var_name = NULL;
-            free(tmp_var_name);
             *_n = find_token_for_offset(tokens, n_tokens, *_n,
                                         l->value_token.end);
-            get_token_position(tokens[*_n + 1], lnum, cpos, &off);
+            get_token_position(&tokens[*_n + 1], lnum, cpos, &off);
             l->context.start = l->context.end;
-            reorder_compound_literal_list(l - comp_literal_lists);
         } else {
-            print_token(tokens[*_n], lnum, cpos);
+            unsigned e;
+
+            print_token(&tokens[*_n], lnum, cpos);
 
             {
                 // Bugfix. Consider preprocessor directives, don't insert closing }
@@ -2069,28 +2775,28 @@ static void replace_comp_literal(CompoundLiteralList *l,
                 unsigned tok_lnum = *lnum;
                 unsigned tok_pos = *cpos;
                 unsigned off;
-                get_token_position(tokens[*_n + 1], &tok_lnum, &tok_pos, &off);
+                get_token_position(&tokens[*_n + 1], &tok_lnum, &tok_pos, &off);
                 if (tok_lnum > *lnum)
                 {
-                    // Get previous token spelling.
-                    CXString s = clang_getTokenSpelling(TU, tokens[*_n]);
-                    const char * spelling = clang_getCString(s);
-                    if (strcmp(spelling, ";") && strcmp(spelling, "}"))
+                    // Check the previous token.
+                    enum TokenAtom atom = tokens[*_n].atom;
+                    if (atom != ATOM_SEMICOLON && atom != ATOM_RBRACE)
                     {
                         print_literal_text("\n", lnum, cpos);
                         (*lnum)++;
                         *cpos = 0;
                     }
-                    clang_disposeString(s);
                 }
             }
 
             // multiple contexts may want to close here - close all at once
-            do {
-                print_literal_text(" }", lnum, cpos);
-                (*clidx)++;
-            } while (*clidx < n_comp_literal_lists &&
-                     comp_literal_lists[*clidx].context.start == l->context.start);
+            for (e = q->ev; e < ctx->n_edit_events &&
+                 ctx->edit_events[e].offset == l->context.start; e++) {
+                if (IS_COMP_LITERAL_EVENT(ctx->edit_events[e].type) &&
+                    ctx->comp_literal_lists[ctx->edit_events[e].idx].context.start ==
+                    l->context.start)
+                    print_literal_text(" }", lnum, cpos);
+            }
         }
     } else if (l->type == TYPE_CONST_DECL) {
         if (l->context.start < l->cast_token.start) {
@@ -2099,32 +2805,27 @@ static void replace_comp_literal(CompoundLiteralList *l,
 
             // declare static const variable
             print_literal_text("static ", lnum, cpos);
-            snprintf(tmp, sizeof(tmp), "tmp__%u", unique_cntr++);
-            l->data.t_c_d.tmp_var_name = strdup(tmp);
-            declare_variable(l, *_n, clidx, saidx, esidx,
-                             tokens, n_tokens, tmp, lnum, cpos);
+            snprintf(tmp, sizeof(tmp), "tmp__%u", ctx->unique_cntr++);
+            l->data.t_c_d.tmp_var_name = arena_strdup(tmp);
+            declare_variable(l, *_n, q, tokens, n_tokens, tmp, lnum, cpos);
             print_literal_text(";", lnum, cpos);
 
-            // re-insert in list now for replacement of the variable
+            // move on to the cast token now for replacement of the variable
             // reference (instead of the actual CL)
             l->context.start = l->cast_token.start;
-            reorder_compound_literal_list(l - comp_literal_lists);
             (*_n)--;
-            get_token_position(tokens[*_n], lnum, cpos, &off);
+            get_token_position(&tokens[*_n], lnum, cpos, &off);
         } else {
             // FIXME duplicate of code in TYPE_TEMP_ASSIGN
             unsigned off;
-            char *tmp_var_name = l->data.t_c_d.tmp_var_name;
 
             // replace original CL with a reference to the
             // newly declared static const variable
-            print_literal_text(tmp_var_name, lnum, cpos);
+            print_literal_text(l->data.t_c_d.tmp_var_name, lnum, cpos);
             l->data.t_c_d.tmp_var_name = NULL;
-            free(tmp_var_name);
             *_n = find_token_for_offset(tokens, n_tokens, *_n,
                                         l->value_token.end);
-            get_token_position(tokens[*_n + 1], lnum, cpos, &off);
-            (*clidx)++;
+            get_token_position(&tokens[*_n + 1], lnum, cpos, &off);
         }
     } else if (l->type == TYPE_NEW_CONTEXT) {
         if (l->context.start == l->cast_token.start) {
@@ -2136,10 +2837,9 @@ static void replace_comp_literal(CompoundLiteralList *l,
             // and initialization here, and then to actually empty out the
             // original location where the variable initialization/declaration
             // happened
-            l->context.start = l->context.end;
             l->type = TYPE_TEMP_ASSIGN;
-            reorder_compound_literal_list(l - comp_literal_lists);
-            get_token_position(tokens[*_n], lnum, cpos, &off);
+            l->context.start = l->context.end;
+            get_token_position(&tokens[*_n], lnum, cpos, &off);
             (*_n)--;
         }
     } else if (l->type == TYPE_LOOP_CONTEXT) {
@@ -2153,95 +2853,90 @@ static void replace_comp_literal(CompoundLiteralList *l,
                                          l->cast_token.start);
             idx2 = find_token_for_offset(tokens, n_tokens, *_n,
                                          l->cast_token.end);
-            get_token_position(tokens[idx1], lnum, cpos, &off);
+            get_token_position(&tokens[idx1], lnum, cpos, &off);
             for (n = idx1; n <= idx2; n++) {
-                indent_for_token(tokens[n], lnum, cpos, &off);
-                print_token(tokens[n], lnum, cpos);
+                indent_for_token(&tokens[n], lnum, cpos, &off);
+                print_token(&tokens[n], lnum, cpos);
             }
             print_literal_text("; ", lnum, cpos);
-            get_token_position(tokens[*_n], lnum, cpos, &off);
+            get_token_position(&tokens[*_n], lnum, cpos, &off);
             (*_n)--;
         } else if (l->context.start == l->cast_token.start) {
             unsigned off;
 
             // remove variable declaration/init, remove ',' if present
-            l->context.start = l->context.end;
             l->type = TYPE_TEMP_ASSIGN;
+            l->context.start = l->context.end;
             (*_n)--;
             do {
                 (*_n)++;
-                get_token_position(tokens[*_n], lnum, cpos, &off);
+                get_token_position(&tokens[*_n], lnum, cpos, &off);
             } while (off < l->cast_token.end);
-            reorder_compound_literal_list(l - comp_literal_lists);
         }
     }
 }
 
-static void replace_struct_array(unsigned *_saidx, unsigned *_clidx, unsigned *esidx,
+static void replace_struct_array(unsigned saidx, EditQueue *q,
                                  unsigned *lnum, unsigned *cpos, unsigned *_n,
-                                 CXToken *tokens, unsigned n_tokens)
+                                 Token *tokens, unsigned n_tokens)
 {
-    unsigned saidx = *_saidx, off, i, n = *_n, j;
-    StructArrayList *sal = &struct_array_lists[saidx];
+    unsigned off, i, n = *_n, j, n_indices;
+    unsigned *value_idx;
+    StructArrayList *sal = &ctx->struct_array_lists[saidx];
     StructDeclaration *decl = sal->struct_decl_idx != (unsigned) -1 ?
-                              &structs[sal->struct_decl_idx] : NULL;
+                              &ctx->structs[sal->struct_decl_idx] : NULL;
     int is_union = decl ? decl->is_union : 0;
 
     if (sal->convert_to_assignment) {
-        CXString spelling;
         print_literal_text(";", lnum, cpos);
         for (i = 0; i < sal->n_entries; i++) {
             StructArrayItem *sai = &sal->entries[i];
             unsigned token_start = find_token_for_offset(tokens, n_tokens, *_n, sai->value_offset.start);
             unsigned token_end   = find_token_for_offset(tokens, n_tokens, *_n, sai->value_offset.end);
-            unsigned saidx2 = 0;
 
             print_literal_text(sal->name, lnum, cpos);
             print_literal_text(".", lnum, cpos);
-            print_literal_text(structs[sal->struct_decl_idx].entries[sai->index].name, lnum, cpos);
+            print_literal_text(ctx->structs[sal->struct_decl_idx].entries[sai->index].name, lnum, cpos);
             print_literal_text("=", lnum, cpos);
-            get_token_position(tokens[token_start], lnum, cpos, &off);
+            get_token_position(&tokens[token_start], lnum, cpos, &off);
             for (n = token_start; n <= token_end; n++)
-                print_token_wrapper(tokens, n_tokens, &n, lnum, cpos,
-                                    &saidx2, _clidx, esidx, off);
+                print_token_wrapper(tokens, n_tokens, &n, lnum, cpos, q, off);
             print_literal_text(";", lnum, cpos);
         }
         n = find_token_for_offset(tokens, n_tokens, *_n,
-                                  struct_array_lists[saidx].value_offset.end);
+                                  ctx->struct_array_lists[saidx].value_offset.end);
         *_n = n;
         print_literal_text("{", lnum, cpos);
 
         // adjust token index and position back
-        get_token_position(tokens[n], lnum, cpos, &off);
-        spelling = clang_getTokenSpelling(TU, tokens[n]);
-        (*cpos) += strlen(clang_getCString(spelling));
-        clang_disposeString(spelling);
+        get_token_position(&tokens[n], lnum, cpos, &off);
+        (*cpos) += tokens[n].len;
         return;
     }
 
     // we assume here the indenting for the first opening token,
     // i.e. the '{', is already taken care of
-    print_token(tokens[n++], lnum, cpos);
-    indent_for_token(tokens[n], lnum, cpos, &off);
+    print_token(&tokens[n++], lnum, cpos);
+    indent_for_token(&tokens[n], lnum, cpos, &off);
 
-    for (i = 0; i < struct_array_lists[saidx].n_entries; i++)
-      assert(struct_array_lists[saidx].entries[i].index != (unsigned) -1);
+    for (i = 0; i < ctx->struct_array_lists[saidx].n_entries; i++)
+      CHECK_INPUT(ctx->struct_array_lists[saidx].entries[i].index != (unsigned) -1);
+    value_idx = map_value_indices(sal, &n_indices);
 
-    for (j = 0, i = 0; i < struct_array_lists[saidx].n_entries; j++) {
-        unsigned expr_off_s, expr_off_e, val_idx, val_off_s, val_off_e, saidx2,
+    for (j = 0, i = 0; i < ctx->struct_array_lists[saidx].n_entries; j++) {
+        unsigned expr_off_s, expr_off_e, val_idx, val_off_s, val_off_e,
                  indent_token_end, next_indent_token_start, val_token_start,
                  val_token_end;
         int print_normal = 1;
-        CXString spelling;
         StructMember *member = decl ? &decl->entries[j] : NULL;
 
-        val_idx = find_value_index(&struct_array_lists[saidx], j);
+        val_idx = j < n_indices ? value_idx[j] : (unsigned) -1;
 
-        assert(struct_array_lists[saidx].array_depth > 0 ||
-               j < structs[struct_array_lists[saidx].struct_decl_idx].n_entries);
+        CHECK_INPUT(ctx->struct_array_lists[saidx].array_depth > 0 ||
+                    j < ctx->structs[ctx->struct_array_lists[saidx].struct_decl_idx].n_entries);
         if (val_idx == (unsigned) -1) {
-            unsigned depth = struct_array_lists[saidx].array_depth;
-            unsigned idx = struct_array_lists[saidx].struct_decl_idx;
+            unsigned depth = ctx->struct_array_lists[saidx].array_depth;
+            unsigned idx = ctx->struct_array_lists[saidx].struct_decl_idx;
             if (is_union) // Don't print the filler zeros for unions
                 continue;
             if (depth > 1) {
@@ -2252,32 +2947,28 @@ static void replace_struct_array(unsigned *_saidx, unsigned *_clidx, unsigned *e
                 } else {
                     print_literal_text("0", lnum, cpos);
                 }
-            } else if ((structs[idx].entries[j].struct_decl_idx != (unsigned) -1 &&
-                        structs[idx].entries[j].n_ptrs == 0) ||
-                       structs[idx].entries[j].array_depth) {
+            } else if ((ctx->structs[idx].entries[j].struct_decl_idx != (unsigned) -1 &&
+                        ctx->structs[idx].entries[j].n_ptrs == 0) ||
+                       ctx->structs[idx].entries[j].array_depth) {
                 print_literal_text("{ 0 }", lnum, cpos);
             } else {
                 print_literal_text("0", lnum, cpos);
             }
             print_literal_text(", ", lnum, cpos);
+            ctx->stats.gap_fillers++;
             continue; // gap
         }
 
-        expr_off_e = struct_array_lists[saidx].entries[i].expression_offset.end;
+        expr_off_e = ctx->struct_array_lists[saidx].entries[i].expression_offset.end;
         next_indent_token_start = find_token_for_offset(tokens, n_tokens, *_n,
                                                         expr_off_e);
-        val_off_s = struct_array_lists[saidx].entries[val_idx].value_offset.start;
+        val_off_s = ctx->struct_array_lists[saidx].entries[val_idx].value_offset.start;
         val_token_start = find_token_for_offset(tokens, n_tokens, *_n, val_off_s);
-        val_off_e = struct_array_lists[saidx].entries[val_idx].value_offset.end;
+        val_off_e = ctx->struct_array_lists[saidx].entries[val_idx].value_offset.end;
         val_token_end = find_token_for_offset(tokens, n_tokens, *_n, val_off_e);
-        saidx2 = find_index_for_level(struct_array_lists[saidx].level + 1,
-                                      val_idx, saidx + 1);
-        if (saidx2 < n_struct_array_lists &&
-            struct_array_lists[saidx2].level < struct_array_lists[saidx].level)
-            saidx2 = n_struct_array_lists;
 
         // adjust position
-        get_token_position(tokens[val_token_start], lnum, cpos, &off);
+        get_token_position(&tokens[val_token_start], lnum, cpos, &off);
 
         if (is_union && j != 0) {
             StructMember *first_member = &decl->entries[0];
@@ -2285,7 +2976,7 @@ static void replace_struct_array(unsigned *_saidx, unsigned *_clidx, unsigned *e
                  !strcmp(first_member->type, "float")) && !first_member->n_ptrs) {
                 fprintf(stderr, "Can't convert type %s to %s for union\n",
                         member->type, first_member->type);
-                exit(1);
+                fail();
             }
             if (first_member->n_ptrs)
                 print_literal_text("(void*) ", lnum, cpos);
@@ -2317,302 +3008,585 @@ static void replace_struct_array(unsigned *_saidx, unsigned *_clidx, unsigned *e
         }
         // print values out of order
         for (n = val_token_start; n <= val_token_end && print_normal; n++) {
-            print_token_wrapper(tokens, n_tokens, &n, lnum, cpos,
-                                &saidx2, _clidx, esidx, off);
+            print_token_wrapper(tokens, n_tokens, &n, lnum, cpos, q, off);
             if (n != val_token_end)
-                indent_for_token(tokens[n + 1], lnum, cpos, &off);
+                indent_for_token(&tokens[n + 1], lnum, cpos, &off);
         }
 
         // adjust token index and position back
         n = next_indent_token_start;
-        get_token_position(tokens[n], lnum, cpos, &off);
-        spelling = clang_getTokenSpelling(TU, tokens[n]);
-        (*cpos) += strlen(clang_getCString(spelling));
-        clang_disposeString(spelling);
+        get_token_position(&tokens[n], lnum, cpos, &off);
+        (*cpos) += tokens[n].len;
         n++;
 
-        if (++i < struct_array_lists[saidx].n_entries) {
-            expr_off_s = struct_array_lists[saidx].entries[i].expression_offset.start;
+        if (++i < ctx->struct_array_lists[saidx].n_entries) {
+            expr_off_s = ctx->struct_array_lists[saidx].entries[i].expression_offset.start;
             indent_token_end = find_token_for_offset(tokens, n_tokens, *_n, expr_off_s);
         } else {
             indent_token_end = find_token_for_offset(tokens, n_tokens, *_n,
-                                                     struct_array_lists[saidx].value_offset.end);
+                                                     ctx->struct_array_lists[saidx].value_offset.end);
         }
 
         if (is_union) // Unions should be initialized by only one element
             break;
 
         if (n < indent_token_end)
-            indent_for_token(tokens[n], lnum, cpos, &off);
+            indent_for_token(&tokens[n], lnum, cpos, &off);
         for (; n < indent_token_end; n++) {
-            print_token(tokens[n], lnum, cpos);
-            indent_for_token(tokens[n + 1], lnum, cpos, &off);
+            print_token(&tokens[n], lnum, cpos);
+            indent_for_token(&tokens[n + 1], lnum, cpos, &off);
         }
     }
 
-    // update *saidx
-    *_saidx = find_index_for_level(struct_array_lists[saidx].level, 1, saidx);
-
     // print '}' closing token
     n = find_token_for_offset(tokens, n_tokens, *_n,
-                              struct_array_lists[saidx].value_offset.end);
-    indent_for_token(tokens[n], lnum, cpos, &off);
-    print_token(tokens[n], lnum, cpos);
+                              ctx->struct_array_lists[saidx].value_offset.end);
+    indent_for_token(&tokens[n], lnum, cpos, &off);
+    print_token(&tokens[n], lnum, cpos);
     *_n = n;
 }
 
-static void print_token_wrapper(CXToken *tokens, unsigned n_tokens,
+static void print_token_wrapper(Token *tokens, unsigned n_tokens,
                                 unsigned *n, unsigned *lnum, unsigned *cpos,
-                                unsigned *saidx, unsigned *clidx, unsigned *esidx,
-                                unsigned off)
-{
-    *saidx = 0;
-    while (*saidx < n_struct_array_lists &&
-           struct_array_lists[*saidx].value_offset.start < off)
-        (*saidx)++;
-    *clidx = 0;
-    while (*clidx < n_comp_literal_lists &&
-           (comp_literal_lists[*clidx].type == TYPE_UNKNOWN ||
-            comp_literal_lists[*clidx].context.start < off))
-        (*clidx)++;
-
-    if (*saidx < n_struct_array_lists &&
-        off == struct_array_lists[*saidx].value_offset.start) {
-        if (struct_array_lists[*saidx].type == TYPE_IRRELEVANT ||
-            struct_array_lists[*saidx].n_entries == 0) {
-            (*saidx)++;
-            print_token(tokens[*n], lnum, cpos);
-        } else {
-            replace_struct_array(saidx, clidx, esidx, lnum, cpos, n,
-                                 tokens, n_tokens);
+                                EditQueue *q, unsigned off)
+{
+    EditEvent *e = NULL;
+    unsigned ev;
+
+    // find the struct array, or a compound literal currently in a context
+    // starting at this token
+    seek_edit_queue(q, off);
+    for (ev = q->ev; ev < ctx->n_edit_events && ctx->edit_events[ev].offset == off;
+         ev++) {
+        if (ctx->edit_events[ev].type == EVENT_STRUCT_ARRAY ||
+            (IS_COMP_LITERAL_EVENT(ctx->edit_events[ev].type) &&
+             ctx->comp_literal_lists[ctx->edit_events[ev].idx].context.start == off)) {
+            e = &ctx->edit_events[ev];
+            q->ev = ev;
+            break;
         }
-    } else if (*clidx < n_comp_literal_lists &&
-               off == comp_literal_lists[*clidx].context.start) {
-        if (comp_literal_lists[*clidx].type == TYPE_UNKNOWN) {
-            print_token(tokens[*n], lnum, cpos);
+    }
+
+    if (e && e->type == EVENT_STRUCT_ARRAY) {
+        StructArrayList *sal = &ctx->struct_array_lists[e->idx];
+        if (sal->type == TYPE_IRRELEVANT || sal->n_entries == 0) {
+            print_token(&tokens[*n], lnum, cpos);
         } else {
-            replace_comp_literal(&comp_literal_lists[*clidx],
-                                 clidx, saidx, esidx, lnum, cpos, n,
-                                 tokens, n_tokens);
+            replace_struct_array(e->idx, q, lnum, cpos, n, tokens, n_tokens);
         }
-        while (*clidx < n_comp_literal_lists &&
-               comp_literal_lists[*clidx].type == TYPE_UNKNOWN)
-            (*clidx)++;
+    } else if (e) {
+        replace_comp_literal(&ctx->comp_literal_lists[e->idx], q,
+                             lnum, cpos, n, tokens, n_tokens);
     } else {
-        print_token(tokens[*n], lnum, cpos);
+        print_token(&tokens[*n], lnum, cpos);
     }
 
-    while (*esidx < n_end_scopes && off >= end_scopes[*esidx].end - 1) {
+    for (; q->es < ctx->n_edit_events; q->es++) {
         int i;
-        for (i = 0; i < end_scopes[*esidx].n_scopes; i++)
+
+        e = &ctx->edit_events[q->es];
+        if (e->type != EVENT_END_SCOPE)
+            continue;
+        if (off < e->offset)
+            break;
+        for (i = 0; i < ctx->end_scopes[e->idx].n_scopes; i++)
             print_literal_text("}", lnum, cpos);
-        (*cpos) -= end_scopes[*esidx].n_scopes;
-        (*esidx)++;
+        (*cpos) -= ctx->end_scopes[e->idx].n_scopes;
     }
 }
 
-static void print_tokens(CXToken *tokens, unsigned n_tokens)
+static int token_matches_source(Token *token)
 {
-    unsigned cpos = 0, lnum = 0, n, saidx = 0, clidx = 0, esidx = 0, off;
+    return token->offset + token->len <= ctx->src.size &&
+           !memcmp(&ctx->src.buf[token->offset], token->spelling, token->len);
+}
+
+/*
+ * Most tokens are not touched by any edit. If the token at n was just
+ * printed in place, copy the tokens following it up to the next pending
+ * edit straight from the input, along with the whitespace and comments
+ * between them. Returns the index of the last token copied.
+ */
+static unsigned copy_unchanged_tokens(Token *tokens, unsigned n_tokens,
+                                      unsigned n, unsigned *lnum,
+                                      unsigned *cpos, EditQueue *q)
+{
+    Token *t;
+    unsigned next = (unsigned) -1, ev, m;
+    size_t start;
+
+    // n is (unsigned) -1 if token 0 is about to be printed again
+    if (!ctx->src.buf || n >= n_tokens || n + 1 >= n_tokens)
+        return n;
+    t = &tokens[n];
+    if (*lnum != t->line || *cpos != t->col + t->len)
+        return n;
+
+    // end scopes are closed after the first token at or after their offset
+    if (q->es < ctx->n_edit_events)
+        next = ctx->edit_events[q->es].offset;
+    seek_edit_queue(q, tokens[n + 1].offset);
+    for (ev = q->ev; ev < ctx->n_edit_events && ctx->edit_events[ev].offset < next;
+         ev++) {
+        EditEvent *e = &ctx->edit_events[ev];
+        if (e->type == EVENT_STRUCT_ARRAY ||
+            (IS_COMP_LITERAL_EVENT(e->type) &&
+             ctx->comp_literal_lists[e->idx].context.start == e->offset)) {
+            next = e->offset;
+            break;
+        }
+    }
 
-    reorder_compound_literal_list(0);
+    m = n + find_first_token_at(&tokens[n + 1], n_tokens - n - 1, next);
+    if (m == n || !token_matches_source(t) || !token_matches_source(&tokens[m]))
+        return n;
+
+    start = t->offset + t->len;
+    write_sink(&ctx->out, &ctx->src.buf[start], tokens[m].offset + tokens[m].len - start);
+    *lnum = tokens[m].line;
+    *cpos = tokens[m].col + tokens[m].len;
+
+    return m;
+}
+
+static void print_tokens(Token *tokens, unsigned n_tokens)
+{
+    unsigned cpos = 0, lnum = 0, n, off;
+    EditQueue q;
+
+    build_edit_queue(&q);
 
     for (n = 0; n < n_tokens; n++) {
-        indent_for_token(tokens[n], &lnum, &cpos, &off);
-        print_token_wrapper(tokens, n_tokens, &n,
-                            &lnum, &cpos, &saidx, &clidx, &esidx, off);
+        indent_for_token(&tokens[n], &lnum, &cpos, &off);
+        print_token_wrapper(tokens, n_tokens, &n, &lnum, &cpos, &q, off);
+        n = copy_unchanged_tokens(tokens, n_tokens, n, &lnum, &cpos, &q);
     }
 
     // each file ends with a newline
-    fprintf(out, "\n");
+    write_sink(&ctx->out, "\n", 1);
 }
 
-static void cleanup(void)
+static void dump_registries(void)
 {
     unsigned n, m;
 
-#define DEBUG 0
-    dprintf("N compound literals: %d\n", n_comp_literal_lists);
-    for (n = 0; n < n_comp_literal_lists; n++) {
-        dprintf("[%d]: type=%d, struct=%d (%s), variable range=%u-%u\n",
-                n, comp_literal_lists[n].type,
-                comp_literal_lists[n].struct_decl_idx,
-                comp_literal_lists[n].struct_decl_idx != (unsigned) -1 ?
-                    structs[comp_literal_lists[n].struct_decl_idx].name : "<none>",
-                comp_literal_lists[n].value_token.start,
-                comp_literal_lists[n].value_token.end);
-    }
-    free(comp_literal_lists);
-
-    dprintf("N array/struct variables: %d\n", n_struct_array_lists);
-    for (n = 0; n < n_struct_array_lists; n++) {
-        dprintf("[%d]: type=%d, struct=%d (%s), level=%d, n_entries=%d, range=%u-%u, depth=%u\n",
-                n, struct_array_lists[n].type,
-                struct_array_lists[n].struct_decl_idx,
-                struct_array_lists[n].struct_decl_idx != (unsigned) -1 ?
-                    (structs[struct_array_lists[n].struct_decl_idx].name[0] ?
-                     structs[struct_array_lists[n].struct_decl_idx].name :
-                     "<anonymous>") : "<none>",
-                struct_array_lists[n].level,
-                struct_array_lists[n].n_entries,
-                struct_array_lists[n].value_offset.start,
-                struct_array_lists[n].value_offset.end,
-                struct_array_lists[n].array_depth);
-        for (m = 0; m < struct_array_lists[n].n_entries; m++) {
-            dprintf(" [%d]: idx=%d, range=%u-%u\n",
-                    m, struct_array_lists[n].entries[m].index,
-                    struct_array_lists[n].entries[m].value_offset.start,
-                    struct_array_lists[n].entries[m].value_offset.end);
-        }
-        free(struct_array_lists[n].entries);
-        free(struct_array_lists[n].name);
-    }
-    free(struct_array_lists);
-
-    dprintf("N extra scope ends: %d\n", n_end_scopes);
-    for (n = 0; n < n_end_scopes; n++) {
-        dprintf("[%d]: end=%u n_scopes=%u\n",
-                n, end_scopes[n].end, end_scopes[n].n_scopes);
-    }
-    free(end_scopes);
-
-    dprintf("N typedef entries: %d\n", n_typedefs);
-    for (n = 0; n < n_typedefs; n++) {
-        if (typedefs[n].struct_decl_idx != (unsigned) -1) {
-            if (structs[typedefs[n].struct_decl_idx].name[0]) {
-                dprintf("[%d]: %s (struct %s = %d)\n",
-                        n, typedefs[n].name,
-                        structs[typedefs[n].struct_decl_idx].name,
-                        typedefs[n].struct_decl_idx);
-            } else {
-                dprintf("[%d]: %s (<anonymous> struct = %d)\n",
-                        n, typedefs[n].name,
-                        typedefs[n].struct_decl_idx);
-            }
-        } else if (typedefs[n].enum_decl_idx != (unsigned) -1) {
-            if (enums[typedefs[n].enum_decl_idx].name[0]) {
-                dprintf("[%d]: %s (enum %s = %d)\n",
-                        n, typedefs[n].name,
-                        enums[typedefs[n].enum_decl_idx].name,
-                        typedefs[n].enum_decl_idx);
-            } else {
-                dprintf("[%d]: %s (<anonymous> enum = %d)\n",
-                        n, typedefs[n].name,
-                        typedefs[n].enum_decl_idx);
-            }
+    trace(TRACE_REGISTRY, "compound literals: %u\n", ctx->n_comp_literal_lists);
+    for (n = 0; n < ctx->n_comp_literal_lists; n++) {
+        CompoundLiteralList *l = &ctx->comp_literal_lists[n];
+        trace(TRACE_REGISTRY, "  [%u] type=%d struct=%d (%s) value=%u-%u\n",
+              n, l->type, l->struct_decl_idx,
+              l->struct_decl_idx != (unsigned) -1 ?
+                  ctx->structs[l->struct_decl_idx].name : "<none>",
+              l->value_token.start, l->value_token.end);
+    }
+
+    trace(TRACE_REGISTRY, "struct/array initializers: %u\n",
+          ctx->n_struct_array_lists);
+    for (n = 0; n < ctx->n_struct_array_lists; n++) {
+        StructArrayList *l = &ctx->struct_array_lists[n];
+        trace(TRACE_REGISTRY, "  [%u] type=%d struct=%d (%s) level=%u "
+              "entries=%u range=%u-%u depth=%u\n",
+              n, l->type, l->struct_decl_idx,
+              l->struct_decl_idx != (unsigned) -1 ?
+                  (ctx->structs[l->struct_decl_idx].name[0] ?
+                   ctx->structs[l->struct_decl_idx].name : "<anonymous>") : "<none>",
+              l->level, l->n_entries, l->value_offset.start,
+              l->value_offset.end, l->array_depth);
+        for (m = 0; m < l->n_entries; m++) {
+            trace(TRACE_REGISTRY, "    [%u] idx=%d range=%u-%u\n",
+                  m, l->entries[m].index, l->entries[m].value_offset.start,
+                  l->entries[m].value_offset.end);
+        }
+    }
+
+    trace(TRACE_REGISTRY, "extra scope ends: %u\n", ctx->n_end_scopes);
+    for (n = 0; n < ctx->n_end_scopes; n++) {
+        trace(TRACE_REGISTRY, "  [%u] end=%u scopes=%u\n",
+              n, ctx->end_scopes[n].end, ctx->end_scopes[n].n_scopes);
+    }
+
+    trace(TRACE_REGISTRY, "typedefs: %u\n", ctx->n_typedefs);
+    for (n = 0; n < ctx->n_typedefs; n++) {
+        TypedefDeclaration *td = &ctx->typedefs[n];
+        if (td->struct_decl_idx != (unsigned) -1) {
+            trace(TRACE_REGISTRY, "  [%u] %s struct=%u (%s)\n",
+                  n, td->name, td->struct_decl_idx,
+                  ctx->structs[td->struct_decl_idx].name[0] ?
+                      ctx->structs[td->struct_decl_idx].name : "<anonymous>");
+        } else if (td->enum_decl_idx != (unsigned) -1) {
+            trace(TRACE_REGISTRY, "  [%u] %s enum=%u (%s)\n",
+                  n, td->name, td->enum_decl_idx,
+                  ctx->enums[td->enum_decl_idx].name[0] ?
+                      ctx->enums[td->enum_decl_idx].name : "<anonymous>");
         } else {
-            dprintf("[%d]: %s (%s)\n",
-                    n, typedefs[n].name, typedefs[n].proxy);
+            trace(TRACE_REGISTRY, "  [%u] %s proxy=%s\n",
+                  n, td->name, td->proxy);
         }
-        if (typedefs[n].proxy)
-            free(typedefs[n].proxy);
-        free(typedefs[n].name);
     }
-    free(typedefs);
 
-    // free memory
-    dprintf("N struct entries: %d\n", n_structs);
-    for (n = 0; n < n_structs; n++) {
-        if (structs[n].name[0]) {
-            dprintf("[%d]: %s (%p)\n", n, structs[n].name, &structs[n]);
-        } else {
-            dprintf("[%d]: <anonymous> (%p)\n", n, &structs[n]);
-        }
-        for (m = 0; m < structs[n].n_entries; m++) {
-            dprintf(" [%d]: %s (%s/%d/%d/%u)\n",
-                    m, structs[n].entries[m].name,
-                    structs[n].entries[m].type,
-                    structs[n].entries[m].n_ptrs,
-                    structs[n].entries[m].array_depth,
-                    structs[n].entries[m].struct_decl_idx);
-            free(structs[n].entries[m].type);
-            free(structs[n].entries[m].name);
-        }
-        free(structs[n].entries);
-        free(structs[n].name);
-    }
-    free(structs);
-
-    dprintf("N enum entries: %d\n", n_enums);
-    for (n = 0; n < n_enums; n++) {
-        if (enums[n].name[0]) {
-            dprintf("[%d]: %s (%p)\n", n, enums[n].name, &enums[n]);
-        } else {
-            dprintf("[%d]: <anonymous> (%p)\n", n, &enums[n]);
+    trace(TRACE_REGISTRY, "structs: %u\n", ctx->n_structs);
+    for (n = 0; n < ctx->n_structs; n++) {
+        StructDeclaration *decl = &ctx->structs[n];
+        trace(TRACE_REGISTRY, "  [%u] %s%s\n", n,
+              decl->is_union ? "union " : "",
+              decl->name[0] ? decl->name : "<anonymous>");
+        for (m = 0; m < decl->n_entries; m++) {
+            trace(TRACE_REGISTRY, "    [%u] %s type=%s ptrs=%u depth=%u "
+                  "struct=%d\n", m, decl->entries[m].name,
+                  decl->entries[m].type, decl->entries[m].n_ptrs,
+                  decl->entries[m].array_depth,
+                  decl->entries[m].struct_decl_idx);
         }
-        for (m = 0; m < enums[n].n_entries; m++) {
-            dprintf(" [%d]: %s = %d\n", m,
-                    enums[n].entries[m].name,
-                    enums[n].entries[m].value);
-            free(enums[n].entries[m].name);
+    }
+
+    trace(TRACE_REGISTRY, "enums: %u\n", ctx->n_enums);
+    for (n = 0; n < ctx->n_enums; n++) {
+        EnumDeclaration *decl = &ctx->enums[n];
+        trace(TRACE_REGISTRY, "  [%u] %s\n", n,
+              decl->name[0] ? decl->name : "<anonymous>");
+        for (m = 0; m < decl->n_entries; m++) {
+            trace(TRACE_REGISTRY, "    [%u] %s = %d\n", m,
+                  decl->entries[m].name, decl->entries[m].value);
         }
-        free(enums[n].entries);
-        free(enums[n].name);
     }
-    free(enums);
-#define DEBUG 0
 }
 
-int convert(const char *infile, const char *outfile, int ms_compat)
+/*
+ * Forget all per-conversion state, but keep the libclang index and the
+ * statistics around.
+ */
+static void reset_context(C99ConvContext *c)
 {
-    CXIndex index;
-    unsigned n_tokens;
-    CXToken *tokens;
+    CXIndex index = c->index;
+    C99ConvStats stats = c->stats;
+
+    memset(c, 0, sizeof(*c));
+    c->index = index;
+    c->stats = stats;
+    c->arena_block_size = 4096;
+}
+
+typedef struct PhaseClock {
+    double wall, cpu;
+} PhaseClock;
+
+static void start_phase(PhaseClock *clock)
+{
+    get_clocks(&clock->wall, &clock->cpu);
+}
+
+/* add the time since *clock to phase, and restart *clock for the next */
+static void end_phase(PhaseClock *clock, enum C99ConvPhase phase)
+{
+    double wall, cpu;
+
+    get_clocks(&wall, &cpu);
+    ctx->stats.wall[phase] += wall - clock->wall;
+    ctx->stats.cpu[phase] += cpu - clock->cpu;
+    clock->wall = wall;
+    clock->cpu = cpu;
+}
+
+/*
+ * Release everything a conversion allocated. This also runs after a
+ * failed conversion, so it has to cope with partially built state.
+ */
+static void cleanup(void)
+{
+    PhaseClock clock;
+    unsigned n;
+
+    start_phase(&clock);
+    ctx->stats.bytes_in += ctx->src.size;
+    ctx->stats.bytes_out += ctx->out.written;
+    ctx->stats.tokens += ctx->tu_tokens.n_tokens;
+    ctx->stats.struct_array_lists += ctx->n_struct_array_lists;
+    ctx->stats.end_scopes += ctx->n_end_scopes;
+
+    free(ctx->comp_literal_lists);
+    for (n = 0; n < ctx->n_struct_array_lists; n++)
+        free(ctx->struct_array_lists[n].entries);
+    free(ctx->struct_array_lists);
+    free(ctx->end_scopes);
+    free(ctx->edit_events);
+    free(ctx->typedefs);
+    for (n = 0; n < ctx->n_structs; n++)
+        free(ctx->structs[n].entries);
+    free(ctx->structs);
+    for (n = 0; n < ctx->n_enums; n++)
+        free(ctx->enums[n].entries);
+    free(ctx->enums);
+
+    free_hash_index(&ctx->struct_names);
+    free_hash_index(&ctx->struct_cursors);
+    free_hash_index(&ctx->struct_members);
+    free_hash_index(&ctx->enum_names);
+    free_hash_index(&ctx->enum_cursors);
+    free_hash_index(&ctx->enum_values);
+    free_hash_index(&ctx->typedef_names);
+    free_arena();
+    // registered names may point into the token table
+    free_token_table(&ctx->tu_tokens);
+
+    if (ctx->TU)
+        clang_disposeTranslationUnit(ctx->TU);
+    free(ctx->out.buf);
+    if (ctx->out.file && ctx->out.file != stdout)
+        fclose(ctx->out.file);
+    free(ctx->src.buf);
+
+    end_phase(&clock, C99CONV_PHASE_CLEANUP);
+    reset_context(ctx);
+}
+
+/*
+ * Convert the source in ctx->src, or the file filename if ctx->src is
+ * empty, into ctx->out. Sources the pre-scan finds nothing to convert in
+ * are copied as they are, without parsing them.
+ */
+static void convert(const char *filename, const C99ConvOptions *opts)
+{
+    struct CXUnsavedFile unsaved;
+    unsigned n_unsaved = 0;
     CXSourceRange range;
     CXCursor cursor;
     CursorRecursion rec;
+    PhaseClock clock;
+    unsigned n;
     const char *ms_argv[] = { "-fms-extensions", "-target", "i386-pc-win32", NULL };
     const char **argv = NULL;
     int argc = 0;
-    if (ms_compat) {
+    if (opts && opts->ms_compat) {
         argv = ms_argv;
         argc = 3;
     }
 
-    out    = fopen(outfile, "w");
-    if (!out) {
-        fprintf(stderr, "Unable to open output file %s\n", outfile);
-        return 1;
+    ctx->stats.files++;
+    start_phase(&clock);
+    if (ctx->src.buf && !(opts && (opts->no_prescan || opts->check_lexer)) &&
+        !prescan_needs_conversion(ctx->src.buf, ctx->src.size)) {
+        trace(TRACE_REGISTRY, "pre-scan: nothing to convert in %s\n", filename);
+        write_sink(&ctx->out, ctx->src.buf, ctx->src.size);
+        // each file ends with a newline
+        if (!ctx->src.size || ctx->src.buf[ctx->src.size - 1] != '\n')
+            write_sink(&ctx->out, "\n", 1);
+        ctx->stats.passed_through++;
+        end_phase(&clock, C99CONV_PHASE_PRESCAN);
+        return;
+    }
+    end_phase(&clock, C99CONV_PHASE_PRESCAN);
+
+    if (ctx->src.buf) {
+        unsaved.Filename = filename;
+        unsaved.Contents = ctx->src.buf;
+        unsaved.Length   = ctx->src.size;
+        n_unsaved = 1;
+    }
+
+    if (load_libclang()) {
+        fprintf(stderr, "Unable to parse %s without libclang\n", filename);
+        fail();
     }
-    index  = clang_createIndex(1, 1);
-    TU     = clang_createTranslationUnitFromSourceFile(index, infile, argc,
-                                                       argv, 0, NULL);
-    cursor = clang_getTranslationUnitCursor(TU);
+    if (!ctx->index)
+        ctx->index = clang_createIndex(1, 1);
+    ctx->TU = clang_createTranslationUnitFromSourceFile(ctx->index, filename,
+                                                        argc, argv, n_unsaved,
+                                                        &unsaved);
+    if (!ctx->TU) {
+        fprintf(stderr, "Unable to parse %s\n", filename);
+        fail();
+    }
+    cursor = clang_getTranslationUnitCursor(ctx->TU);
     range  = clang_getCursorExtent(cursor);
-    clang_tokenize(TU, range, &tokens, &n_tokens);
+    clang_getSpellingLocation(clang_getRangeStart(range), &ctx->tu_file,
+                              NULL, NULL, NULL);
+    end_phase(&clock, C99CONV_PHASE_PARSE);
+
+    // the native lexer needs the source in memory
+    if (!ctx->src.buf || ctx->src.size > UINT_MAX ||
+        (opts && opts->clang_lexer)) {
+        build_token_table(range, &ctx->tu_tokens);
+    } else if (!(opts && opts->check_lexer)) {
+        lex_token_table(&ctx->src, opts && opts->ms_compat, &ctx->tu_tokens);
+    } else {
+        TokenTable clang_tokens;
+        int res;
+
+        memset(&clang_tokens, 0, sizeof(clang_tokens));
+        lex_token_table(&ctx->src, opts->ms_compat, &ctx->tu_tokens);
+        build_token_table(range, &clang_tokens);
+        res = compare_token_tables(&ctx->tu_tokens, &clang_tokens, filename);
+        free_token_table(&clang_tokens);
+        if (res)
+            fail();
+        trace(TRACE_REGISTRY, "lexer: %u tokens match clang's in %s\n",
+              ctx->tu_tokens.n_tokens, filename);
+    }
+    // names and types are mostly made up of token spellings
+    if (ctx->arena_block_size < ctx->tu_tokens.n_tokens * 4)
+        ctx->arena_block_size = ctx->tu_tokens.n_tokens * 4;
+    end_phase(&clock, C99CONV_PHASE_TOKENIZE);
 
     memset(&rec, 0, sizeof(rec));
-    rec.tokens = tokens;
-    rec.n_tokens = n_tokens;
+    rec.tokens = ctx->tu_tokens.tokens;
+    rec.n_tokens = ctx->tu_tokens.n_tokens;
     rec.kind = CXCursor_TranslationUnit;
-    clang_visitChildren(cursor, callback, &rec);
-    print_tokens(tokens, n_tokens);
-    clang_disposeTokens(TU, tokens, n_tokens);
+    visit_children(cursor, callback, &rec);
+    // emitting turns some literals into temporary assignments
+    for (n = 0; n < ctx->n_comp_literal_lists; n++)
+        ctx->stats.literals[ctx->comp_literal_lists[n].type]++;
+    end_phase(&clock, C99CONV_PHASE_WALK);
+    print_tokens(ctx->tu_tokens.tokens, ctx->tu_tokens.n_tokens);
+    end_phase(&clock, C99CONV_PHASE_EMIT);
+
+    if (ctx->trace_level >= TRACE_REGISTRY)
+        dump_registries();
+}
 
-    clang_disposeTranslationUnit(TU);
-    clang_disposeIndex(index);
+C99ConvContext *c99conv_create_context(void)
+{
+    C99ConvContext *c = (C99ConvContext *) malloc(sizeof(*c));
 
-    cleanup();
-    fclose(out);
+    if (c) {
+        c->index = NULL;
+        memset(&c->stats, 0, sizeof(c->stats));
+        reset_context(c);
+    }
 
-    return 0;
+    return c;
+}
+
+void c99conv_free_context(C99ConvContext *c)
+{
+    if (!c)
+        return;
+    if (c->index)
+        clang_disposeIndex(c->index);
+    free(c);
 }
 
-int main(int argc, char *argv[])
+void c99conv_free(void *ptr)
 {
-    int arg = 1;
-    int ms_compat = 0;
-    while (arg < argc) {
-        if (!strcmp(argv[arg], "-ms")) {
-            ms_compat = 1;
+    free(ptr);
+}
+
+int c99conv_describe_libclang(char *buf, size_t size)
+{
+    CXString version;
+    const char *path;
+    size_t len;
+    int res = 1;
+
+    if (load_libclang())
+        return 1;
+    version = clang_getClangVersion();
+    path = libclang_path();
+    len = strlen(path) + 1 + strlen(clang_getCString(version));
+    if (len < size) {
+        sprintf(buf, "%s %s", path, clang_getCString(version));
+        res = 0;
+    } else {
+        fprintf(stderr, "The libclang description is too long\n");
+    }
+    clang_disposeString(version);
+
+    return res;
+}
+
+void c99conv_get_stats(const C99ConvContext *c, C99ConvStats *stats)
+{
+    *stats = c->stats;
+}
+
+/*
+ * Each entry point makes c the current context for the duration of the
+ * call and catches fail() from anywhere in the converter. The previous
+ * context is restored afterwards, so that calls can nest.
+ */
+int c99conv_convert_file(C99ConvContext *c, const char *infile,
+                         const char *outfile, const C99ConvOptions *opts)
+{
+    C99ConvContext *prev = ctx;
+    volatile int res = 1;
+    jmp_buf error;
+
+    ctx = c;
+    ctx->trace_level = opts ? (enum TraceLevel) opts->trace_level : TRACE_NONE;
+    ctx->error = &error;
+    if (!setjmp(error)) {
+        if (!strcmp(infile, "-")) {
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            read_source(stdin, &ctx->src);
+            if (!ctx->src.buf) {
+                fprintf(stderr, "Unable to read input from stdin\n");
+                fail();
+            }
+            // libclang needs a file name for the buffer
+            infile = "stdin.c";
         } else {
-            break;
+            FILE *f = fopen(infile, "rb");
+            if (f) {
+                read_source(f, &ctx->src);
+                fclose(f);
+            }
+        }
+
+        ctx->out.file = !strcmp(outfile, "-") ? stdout : fopen(outfile, "w");
+        if (!ctx->out.file) {
+            fprintf(stderr, "Unable to open output file %s\n", outfile);
+            fail();
         }
-        arg++;
+
+        convert(infile, opts);
+
+        flush_sink(&ctx->out);
+        if (fflush(ctx->out.file)) {
+            fprintf(stderr, "Failed to write output\n");
+            fail();
+        }
+        res = 0;
     }
-    if (argc < arg + 2) {
-        fprintf(stderr, "%s [-ms] <in> <out>\n", argv[0]);
-        return 1;
+    cleanup();
+    ctx = prev;
+
+    return res;
+}
+
+int c99conv_convert_buffer(C99ConvContext *c, const char *in, size_t len,
+                           const C99ConvOptions *opts,
+                           char **out, size_t *outlen)
+{
+    C99ConvContext *prev = ctx;
+    volatile int res = 1;
+    jmp_buf error;
+
+    *out = NULL;
+    *outlen = 0;
+    ctx = c;
+    ctx->trace_level = opts ? (enum TraceLevel) opts->trace_level : TRACE_NONE;
+    ctx->error = &error;
+    if (!setjmp(error)) {
+        // libclang wants a buffer it can keep while the TU lives
+        ctx->src.buf = (char *) malloc(len + 1);
+        if (!ctx->src.buf) {
+            fprintf(stderr, "Out of memory while reading input\n");
+            fail();
+        }
+        memcpy(ctx->src.buf, in, len);
+        ctx->src.buf[len] = 0;
+        ctx->src.size = len;
+
+        convert("input.c", opts);
+
+        *out = ctx->out.buf;
+        *outlen = ctx->out.len;
+        ctx->out.buf = NULL;
+        res = 0;
     }
-    return convert(argv[arg], argv[arg + 1], ms_compat);
+    cleanup();
+    ctx = prev;
+
+    return res;
 }
@@ -0,0 +1,456 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "lex.h"
+
+#define CHAR_IDENT   1 // identifier body
+#define CHAR_NUMBER  2 // pp-number body
+#define CHAR_SPACE   4 // horizontal whitespace, and NUL, which clang ignores
+#define CHAR_NEWLINE 8
+
+/* bytes from 0x80 are taken as identifier characters */
+static const unsigned char char_class[256] = {
+    4, 0, 0, 0, 0, 0, 0, 0, 0, 4, 8, 4, 4, 8, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    4, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 0, 0, 0, 0, 0, 0,
+    0, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 0, 0, 0, 0, 3,
+    0, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 0, 0, 0, 0, 0,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+};
+
+#define IS(c, class) ((c) >= 0 && (char_class[c] & (class)))
+
+void init_lexer(Lexer *l, const char *buf, size_t len, int ms_compat)
+{
+    l->buf = buf;
+    l->len = len;
+    l->pos = 0;
+    l->line = 0;
+    l->line_start = 0;
+    l->ms_compat = ms_compat;
+    // a UTF-8 byte order mark is skipped, but still counts for columns
+    if (len >= 3 && !memcmp(buf, "\xEF\xBB\xBF", 3))
+        l->pos = 3;
+}
+
+/*
+ * The size of the backslash-newline at p, or 0. Like clang, this allows
+ * whitespace between the backslash and the newline, and takes \r\n and
+ * \n\r as one newline.
+ */
+static size_t splice_size(const Lexer *l, size_t p)
+{
+    const char *buf = l->buf;
+    size_t q = p + 1;
+
+    while (q < l->len && (char_class[(unsigned char) buf[q]] & CHAR_SPACE) &&
+           buf[q])
+        q++;
+    if (q >= l->len || !(char_class[(unsigned char) buf[q]] & CHAR_NEWLINE))
+        return 0;
+    if (q + 1 < l->len && buf[q + 1] != buf[q] &&
+        (char_class[(unsigned char) buf[q + 1]] & CHAR_NEWLINE))
+        q++;
+
+    return q + 1 - p;
+}
+
+/*
+ * The character at *p after any backslash-newlines, which *p is moved past
+ * and which set *spliced. Returns -1 at the end of the buffer.
+ */
+static int char_at(const Lexer *l, size_t *p, int *spliced)
+{
+    size_t n;
+
+    while (*p < l->len && l->buf[*p] == '\\' && (n = splice_size(l, *p))) {
+        *p += n;
+        *spliced = 1;
+    }
+
+    return *p < l->len ? (unsigned char) l->buf[*p] : -1;
+}
+
+/* if the character at *p is c, move *p past it */
+static int accept(const Lexer *l, size_t *p, int c, int *spliced)
+{
+    size_t q = *p;
+    int s = 0;
+
+    if (char_at(l, &q, &s) != c)
+        return 0;
+    *p = q + 1;
+    *spliced |= s;
+
+    return 1;
+}
+
+// like clang's line table: \r\n is one line break, \n\r two
+static void count_lines(Lexer *l, size_t start, size_t end)
+{
+    const char *buf = l->buf;
+    size_t p;
+
+    for (p = start; p < end; p++) {
+        if (buf[p] == '\n' ||
+            (buf[p] == '\r' && (p + 1 >= l->len || buf[p + 1] != '\n'))) {
+            l->line++;
+            l->line_start = p + 1;
+        }
+    }
+}
+
+/* skip characters of class, and backslash-newlines followed by them */
+static size_t skip_class(const Lexer *l, size_t p, int class, int *spliced)
+{
+    const char *buf = l->buf;
+    size_t q;
+    int s;
+
+    for (;;) {
+        while (p < l->len && (char_class[(unsigned char) buf[p]] & class))
+            p++;
+        if (p >= l->len || buf[p] != '\\')
+            return p;
+        q = p;
+        s = 0;
+        if (!IS(char_at(l, &q, &s), class))
+            return p;
+        p = q + 1;
+        *spliced = 1;
+    }
+}
+
+/*
+ * A string or character literal, from p past the opening quote. Returns
+ * its end; unterminated literals end before the line break, and are
+ * LEX_UNKNOWN like the empty character constant.
+ */
+static size_t lex_literal(const Lexer *l, size_t p, int quote,
+                          enum LexTokenKind *kind, int *spliced)
+{
+    const char *buf = l->buf;
+    int c;
+
+    *kind = LEX_UNKNOWN;
+    if (quote == '\'' && accept(l, &p, '\'', spliced))
+        return p;
+    for (;;) {
+        while (p < l->len && buf[p] != quote && buf[p] != '\\' &&
+               buf[p] != '\n' && buf[p] != '\r')
+            p++;
+        c = char_at(l, &p, spliced);
+        if (c == quote) {
+            *kind = LEX_LITERAL;
+            return p + 1;
+        }
+        if (c == '\\') {
+            p++;
+            c = char_at(l, &p, spliced);
+        }
+        if (c == '\n' || c == '\r' || c < 0)
+            return p;
+        p++;
+    }
+}
+
+/*
+ * A pp-number from p, past its first character first. Signs continue it
+ * after e or p, except after e in hexadecimal numbers with MS extensions,
+ * where 0x1e+1 is three tokens.
+ */
+static size_t lex_number(const Lexer *l, size_t p, int first, int hex,
+                         int *spliced)
+{
+    int prev = first, c;
+    size_t q;
+
+    for (;;) {
+        q = p;
+        c = char_at(l, &q, spliced);
+        if (IS(c, CHAR_NUMBER)) {
+            p = skip_class(l, q + 1, CHAR_NUMBER, spliced);
+            prev = (unsigned char) l->buf[p - 1];
+        } else if ((c == '+' || c == '-') &&
+                   (((prev == 'e' || prev == 'E') && !(hex && l->ms_compat)) ||
+                    prev == 'p' || prev == 'P')) {
+            p = q + 1;
+            prev = c;
+        } else {
+            return p;
+        }
+    }
+}
+
+/*
+ * A comment from p, at the character after its first slash. Returns its
+ * end, or 0 for an unterminated block comment.
+ */
+static size_t lex_comment(const Lexer *l, size_t p, int *spliced)
+{
+    const char *buf = l->buf;
+    size_t first, n;
+
+    if (char_at(l, &p, spliced) == '/') {
+        // backslash-newlines continue line comments
+        for (p++;;) {
+            while (p < l->len && buf[p] != '\n' && buf[p] != '\r' &&
+                   buf[p] != '\\')
+                p++;
+            if (p >= l->len || buf[p] != '\\')
+                return p;
+            if ((n = splice_size(l, p))) {
+                p += n;
+                *spliced = 1;
+            } else {
+                p++;
+            }
+        }
+    }
+
+    // the first character after /* can't end the comment, even if it's a /
+    first = p + 1;
+    char_at(l, &first, spliced);
+    for (p = first + 1; p < l->len; p++) {
+        const char *slash = (const char *) memchr(&buf[p], '/', l->len - p);
+        size_t star;
+
+        if (!slash)
+            break;
+        p = slash - buf;
+        star = p - 1;
+        // a star, then backslash-newlines, before the slash ends it too
+        while (star > first && (buf[star] == '\n' || buf[star] == '\r')) {
+            size_t q = star;
+
+            if (buf[q - 1] != buf[q] &&
+                (buf[q - 1] == '\n' || buf[q - 1] == '\r'))
+                q--;
+            while (q > first && (char_class[(unsigned char) buf[q - 1]] &
+                                 CHAR_SPACE) && buf[q - 1])
+                q--;
+            if (q <= first + 1 || buf[q - 1] != '\\')
+                break;
+            star = q - 2;
+        }
+        if (star >= first && buf[star] == '*')
+            return p + 1;
+    }
+
+    return 0;
+}
+
+int lex_token(Lexer *l, LexToken *tok)
+{
+    const char *buf = l->buf;
+    enum LexTokenKind kind = LEX_PUNCT;
+    size_t p = l->pos, start, q;
+    int c, first, spliced = 0;
+
+    for (;;) {
+        while (p < l->len && (char_class[(unsigned char) buf[p]] & CHAR_SPACE))
+            p++;
+        if (p >= l->len) {
+            l->pos = p;
+            return 0;
+        }
+        if (char_class[(unsigned char) buf[p]] & CHAR_NEWLINE) {
+            count_lines(l, p, p + 1);
+            p++;
+            continue;
+        }
+        // a backslash-newline starts the token, unless whitespace follows
+        q = p;
+        spliced = 0;
+        c = char_at(l, &q, &spliced);
+        if (q == p || (c >= 0 && !IS(c, CHAR_SPACE | CHAR_NEWLINE)))
+            break;
+        count_lines(l, p, q);
+        p = q;
+    }
+
+    start = p;
+    first = c;
+    p = q + 1;
+    switch (c) {
+    case '"':
+    case '\'':
+        p = lex_literal(l, p, c, &kind, &spliced);
+        break;
+    case 'L':
+    case 'u':
+    case 'U':
+        q = p;
+        c = char_at(l, &q, &spliced);
+        if (c == '"' || c == '\'') {
+            p = lex_literal(l, q + 1, c, &kind, &spliced);
+            break;
+        }
+        if (c == '8' && first == 'u') {
+            q++;
+            if (accept(l, &q, '"', &spliced)) {
+                p = lex_literal(l, q, '"', &kind, &spliced);
+                break;
+            }
+        }
+        p = skip_class(l, p, CHAR_IDENT, &spliced);
+        kind = LEX_IDENT;
+        break;
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+        q = p;
+        p = lex_number(l, p, c,
+                       c == '0' && (accept(l, &q, 'x', &spliced) ||
+                                    accept(l, &q, 'X', &spliced)),
+                       &spliced);
+        kind = LEX_NUMBER;
+        break;
+    case '.':
+        q = p;
+        c = char_at(l, &q, &spliced);
+        if (c >= '0' && c <= '9') {
+            p = lex_number(l, q + 1, c, 0, &spliced);
+            kind = LEX_NUMBER;
+        } else if (c == '.') {
+            q++;
+            if (accept(l, &q, '.', &spliced))
+                p = q;
+        }
+        break;
+    case '/':
+        q = p;
+        c = char_at(l, &q, &spliced);
+        if (c == '/' || c == '*') {
+            if (!(p = lex_comment(l, p, &spliced))) {
+                // clang drops unterminated block comments
+                count_lines(l, start, l->len);
+                l->pos = l->len;
+                return 0;
+            }
+            kind = LEX_COMMENT;
+        } else {
+            accept(l, &p, '=', &spliced);
+        }
+        break;
+    case '-':
+        if (!accept(l, &p, '-', &spliced) && !accept(l, &p, '>', &spliced))
+            accept(l, &p, '=', &spliced);
+        break;
+    case '+':
+    case '&':
+    case '|':
+        if (!accept(l, &p, c, &spliced))
+            accept(l, &p, '=', &spliced);
+        break;
+    case '*':
+    case '!':
+    case '=':
+    case '^':
+        accept(l, &p, '=', &spliced);
+        break;
+    case '<':
+        if (accept(l, &p, '<', &spliced))
+            accept(l, &p, '=', &spliced);
+        else if (!accept(l, &p, '=', &spliced) &&
+                 !accept(l, &p, ':', &spliced))
+            accept(l, &p, '%', &spliced);
+        break;
+    case '>':
+        accept(l, &p, '>', &spliced);
+        accept(l, &p, '=', &spliced);
+        break;
+    case ':':
+        accept(l, &p, '>', &spliced);
+        break;
+    case '%':
+        if (accept(l, &p, '=', &spliced) || accept(l, &p, '>', &spliced))
+            break;
+        if (!accept(l, &p, ':', &spliced))
+            break;
+        // %: is #
+        q = p;
+        if (accept(l, &q, '%', &spliced) && accept(l, &q, ':', &spliced))
+            p = q;
+        else if (l->ms_compat)
+            accept(l, &p, '@', &spliced);
+        break;
+    case '#':
+        // #@ is MSVC's charizing operator
+        if (!accept(l, &p, '#', &spliced) && l->ms_compat)
+            accept(l, &p, '@', &spliced);
+        break;
+    case '(': case ')': case '[': case ']': case '{': case '}':
+    case ';': case ',': case '?': case '~': case '@':
+        break;
+    default:
+        if (IS(c, CHAR_IDENT)) {
+            p = skip_class(l, p, CHAR_IDENT, &spliced);
+            kind = LEX_IDENT;
+        } else {
+            kind = LEX_UNKNOWN;
+        }
+        break;
+    }
+
+    tok->offset  = (unsigned) start;
+    tok->size    = (unsigned) (p - start);
+    tok->line    = l->line;
+    tok->col     = (unsigned) (start - l->line_start);
+    tok->kind    = kind;
+    tok->spliced = spliced;
+    if (spliced || kind == LEX_COMMENT)
+        count_lines(l, start, p);
+    l->pos = p;
+
+    return 1;
+}
+
+unsigned get_token_spelling(const Lexer *l, const LexToken *tok, char *dst)
+{
+    const char *src = l->buf + tok->offset;
+    size_t p = tok->offset, end = p + tok->size, n;
+    unsigned len = 0;
+
+    // like clang_getTokenSpelling(), only identifiers are cleaned
+    if (!tok->spliced || tok->kind != LEX_IDENT) {
+        memcpy(dst, src, tok->size);
+        return tok->size;
+    }
+    while (p < end) {
+        if (l->buf[p] == '\\' && (n = splice_size(l, p))) {
+            p += n;
+        } else {
+            dst[len++] = l->buf[p++];
+        }
+    }
+
+    return len;
+}
@@ -0,0 +1,69 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef C99CONV_LEX_H
+#define C99CONV_LEX_H
+
+#include <stddef.h>
+
+/*
+ * Lexer for the token table of the emitter. It splits a source buffer into
+ * the same tokens as clang_tokenize(), i.e. clang's raw lexer with comments
+ * kept: preprocessor lines are lexed like any other line, and comments are
+ * tokens.
+ */
+
+enum LexTokenKind {
+    LEX_IDENT,
+    LEX_NUMBER,
+    LEX_LITERAL, // string or character literal
+    LEX_PUNCT,
+    LEX_COMMENT,
+    LEX_UNKNOWN, // stray characters and unterminated literals
+};
+
+typedef struct LexToken {
+    unsigned offset;    // of the first byte
+    unsigned size;      // in bytes of source
+    unsigned line, col; // 0-based
+    enum LexTokenKind kind;
+    int spliced;        // contains backslash-newlines, which the spelling drops
+} LexToken;
+
+typedef struct Lexer {
+    const char *buf;
+    size_t len;
+    size_t pos;
+    unsigned line;
+    size_t line_start;
+    int ms_compat;
+} Lexer;
+
+void init_lexer(Lexer *l, const char *buf, size_t len, int ms_compat);
+
+/* read the next token into tok; returns 0 at the end of the buffer */
+int lex_token(Lexer *l, LexToken *tok);
+
+/*
+ * Write the spelling of tok, which is tok->size bytes at most, to dst.
+ * Returns its length.
+ */
+unsigned get_token_spelling(const Lexer *l, const LexToken *tok, char *dst);
+
+#endif /* C99CONV_LEX_H */
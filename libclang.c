@@ -0,0 +1,146 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WIN32
+#define _GNU_SOURCE // for dladdr
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libclang.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#include <pthread.h>
+#endif
+
+#ifndef LIBCLANG_NAME
+#if defined(_WIN32)
+#define LIBCLANG_NAME "libclang.dll"
+#elif defined(__APPLE__)
+#define LIBCLANG_NAME "libclang.dylib"
+#else
+#define LIBCLANG_NAME "libclang.so"
+#endif
+#endif
+
+LibClang libclang;
+
+static int load_error;
+static char path[1024];
+
+static void load(void)
+{
+    const char *name = getenv(LIBCLANG_ENV);
+#ifdef _WIN32
+    HMODULE lib;
+#else
+    void *lib;
+#endif
+
+    if (!name || !*name)
+        name = LIBCLANG_NAME;
+#ifdef _WIN32
+    lib = LoadLibraryA(name);
+    if (!lib) {
+        fprintf(stderr, "Unable to load %s (error %lu), set %s to the "
+                "libclang library\n", name, (unsigned long) GetLastError(),
+                LIBCLANG_ENV);
+        load_error = 1;
+        return;
+    }
+#define LIBCLANG_LOAD(ret, func, args) \
+    libclang.func = (ret (*) args) GetProcAddress(lib, "clang_" #func);
+#else
+    // only the few functions the converter calls are ever bound
+    lib = dlopen(name, RTLD_LAZY | RTLD_LOCAL);
+    if (!lib) {
+        fprintf(stderr, "Unable to load %s (%s), set %s to the libclang "
+                "library\n", name, dlerror(), LIBCLANG_ENV);
+        load_error = 1;
+        return;
+    }
+#define LIBCLANG_LOAD(ret, func, args) \
+    libclang.func = (ret (*) args) dlsym(lib, "clang_" #func);
+#endif
+
+#define LIBCLANG_CHECK(ret, func, args) \
+    if (!load_error && !libclang.func) { \
+        fprintf(stderr, "%s has no clang_%s\n", name, #func); \
+        load_error = 1; \
+    }
+
+    LIBCLANG_FUNCTIONS(LIBCLANG_LOAD)
+    LIBCLANG_FUNCTIONS(LIBCLANG_CHECK)
+
+    // where the search for name ended up, as the cache has to tell apart
+    // conversions by different libraries
+#ifdef _WIN32
+    if (!GetModuleFileNameA(lib, path, sizeof(path)) ||
+        GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+        path[0] = '\0';
+#else
+    if (!load_error) {
+        Dl_info info;
+        char *real = NULL;
+        if (dladdr((void *) libclang.getClangVersion, &info) &&
+            info.dli_fname)
+            real = realpath(info.dli_fname, NULL);
+        if (real && strlen(real) < sizeof(path))
+            strcpy(path, real);
+        free(real);
+    }
+#endif
+    if (!path[0] && strlen(name) < sizeof(path))
+        strcpy(path, name);
+    // the library stays loaded until the process exits
+}
+
+#ifdef _WIN32
+static BOOL CALLBACK load_once(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+    load();
+
+    return TRUE;
+}
+#endif
+
+int load_libclang(void)
+{
+#ifdef _WIN32
+    static INIT_ONCE once = INIT_ONCE_STATIC_INIT;
+
+    InitOnceExecuteOnce(&once, load_once, NULL, NULL);
+#else
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, load);
+#endif
+
+    return load_error;
+}
+
+const char *libclang_path(void)
+{
+    return path;
+}
@@ -0,0 +1,108 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef C99CONV_LIBCLANG_H
+#define C99CONV_LIBCLANG_H
+
+#include <clang-c/Index.h>
+
+/*
+ * libclang is loaded when the first source has to be parsed, so that runs
+ * that only copy sources the pre-scan passes through never pay for loading
+ * and relocating it. It's loaded from the library $C99CONV_LIBCLANG names,
+ * or LIBCLANG_NAME by default. With C99CONV_LINK_LIBCLANG defined, the
+ * converter is linked with libclang at build time instead.
+ */
+
+#define LIBCLANG_ENV "C99CONV_LIBCLANG"
+
+#ifdef C99CONV_LINK_LIBCLANG
+
+#define load_libclang() 0
+#define libclang_path() "(linked)"
+
+#else
+
+/* returns 0 once libclang is loaded, and prints why not otherwise */
+int load_libclang(void);
+
+/* the file libclang was loaded from, once it is loaded */
+const char *libclang_path(void);
+
+#define LIBCLANG_FUNCTIONS(X) \
+    X(CXIndex, createIndex, (int, int)) \
+    X(void, disposeIndex, (CXIndex)) \
+    X(CXTranslationUnit, createTranslationUnitFromSourceFile, \
+      (CXIndex, const char *, int, const char * const *, unsigned, \
+       struct CXUnsavedFile *)) \
+    X(void, disposeTranslationUnit, (CXTranslationUnit)) \
+    X(CXCursor, getTranslationUnitCursor, (CXTranslationUnit)) \
+    X(unsigned, visitChildren, (CXCursor, CXCursorVisitor, CXClientData)) \
+    X(unsigned, hashCursor, (CXCursor)) \
+    X(CXString, getCursorSpelling, (CXCursor)) \
+    X(CXSourceRange, getCursorExtent, (CXCursor)) \
+    X(CXSourceLocation, getCursorLocation, (CXCursor)) \
+    X(CXSourceLocation, getRangeStart, (CXSourceRange)) \
+    X(CXSourceLocation, getRangeEnd, (CXSourceRange)) \
+    X(void, getSpellingLocation, (CXSourceLocation, CXFile *, unsigned *, \
+                                  unsigned *, unsigned *)) \
+    X(CXString, getFileName, (CXFile)) \
+    X(void, tokenize, (CXTranslationUnit, CXSourceRange, CXToken **, \
+                       unsigned *)) \
+    X(void, disposeTokens, (CXTranslationUnit, CXToken *, unsigned)) \
+    X(CXString, getTokenSpelling, (CXTranslationUnit, CXToken)) \
+    X(CXSourceLocation, getTokenLocation, (CXTranslationUnit, CXToken)) \
+    X(const char *, getCString, (CXString)) \
+    X(CXString, getClangVersion, (void)) \
+    X(void, disposeString, (CXString))
+
+typedef struct LibClang {
+#define LIBCLANG_POINTER(ret, name, args) ret (*name) args;
+    LIBCLANG_FUNCTIONS(LIBCLANG_POINTER)
+#undef LIBCLANG_POINTER
+} LibClang;
+
+extern LibClang libclang;
+
+#define clang_createIndex libclang.createIndex
+#define clang_disposeIndex libclang.disposeIndex
+#define clang_createTranslationUnitFromSourceFile \
+    libclang.createTranslationUnitFromSourceFile
+#define clang_disposeTranslationUnit libclang.disposeTranslationUnit
+#define clang_getTranslationUnitCursor libclang.getTranslationUnitCursor
+#define clang_visitChildren libclang.visitChildren
+#define clang_hashCursor libclang.hashCursor
+#define clang_getCursorSpelling libclang.getCursorSpelling
+#define clang_getCursorExtent libclang.getCursorExtent
+#define clang_getCursorLocation libclang.getCursorLocation
+#define clang_getRangeStart libclang.getRangeStart
+#define clang_getRangeEnd libclang.getRangeEnd
+#define clang_getSpellingLocation libclang.getSpellingLocation
+#define clang_getFileName libclang.getFileName
+#define clang_tokenize libclang.tokenize
+#define clang_disposeTokens libclang.disposeTokens
+#define clang_getTokenSpelling libclang.getTokenSpelling
+#define clang_getTokenLocation libclang.getTokenLocation
+#define clang_getCString libclang.getCString
+#define clang_getClangVersion libclang.getClangVersion
+#define clang_disposeString libclang.disposeString
+
+#endif /* C99CONV_LINK_LIBCLANG */
+
+#endif /* C99CONV_LIBCLANG_H */
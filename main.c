@@ -0,0 +1,476 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "c99conv.h"
+#include "server.h"
+#include "cache.h"
+
+/*
+ * The build ID keys the conversion cache of c99wrap, which asks for it
+ * with --build-id. The Makefiles derive it from the converter sources, as
+ * a pp-number so that it survives any shell quoting. --build-id adds the
+ * libclang the conversions would use, as their output depends on it too.
+ */
+#ifdef C99CONV_BUILD_ID
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+#define BUILD_ID TO_STRING(C99CONV_BUILD_ID)
+#endif
+
+typedef struct Job {
+    const char *infile, *outfile;
+    long size; // of infile, for scheduling
+    unsigned idx; // position in the list
+} Job;
+
+typedef struct JobList {
+    Job *jobs;
+    unsigned n_jobs;
+    unsigned n_allocated_jobs;
+    char *buf; // backing storage for names read from a list file
+} JobList;
+
+static int add_job(JobList *list, const char *infile, const char *outfile)
+{
+    if (list->n_jobs == list->n_allocated_jobs) {
+        unsigned num = list->n_allocated_jobs ? list->n_allocated_jobs * 2 : 16;
+        void *mem = realloc(list->jobs, sizeof(*list->jobs) * num);
+        if (!mem) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        list->jobs = (Job *) mem;
+        list->n_allocated_jobs = num;
+    }
+    list->jobs[list->n_jobs].infile = infile;
+    list->jobs[list->n_jobs].outfile = outfile;
+    list->jobs[list->n_jobs].size = 0;
+    list->jobs[list->n_jobs].idx = list->n_jobs;
+    list->n_jobs++;
+
+    return 0;
+}
+
+/*
+ * Cut the next file name out of the line at *p, terminating it in place.
+ * Names containing spaces can be put in double quotes. Returns NULL at the
+ * end of the line.
+ */
+static char *next_list_field(char **p)
+{
+    char *str = *p, *start;
+
+    while (*str == ' ' || *str == '\t' || *str == '\r')
+        str++;
+    if (!*str)
+        return NULL;
+
+    if (*str == '"') {
+        start = ++str;
+        while (*str && *str != '"')
+            str++;
+    } else {
+        start = str;
+        while (*str && !isspace((unsigned char) *str))
+            str++;
+    }
+    if (*str)
+        *str++ = 0;
+    *p = str;
+
+    return start;
+}
+
+/*
+ * Read a batch list: one "<in> <out>" pair per line. Empty lines and lines
+ * starting with # are skipped.
+ */
+static int read_job_list(const char *filename, JobList *list)
+{
+    FILE *f = !strcmp(filename, "-") ? stdin : fopen(filename, "rb");
+    size_t size = 0, n_allocated = 0;
+    char *line, *next;
+    unsigned lnum = 0;
+
+    if (!f) {
+        fprintf(stderr, "Unable to open batch list %s\n", filename);
+        return 1;
+    }
+    for (;;) {
+        size_t n;
+
+        if (n_allocated - size < 4096) {
+            void *mem;
+
+            n_allocated = n_allocated ? n_allocated * 2 : 65536;
+            mem = realloc(list->buf, n_allocated + 1);
+            if (!mem) {
+                fprintf(stderr, "Out of memory while reading %s\n", filename);
+                if (f != stdin)
+                    fclose(f);
+                return 1;
+            }
+            list->buf = (char *) mem;
+        }
+        n = fread(&list->buf[size], 1, n_allocated - size, f);
+        size += n;
+        if (!n)
+            break;
+    }
+    if (f != stdin)
+        fclose(f);
+    list->buf[size] = 0;
+
+    for (line = list->buf; line; line = next) {
+        char *infile, *outfile;
+
+        lnum++;
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = 0;
+
+        infile = next_list_field(&line);
+        if (!infile || *infile == '#')
+            continue;
+        outfile = next_list_field(&line);
+        if (!outfile || next_list_field(&line)) {
+            fprintf(stderr, "%s:%u: expected <in> <out>\n", filename, lnum);
+            return 1;
+        }
+        if (add_job(list, infile, outfile))
+            return 1;
+    }
+
+    return 0;
+}
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+#else
+typedef pthread_t Thread;
+#endif
+
+/*
+ * Jobs run on several threads share one queue. It is sorted largest file
+ * first, so that a huge file picked up late does not leave the other
+ * threads idle at the end.
+ */
+typedef struct JobQueue {
+    JobList *list;
+    unsigned next;
+    const C99ConvOptions *opts;
+    int res;
+    C99ConvStats stats; // of all workers
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+} JobQueue;
+
+static int compare_job_sizes(const void *a, const void *b)
+{
+    const Job *ja = (const Job *) a, *jb = (const Job *) b;
+
+    if (ja->size != jb->size)
+        return ja->size > jb->size ? -1 : 1;
+
+    return ja->idx < jb->idx ? -1 : ja->idx > jb->idx;
+}
+
+static void lock_queue(JobQueue *q)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&q->lock);
+#else
+    pthread_mutex_lock(&q->lock);
+#endif
+}
+
+static void unlock_queue(JobQueue *q)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&q->lock);
+#else
+    pthread_mutex_unlock(&q->lock);
+#endif
+}
+
+/* worker thread: convert jobs from the queue, with a context of its own */
+#ifdef _WIN32
+static unsigned __stdcall run_worker(void *arg)
+#else
+static void *run_worker(void *arg)
+#endif
+{
+    JobQueue *q = (JobQueue *) arg;
+    C99ConvContext *ctx = c99conv_create_context();
+    int res = 0;
+
+    if (!ctx) {
+        fprintf(stderr, "Out of memory\n");
+        res = 1;
+    }
+    while (ctx) {
+        Job *job = NULL;
+
+        lock_queue(q);
+        if (q->next < q->list->n_jobs)
+            job = &q->list->jobs[q->next++];
+        unlock_queue(q);
+        if (!job)
+            break;
+
+        if (c99conv_convert_file(ctx, job->infile, job->outfile, q->opts))
+            res = 1;
+    }
+
+    lock_queue(q);
+    if (ctx) {
+        C99ConvStats stats;
+
+        c99conv_get_stats(ctx, &stats);
+        c99conv_add_stats(&q->stats, &stats);
+    }
+    if (res)
+        q->res = 1;
+    unlock_queue(q);
+    c99conv_free_context(ctx);
+
+    return 0;
+}
+
+static int run_jobs_parallel(JobList *list, const C99ConvOptions *opts,
+                             unsigned n_threads, C99ConvStats *stats)
+{
+    JobQueue q;
+    Thread *threads;
+    unsigned n, n_started;
+
+    for (n = 0; n < list->n_jobs; n++) {
+        struct stat st;
+
+        if (!strcmp(list->jobs[n].infile, "-") ||
+            !strcmp(list->jobs[n].outfile, "-")) {
+            fprintf(stderr, "stdin and stdout can't be used with --jobs\n");
+            return 1;
+        }
+        if (!stat(list->jobs[n].infile, &st))
+            list->jobs[n].size = (long) st.st_size;
+    }
+    qsort(list->jobs, list->n_jobs, sizeof(*list->jobs), compare_job_sizes);
+
+    threads = (Thread *) malloc(sizeof(*threads) * n_threads);
+    if (!threads) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    memset(&q, 0, sizeof(q));
+    q.list = list;
+    q.opts = opts;
+#ifdef _WIN32
+    InitializeCriticalSection(&q.lock);
+#else
+    pthread_mutex_init(&q.lock, NULL);
+#endif
+
+    for (n_started = 0; n_started < n_threads; n_started++) {
+#ifdef _WIN32
+        threads[n_started] = (HANDLE) _beginthreadex(NULL, 0, run_worker, &q,
+                                                     0, NULL);
+        if (!threads[n_started])
+            break;
+#else
+        if (pthread_create(&threads[n_started], NULL, run_worker, &q))
+            break;
+#endif
+    }
+    if (!n_started) {
+        fprintf(stderr, "Unable to start worker threads\n");
+        q.res = 1;
+    }
+    for (n = 0; n < n_started; n++) {
+#ifdef _WIN32
+        WaitForSingleObject(threads[n], INFINITE);
+        CloseHandle(threads[n]);
+#else
+        pthread_join(threads[n], NULL);
+#endif
+    }
+
+#ifdef _WIN32
+    DeleteCriticalSection(&q.lock);
+#else
+    pthread_mutex_destroy(&q.lock);
+#endif
+    free(threads);
+    *stats = q.stats;
+
+    return q.res;
+}
+
+int main(int argc, char *argv[])
+{
+    C99ConvContext *ctx;
+    C99ConvOptions opts;
+    C99ConvStats stats;
+    JobList list;
+    const char *batch = NULL, *server = NULL;
+    unsigned n_threads = 0; // 0 is the default, for the server too
+    int arg = 1;
+    int res = 0;
+    int print_stats = 0, stats_json = 0;
+    unsigned n;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&stats, 0, sizeof(stats));
+    memset(&list, 0, sizeof(list));
+    while (arg < argc) {
+        if (!strcmp(argv[arg], "-ms")) {
+            opts.ms_compat = 1;
+        } else if (!strncmp(argv[arg], "--trace=", 8)) {
+            opts.trace_level = atoi(argv[arg] + 8);
+        } else if (!strcmp(argv[arg], "--no-prescan")) {
+            opts.no_prescan = 1;
+        } else if (!strcmp(argv[arg], "--clang-lexer")) {
+            opts.clang_lexer = 1;
+        } else if (!strcmp(argv[arg], "--check-lexer")) {
+            opts.check_lexer = 1;
+        } else if (!strcmp(argv[arg], "--stats") ||
+                   !strcmp(argv[arg], "--stats=json")) {
+            print_stats = 1;
+            stats_json = argv[arg][7] == '=';
+        } else if (!strcmp(argv[arg], "--batch") && arg + 1 < argc) {
+            batch = argv[++arg];
+        } else if (!strcmp(argv[arg], "--jobs") && arg + 1 < argc) {
+            int num = atoi(argv[++arg]);
+            n_threads = num > 0 ? num : 1;
+        } else if (!strcmp(argv[arg], "--server") && arg + 1 < argc) {
+            server = argv[++arg];
+        } else if (!strcmp(argv[arg], "--build-id")) {
+#ifdef BUILD_ID
+            char clang[CACHE_BUILD_ID_SIZE - sizeof(BUILD_ID)];
+            if (c99conv_describe_libclang(clang, sizeof(clang)))
+                return 1;
+            printf("%s %s\n", BUILD_ID, clang);
+            return 0;
+#else
+            fprintf(stderr, "This build has no build ID\n");
+            return 1;
+#endif
+        } else if (!strcmp(argv[arg], "--cache-stats") ||
+                   !strcmp(argv[arg], "--cache-clear")) {
+            Cache cache;
+            if (cache_open(&cache)) {
+                fprintf(stderr, "The cache is disabled, set %s to enable "
+                        "it\n", CACHE_DIR_ENV);
+                return 1;
+            }
+            if (!strcmp(argv[arg], "--cache-clear"))
+                return cache_clear(&cache);
+            cache_print_stats(&cache, stdout);
+            return 0;
+        } else {
+            break;
+        }
+        arg++;
+    }
+    if (server && arg == argc && !batch)
+        return run_server(server, opts.trace_level, n_threads);
+    if (server || (batch ? arg != argc : (argc < arg + 2 || (argc - arg) % 2))) {
+        fprintf(stderr, "%s [-ms] [--trace=<level>] [--jobs <n>] <in> <out> "
+                "[<in> <out> ...]\n", argv[0]);
+        fprintf(stderr, "%s [-ms] [--trace=<level>] [--jobs <n>] "
+                "--batch <list>\n", argv[0]);
+        fprintf(stderr, "%s [--trace=<level>] [--jobs <n>] --server <socket>\n",
+                argv[0]);
+        fprintf(stderr, "%s --cache-stats | --cache-clear | --build-id\n",
+                argv[0]);
+        fprintf(stderr, "use - as <in> or <out> for stdin or stdout\n");
+        fprintf(stderr, "the batch list has one \"<in> <out>\" pair per line, "
+                "- reads it from stdin\n");
+        fprintf(stderr, "--no-prescan parses even files that need no "
+                "conversion\n");
+        fprintf(stderr, "--clang-lexer tokenizes with libclang, "
+                "--check-lexer checks the native lexer against it\n");
+        fprintf(stderr, "--stats[=json] prints where the time went and what "
+                "was converted to stderr\n");
+        fprintf(stderr, "trace levels: 1 = registries, 2 = cursors, "
+                "3 = tokens\n");
+        fprintf(stderr, "the server converts for c99wrap with <n> workers, "
+                "one per cpu by default\n");
+        return 1;
+    }
+
+    if (batch) {
+        res = read_job_list(batch, &list);
+    } else {
+        for (; arg < argc && !res; arg += 2)
+            res = add_job(&list, argv[arg], argv[arg + 1]);
+    }
+    if (res) {
+        free(list.jobs);
+        free(list.buf);
+        return 1;
+    }
+
+    if (n_threads > list.n_jobs)
+        n_threads = list.n_jobs;
+    if (n_threads > 1) {
+        res = run_jobs_parallel(&list, &opts, n_threads, &stats);
+        free(list.jobs);
+        free(list.buf);
+        if (print_stats)
+            c99conv_print_stats(stderr, &stats, stats_json);
+        return res;
+    }
+
+    // one context for all files, so that libclang is only set up once
+    ctx = c99conv_create_context();
+    if (!ctx) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (n = 0; n < list.n_jobs; n++) {
+        if (c99conv_convert_file(ctx, list.jobs[n].infile,
+                                 list.jobs[n].outfile, &opts))
+            res = 1;
+    }
+    c99conv_get_stats(ctx, &stats);
+    c99conv_free_context(ctx);
+    free(list.jobs);
+    free(list.buf);
+    if (print_stats)
+        c99conv_print_stats(stderr, &stats, stats_json);
+
+    return res;
+}
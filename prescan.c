@@ -0,0 +1,760 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "prescan.h"
+#include "scan.h"
+
+/*
+ * The converter rewrites designated initializers, compound literals and
+ * declarations that follow statements or sit in a for loop header. The
+ * pre-scan looks for the token patterns these can start with:
+ *
+ *   { .member      , .member      { [index]      , [index]
+ *   { member:      , member:      (gnu designators)
+ *   (type) {       outside of function definitions and if/for/while/switch
+ *   for (type ...
+ *   a declaration after a statement in the same block
+ *
+ * Whenever a token sequence could be read either way, it is assumed to
+ * need conversion.
+ *
+ * All of these hinge on brackets and separators, which the candidate
+ * scanner finds at vector speed. The tokens between them are only lexed
+ * where a rule looks at them.
+ */
+
+enum PrescanTokenType {
+    PS_NONE,
+    PS_IDENT,
+    PS_NUMBER,
+    PS_STRING,
+    PS_PUNCT,
+};
+
+enum PrescanKeyword {
+    KW_NONE,      // plain identifier
+    KW_CONTROL,   // if, while, switch: (...) { is not a compound literal
+    KW_FOR,
+    KW_STMT,      // starts a statement
+    KW_DEFAULT,
+    KW_TYPE,      // certainly starts a declaration
+    KW_AMBIGUOUS, // may start a declaration or a statement
+    KW_TAG,       // struct, union, enum
+    KW_TYPEDEF,
+    KW_TYPEDEF_NAME,
+};
+
+static const struct {
+    const char *name;
+    enum PrescanKeyword kw;
+} prescan_keywords[] = {
+    { "if", KW_CONTROL }, { "while", KW_CONTROL }, { "switch", KW_CONTROL },
+    { "for", KW_FOR },
+    { "else", KW_STMT }, { "do", KW_STMT }, { "return", KW_STMT },
+    { "goto", KW_STMT }, { "break", KW_STMT }, { "continue", KW_STMT },
+    { "case", KW_STMT }, { "sizeof", KW_STMT }, { "asm", KW_STMT },
+    { "__asm", KW_STMT }, { "__asm__", KW_STMT },
+    { "default", KW_DEFAULT },
+    { "void", KW_TYPE }, { "char", KW_TYPE }, { "short", KW_TYPE },
+    { "int", KW_TYPE }, { "long", KW_TYPE }, { "float", KW_TYPE },
+    { "double", KW_TYPE }, { "signed", KW_TYPE }, { "unsigned", KW_TYPE },
+    { "_Bool", KW_TYPE }, { "_Complex", KW_TYPE }, { "const", KW_TYPE },
+    { "volatile", KW_TYPE }, { "restrict", KW_TYPE }, { "static", KW_TYPE },
+    { "extern", KW_TYPE }, { "auto", KW_TYPE }, { "register", KW_TYPE },
+    { "inline", KW_TYPE }, { "_Alignas", KW_TYPE }, { "_Atomic", KW_TYPE },
+    { "_Noreturn", KW_TYPE }, { "_Thread_local", KW_TYPE },
+    { "_Static_assert", KW_TYPE }, { "__thread", KW_TYPE },
+    { "__inline", KW_TYPE }, { "__inline__", KW_TYPE },
+    { "__forceinline", KW_TYPE }, { "__restrict", KW_TYPE },
+    { "__restrict__", KW_TYPE }, { "__const", KW_TYPE },
+    { "__volatile", KW_TYPE }, { "__volatile__", KW_TYPE },
+    { "__signed", KW_TYPE }, { "__signed__", KW_TYPE },
+    { "__int8", KW_TYPE }, { "__int16", KW_TYPE }, { "__int32", KW_TYPE },
+    { "__int64", KW_TYPE }, { "__declspec", KW_TYPE },
+    { "__typeof", KW_TYPE }, { "__typeof__", KW_TYPE }, { "typeof", KW_TYPE },
+    { "__builtin_va_list", KW_TYPE }, { "__label__", KW_TYPE },
+    { "__int128", KW_TYPE }, { "__int128_t", KW_TYPE },
+    { "__uint128_t", KW_TYPE }, { "_Float16", KW_TYPE },
+    { "_Float128", KW_TYPE }, { "__float128", KW_TYPE },
+    { "__fp16", KW_TYPE }, { "__bf16", KW_TYPE },
+    { "__extension__", KW_AMBIGUOUS }, { "__attribute__", KW_AMBIGUOUS },
+    { "__attribute", KW_AMBIGUOUS },
+    { "struct", KW_TAG }, { "union", KW_TAG }, { "enum", KW_TAG },
+    { "typedef", KW_TYPEDEF },
+};
+
+typedef struct PrescanName {
+    const char *name;
+    unsigned len;
+    enum PrescanKeyword kw;
+} PrescanName;
+
+/* keywords and typedef names, open addressing */
+typedef struct PrescanNames {
+    PrescanName *names;
+    unsigned n_names;
+    unsigned n_allocated_names; // power of 2
+} PrescanNames;
+
+typedef struct PrescanToken {
+    enum PrescanTokenType type;
+    char punct;
+    const char *str;
+    unsigned len;
+    enum PrescanKeyword kw;
+} PrescanToken;
+
+typedef struct PrescanBracket {
+    char type;               // ( [ or {
+    char is_block;           // { opens a block of statements
+    char seen_stmt;          // { has seen a statement
+    enum PrescanKeyword pre; // ( follows this keyword
+    char pre_call;           // ( follows a name, ) or ]
+} PrescanBracket;
+
+#define PRESCAN_MAX_DEPTH 1024
+
+static unsigned hash_prescan_name(const char *str, unsigned len)
+{
+    unsigned hash = 2166136261U, n;
+
+    for (n = 0; n < len; n++)
+        hash = (hash ^ (unsigned char) str[n]) * 16777619U;
+
+    return hash;
+}
+
+static PrescanName *find_prescan_name(PrescanNames *names, const char *str,
+                                      unsigned len)
+{
+    unsigned mask = names->n_allocated_names - 1;
+    unsigned n = hash_prescan_name(str, len) & mask;
+
+    while (names->names[n].name) {
+        if (names->names[n].len == len &&
+            !memcmp(names->names[n].name, str, len))
+            break;
+        n = (n + 1) & mask;
+    }
+
+    return &names->names[n];
+}
+
+static int add_prescan_name(PrescanNames *names, const char *str,
+                            unsigned len, enum PrescanKeyword kw)
+{
+    PrescanName *name;
+
+    if ((names->n_names + 1) * 2 > names->n_allocated_names) {
+        PrescanNames grown;
+        unsigned n;
+
+        grown.n_allocated_names = names->n_allocated_names ?
+                                  names->n_allocated_names * 2 : 256;
+        grown.n_names = 0;
+        grown.names = (PrescanName *) calloc(grown.n_allocated_names,
+                                             sizeof(*grown.names));
+        if (!grown.names)
+            return 1;
+        for (n = 0; n < names->n_allocated_names; n++) {
+            if (names->names[n].name)
+                *find_prescan_name(&grown, names->names[n].name,
+                                   names->names[n].len) = names->names[n];
+        }
+        grown.n_names = names->n_names;
+        free(names->names);
+        *names = grown;
+    }
+
+    name = find_prescan_name(names, str, len);
+    if (!name->name) {
+        name->name = str;
+        name->len = len;
+        name->kw = kw;
+        names->n_names++;
+    }
+
+    return 0;
+}
+
+static int is_ident_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_' || c == '$' || (c & 0x80);
+}
+
+/*
+ * Read the token at *pos. Comments, whitespace and preprocessor lines
+ * (line markers and pragmas) are skipped. Returns 0 at the end.
+ */
+static int next_prescan_token(const char *buf, size_t len, size_t *pos,
+                              PrescanToken *tok)
+{
+    size_t p = *pos;
+    int line_start = p == 0;
+
+    for (;;) {
+        if (p >= len)
+            return 0;
+        if (buf[p] == '\n') {
+            line_start = 1;
+            p++;
+        } else if (buf[p] == ' ' || buf[p] == '\t' || buf[p] == '\r' ||
+                   buf[p] == '\f' || buf[p] == '\v') {
+            p++;
+        } else if (buf[p] == '/' && p + 1 < len && buf[p + 1] == '/') {
+            while (p < len && buf[p] != '\n')
+                p++;
+        } else if (buf[p] == '/' && p + 1 < len && buf[p + 1] == '*') {
+            for (p += 2; p + 1 < len && (buf[p] != '*' || buf[p + 1] != '/'); p++);
+            p += 2;
+        } else if (buf[p] == '#' && line_start) {
+            while (p < len && buf[p] != '\n')
+                p += buf[p] == '\\' ? 2 : 1;
+        } else if (buf[p] == '\\' && p + 1 < len &&
+                   (buf[p + 1] == '\n' || buf[p + 1] == '\r')) {
+            p += 2;
+        } else {
+            break;
+        }
+    }
+
+    tok->str = &buf[p];
+    tok->kw = KW_NONE;
+    if (buf[p] == '"' || buf[p] == '\'') {
+        char quote = buf[p++];
+        while (p < len && buf[p] != quote && buf[p] != '\n')
+            p += buf[p] == '\\' ? 2 : 1;
+        if (p < len && buf[p] == quote)
+            p++;
+        tok->type = PS_STRING;
+    } else if ((buf[p] >= '0' && buf[p] <= '9') ||
+               (buf[p] == '.' && p + 1 < len && buf[p + 1] >= '0' &&
+                buf[p + 1] <= '9')) {
+        // pp-number, e.g. 1.5e+3f
+        for (p++; p < len; p++) {
+            if ((buf[p] == '+' || buf[p] == '-') &&
+                (buf[p - 1] == 'e' || buf[p - 1] == 'E' ||
+                 buf[p - 1] == 'p' || buf[p - 1] == 'P'))
+                continue;
+            if (!is_ident_char(buf[p]) && buf[p] != '.')
+                break;
+        }
+        tok->type = PS_NUMBER;
+    } else if (is_ident_char(buf[p])) {
+        while (p < len && is_ident_char(buf[p]))
+            p++;
+        tok->type = PS_IDENT;
+    } else {
+        tok->type = PS_PUNCT;
+        tok->punct = buf[p++];
+        // digraphs
+        if (p < len) {
+            char c = buf[p];
+            if (tok->punct == '<' && c == ':') {
+                tok->punct = '[';
+                p++;
+            } else if (tok->punct == ':' && c == '>') {
+                tok->punct = ']';
+                p++;
+            } else if (tok->punct == '<' && c == '%') {
+                tok->punct = '{';
+                p++;
+            } else if (tok->punct == '%' && c == '>') {
+                tok->punct = '}';
+                p++;
+            }
+        }
+    }
+    tok->len = (unsigned) ((p > len ? len : p) - (tok->str - buf));
+    *pos = p;
+
+    return 1;
+}
+
+#define IS_PUNCT(tok, c) ((tok)->type == PS_PUNCT && (tok)->punct == (c))
+
+/*
+ * Classify a statement in a block that starts with t1, followed by t2.
+ * Returns 1 if it may be a declaration, and sets *is_stmt if it may be a
+ * statement.
+ */
+static int classify_statement(const PrescanToken *t1, const PrescanToken *t2,
+                              int *is_stmt)
+{
+    *is_stmt = 0;
+    if (t1->type == PS_IDENT) {
+        switch (t1->kw) {
+        case KW_TYPE:
+        case KW_TAG:
+        case KW_TYPEDEF:
+            return 1;
+        case KW_AMBIGUOUS:
+            *is_stmt = 1;
+            return 1;
+        case KW_TYPEDEF_NAME:
+            // typedef name followed by a declarator, T (x) and T (*fp)(void)
+            // included
+            if (t2->type == PS_IDENT || IS_PUNCT(t2, '*') ||
+                IS_PUNCT(t2, '(') || IS_PUNCT(t2, '['))
+                return 1;
+            break;
+        case KW_NONE:
+            // a type that wasn't seen being declared, or a multiplication
+            if (IS_PUNCT(t2, '*')) {
+                *is_stmt = 1;
+                return 1;
+            }
+            if (t2->type == PS_IDENT)
+                return 1;
+            break;
+        default:
+            break;
+        }
+    }
+    *is_stmt = 1;
+
+    return 0;
+}
+
+#define PRESCAN_CHUNK 1024
+
+typedef struct PrescanState {
+    const char *buf;
+    size_t len;
+    PrescanNames *names;
+    PrescanBracket stack[PRESCAN_MAX_DEPTH];
+    unsigned depth, brace_depth;
+    unsigned typedef_depth; // bracket depth of a typedef
+    int at_start;           // the next token starts a statement
+    char prev;              // the last structural character, 0 at the start
+    // the tokens between prev and the current structural character, as far
+    // as they were lexed
+    unsigned gap_tokens;
+    PrescanToken last;
+    int after_tag;          // { at file scope follows struct, union or enum
+    unsigned offsets[PRESCAN_CHUNK];
+} PrescanState;
+
+/*
+ * The bracket or punctuator a candidate stands for, with the digraphs
+ * mapped to their brackets, and its length in *cand_len.
+ */
+static char candidate_char(const char *buf, size_t len, size_t off,
+                           unsigned *cand_len)
+{
+    char c = buf[off], next = off + 1 < len ? buf[off + 1] : 0;
+
+    *cand_len = 1;
+    if (c == '<') {
+        *cand_len = 2;
+        return next == ':' ? '[' : '{';
+    } else if (c == '%') {
+        *cand_len = 2;
+        return '}';
+    } else if (c == ':' && next == '>') {
+        *cand_len = 2;
+        return ']';
+    }
+
+    return c;
+}
+
+static void punct_token(PrescanToken *tok, char c)
+{
+    tok->type = c ? PS_PUNCT : PS_NONE;
+    tok->punct = c;
+    tok->str = NULL;
+    tok->len = 0;
+    tok->kw = KW_NONE;
+}
+
+/*
+ * Find the last token in buf[start, end) by reading backwards. Returns 0 if
+ * there is none, and -1 if the end of the text has to be lexed forwards to
+ * tell, like after a comment, a line break or a dot.
+ */
+static int last_prescan_token(const char *buf, size_t start, size_t end,
+                              PrescanToken *tok)
+{
+    size_t p = end, q;
+
+    while (p > start && (buf[p - 1] == ' ' || buf[p - 1] == '\t'))
+        p--;
+    if (p == start)
+        return 0;
+
+    q = p - 1;
+    tok->kw = KW_NONE;
+    if (is_ident_char(buf[q])) {
+        while (q > start && is_ident_char(buf[q - 1]))
+            q--;
+        // a member name or the end of a pp-number like 1.5e3
+        if (q > start && buf[q - 1] == '.')
+            return -1;
+        tok->type = buf[q] >= '0' && buf[q] <= '9' ? PS_NUMBER : PS_IDENT;
+    } else if (buf[q] == '"' || buf[q] == '\'') {
+        tok->type = PS_STRING;
+    } else if (buf[q] == '/' || buf[q] == '\\' || buf[q] == '#' ||
+               buf[q] == '\n' || buf[q] == '\r' || buf[q] == '\f' ||
+               buf[q] == '\v' || !buf[q]) {
+        return -1;
+    } else {
+        tok->type = PS_PUNCT;
+        tok->punct = buf[q];
+    }
+    tok->str = &buf[q];
+    tok->len = (unsigned) (p - q);
+
+    return 1;
+}
+
+/*
+ * Check whether buf[start, end) may contain the keyword typedef, before
+ * lexing it to make sure.
+ */
+static int has_typedef(const char *buf, size_t start, size_t end)
+{
+    size_t p = start + 6;
+
+    // Horspool search, keyed on the last character of the window
+    while (p < end) {
+        switch (buf[p]) {
+        case 'f':
+            if (!memcmp(&buf[p - 6], "typedef", 7) &&
+                (p == 6 || !is_ident_char(buf[p - 7])) &&
+                (p + 1 == end || !is_ident_char(buf[p + 1])))
+                return 1;
+            p += 7;
+            break;
+        case 't': p += 6; break;
+        case 'y': p += 5; break;
+        case 'p': p += 4; break;
+        case 'd': p += 2; break;
+        case 'e': p += 1; break;
+        default:  p += 7; break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Lex the text between the last structural character and c, as far as
+ * needed for a statement start, a typedef, or the rules for c.
+ */
+static int scan_gap(PrescanState *st, size_t start, size_t end, char c)
+{
+    PrescanToken tok, first, second, prev_tok, before, last;
+    unsigned need = st->at_start || c == ':' ? 2 : c == '[', n;
+    int need_all = 0, may_typedef = 0, collect = 0, lexed_all = 0, found = 0;
+    size_t pos = start;
+
+    // ( and { only look at the last token
+    if (c == '(' || c == '{') {
+        found = last_prescan_token(st->buf, start, end, &last);
+        need_all = found < 0;
+    }
+    // at file scope, { takes the two tokens before it to tell a struct,
+    // union or enum body from a function body
+    if (c == '{' && !st->depth)
+        need_all = 1;
+    // typedef only follows other declaration specifiers and attributes;
+    // the names it declares are collected for telling "T *x;" from "a * b;"
+    if (st->typedef_depth == (unsigned) -1) {
+        if (!st->prev || st->prev == ';' || st->prev == '{' ||
+            st->prev == '}' || st->prev == ')')
+            may_typedef = has_typedef(st->buf, start, end);
+    } else {
+        for (n = st->typedef_depth; n < st->depth && st->stack[n].type != '{'; n++);
+        collect = n == st->depth;
+    }
+
+    st->gap_tokens = 0;
+    punct_token(&prev_tok, st->prev);
+    first = second = before = prev_tok;
+    while (need_all || may_typedef || collect || st->gap_tokens < need) {
+        if (!next_prescan_token(st->buf, end, &pos, &tok)) {
+            lexed_all = 1;
+            break;
+        }
+        if (tok.type == PS_IDENT) {
+            PrescanName *name = find_prescan_name(st->names, tok.str, tok.len);
+            if (name->name)
+                tok.kw = name->kw;
+        }
+        if (st->gap_tokens == 0)
+            first = tok;
+        else if (st->gap_tokens == 1)
+            second = tok;
+        st->gap_tokens++;
+
+        if (may_typedef && tok.kw == KW_TYPEDEF) {
+            st->typedef_depth = st->depth;
+            may_typedef = 0;
+            collect = 1;
+        } else if (collect && tok.type == PS_IDENT &&
+                   (tok.kw == KW_NONE || tok.kw == KW_TYPEDEF_NAME) &&
+                   !(prev_tok.type == PS_IDENT && prev_tok.kw == KW_TAG)) {
+            if (add_prescan_name(st->names, tok.str, tok.len, KW_TYPEDEF_NAME))
+                return 1;
+        }
+        before = prev_tok;
+        prev_tok = tok;
+    }
+
+    st->last = prev_tok;
+    if (c == '{' && !st->depth)
+        st->after_tag = (prev_tok.type == PS_IDENT && prev_tok.kw == KW_TAG) ||
+                        (prev_tok.type == PS_IDENT && before.type == PS_IDENT &&
+                         before.kw == KW_TAG);
+    if (found > 0 && !lexed_all) {
+        if (last.type == PS_IDENT) {
+            PrescanName *name = find_prescan_name(st->names, last.str, last.len);
+            if (name->name)
+                last.kw = name->kw;
+        }
+        st->last = last;
+        if (!st->gap_tokens)
+            st->gap_tokens = 1;
+    }
+
+    if (st->at_start) {
+        PrescanBracket *top = &st->stack[st->depth - 1];
+        int is_stmt;
+
+        st->at_start = 0;
+        if (st->gap_tokens < 2)
+            punct_token(&second, c);
+        if (!st->gap_tokens)
+            first = second;
+        if (IS_PUNCT(&first, '}'))
+            return 0;
+        if (first.type != PS_IDENT) {
+            top->seen_stmt = 1;
+            return 0;
+        }
+        if (classify_statement(&first, &second, &is_stmt) && top->seen_stmt)
+            return 1;
+        if (is_stmt)
+            top->seen_stmt = 1;
+    }
+
+    return 0;
+}
+
+static int scan_punct(PrescanState *st, char c)
+{
+    PrescanBracket *stack = st->stack;
+    PrescanBracket *top = st->depth ? &stack[st->depth - 1] : NULL;
+    PrescanToken p1;
+    int stmt_end = 0;
+
+    if (st->gap_tokens)
+        p1 = st->last;
+    else
+        punct_token(&p1, st->prev);
+
+    switch (c) {
+    case ':':
+        // { member: val
+        if (st->gap_tokens == 1 && p1.type == PS_IDENT &&
+            p1.kw != KW_DEFAULT && (st->prev == '{' || st->prev == ','))
+            return 1;
+        break;
+    case '[':
+        // { [index] = val
+        if (IS_PUNCT(&p1, '{') || IS_PUNCT(&p1, ','))
+            return 1;
+        // fall through
+    case '(':
+        if (st->depth == PRESCAN_MAX_DEPTH)
+            return 1;
+        top = &stack[st->depth++];
+        top->type = c;
+        top->pre = p1.type == PS_IDENT ? p1.kw : KW_NONE;
+        top->pre_call = (p1.type == PS_IDENT && p1.kw != KW_STMT) ||
+                        IS_PUNCT(&p1, ')') || IS_PUNCT(&p1, ']');
+        // for (int i = 0; ...
+        if (top->pre == KW_FOR) {
+            top->seen_stmt = 1;
+            st->at_start = 1;
+        }
+        break;
+    case ')':
+    case ']':
+        if (!st->depth || top->type != (c == ')' ? '(' : '['))
+            return 1;
+        st->depth--;
+        break;
+    case '{':
+        if (IS_PUNCT(&p1, ')')) {
+            // (type) { val }, unless this is the body of a function
+            // or of an if/for/while/switch
+            const PrescanBracket *paren = &stack[st->depth];
+            if (top && top->type != '{')
+                return 1;
+            if (st->brace_depth ? paren->pre != KW_CONTROL &&
+                                  paren->pre != KW_FOR
+                                : !paren->pre_call)
+                return 1;
+        }
+        if (st->depth == PRESCAN_MAX_DEPTH)
+            return 1;
+        // a function or statement body, a statement expression, or a
+        // nested block, rather than a struct body or an initializer
+        if (IS_PUNCT(&p1, ')') || IS_PUNCT(&p1, '(') ||
+            (p1.type == PS_IDENT && p1.kw == KW_STMT)) {
+            stack[st->depth].is_block = 1;
+        } else if (!top) {
+            // at file scope, any { but an initializer or a struct, union
+            // or enum body may be a function body, like after the
+            // parameter declarations of a K&R definition or after
+            // int (*f(void))[2]
+            stack[st->depth].is_block = !IS_PUNCT(&p1, '=') && !st->after_tag;
+        } else {
+            stack[st->depth].is_block = top && top->type == '{' &&
+                                        top->is_block &&
+                                        (IS_PUNCT(&p1, '{') ||
+                                         IS_PUNCT(&p1, '}') ||
+                                         IS_PUNCT(&p1, ';') ||
+                                         IS_PUNCT(&p1, ':'));
+        }
+        if (top && top->type == '{' && top->is_block &&
+            stack[st->depth].is_block)
+            top->seen_stmt = 1;
+        top = &stack[st->depth++];
+        top->type = '{';
+        top->seen_stmt = 0;
+        st->brace_depth++;
+        st->at_start = top->is_block;
+        break;
+    case '}':
+        if (!st->depth || top->type != '{')
+            return 1;
+        stmt_end = top->is_block;
+        st->depth--;
+        st->brace_depth--;
+        break;
+    case ';':
+        stmt_end = 1;
+        if (st->typedef_depth == st->depth)
+            st->typedef_depth = (unsigned) -1;
+        break;
+    }
+
+    // the next token starts a statement
+    if (stmt_end && st->depth && stack[st->depth - 1].type == '{' &&
+        stack[st->depth - 1].is_block)
+        st->at_start = 1;
+
+    return 0;
+}
+
+/*
+ * Walk the structural characters from the candidate scanner. The text
+ * between two of them is only lexed where a rule looks at it.
+ */
+static int scan_structure(PrescanState *st)
+{
+    Scanner scanner;
+    unsigned n = 0, n_offsets = 0;
+    size_t gap = 0;
+
+    if (st->len > (unsigned) -1 ||
+        init_scanner(&scanner, st->buf, st->len, SCAN_AUTO))
+        return 1;
+
+    for (;;) {
+        size_t off = st->len;
+        unsigned cand_len = 0;
+        char c = 0;
+
+        if (n == n_offsets) {
+            n_offsets = scan_candidates(&scanner, st->offsets, PRESCAN_CHUNK);
+            n = 0;
+        }
+        if (n < n_offsets) {
+            off = st->offsets[n++];
+            c = candidate_char(st->buf, st->len, off, &cand_len);
+        }
+
+        if (c == '.') {
+            // { .member = val   or   , .member = val; any other . is part
+            // of a number or a member access
+            if (st->prev == '{' || st->prev == ',') {
+                PrescanToken tok;
+                size_t pos = gap;
+                if (!next_prescan_token(st->buf, off, &pos, &tok)) {
+                    pos = off + 1;
+                    if (next_prescan_token(st->buf, st->len, &pos, &tok) &&
+                        tok.type == PS_IDENT)
+                        return 1;
+                }
+            }
+            continue;
+        }
+
+        if (scan_gap(st, gap, off, c))
+            return 1;
+        if (!c)
+            break;
+        if (scan_punct(st, c))
+            return 1;
+        st->prev = c;
+        gap = off + cand_len;
+    }
+
+    return st->depth != 0;
+}
+
+int prescan_needs_conversion(const char *buf, size_t len)
+{
+    PrescanNames names;
+    PrescanState *st;
+    unsigned n;
+    int res = 1;
+
+    memset(&names, 0, sizeof(names));
+    st = (PrescanState *) malloc(sizeof(*st));
+    if (!st)
+        return 1;
+    for (n = 0; n < sizeof(prescan_keywords) / sizeof(*prescan_keywords); n++) {
+        if (add_prescan_name(&names, prescan_keywords[n].name,
+                             (unsigned) strlen(prescan_keywords[n].name),
+                             prescan_keywords[n].kw))
+            goto end;
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->buf = buf;
+    st->len = len;
+    st->names = &names;
+    st->typedef_depth = (unsigned) -1;
+    res = scan_structure(st);
+
+end:
+    free(names.names);
+    free(st);
+
+    return res;
+}
@@ -0,0 +1,32 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef C99CONV_PRESCAN_H
+#define C99CONV_PRESCAN_H
+
+#include <stddef.h>
+
+/*
+ * Cheap lexical check whether preprocessed source may contain anything
+ * the converter rewrites. Returns 0 only if the source certainly needs no
+ * conversion; anything unclear counts as needing it.
+ */
+int prescan_needs_conversion(const char *buf, size_t len);
+
+#endif /* C99CONV_PRESCAN_H */
@@ -0,0 +1,322 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+static unsigned ctz(unsigned v)
+{
+    unsigned long idx;
+    _BitScanForward(&idx, v);
+    return idx;
+}
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define ctz(v) ((unsigned) __builtin_ctz(v))
+#endif
+
+/*
+ * 1 for the structural characters, 2 for the ones that start a literal,
+ * a comment, a preprocessor line or a digraph: " # % ' / <
+ */
+static const unsigned char candidate_type[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 2, 2, 0, 2, 0, 2, 1, 1, 0, 0, 1, 0, 1, 2,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 2, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0,
+};
+
+/*
+ * Handle the character at off that may start a literal, a comment, a
+ * preprocessor line or a digraph. Returns the offset to continue from,
+ * and sets *is_cand for a digraph.
+ */
+static size_t skip_special(const char *buf, size_t len, size_t off,
+                           int *is_cand)
+{
+    size_t p = off;
+    char next = p + 1 < len ? buf[p + 1] : 0;
+
+    *is_cand = 0;
+    switch (buf[p]) {
+    case '"':
+    case '\'':
+        for (p++; p < len && buf[p] != buf[off] && buf[p] != '\n';)
+            p += buf[p] == '\\' ? 2 : 1;
+        if (p < len && buf[p] == buf[off])
+            p++;
+        break;
+    case '/':
+        if (next == '/') {
+            const char *nl = (const char *) memchr(&buf[p], '\n', len - p);
+            p = nl ? (size_t) (nl - buf) : len;
+        } else if (next == '*') {
+            for (p += 2; p + 1 < len && (buf[p] != '*' || buf[p + 1] != '/'); p++);
+            p += 2;
+        } else {
+            p++;
+        }
+        break;
+    case '#':
+        // only at the start of a line
+        while (p > 0 && (buf[p - 1] == ' ' || buf[p - 1] == '\t' ||
+                         buf[p - 1] == '\r' || buf[p - 1] == '\f' ||
+                         buf[p - 1] == '\v'))
+            p--;
+        if (p > 0 && buf[p - 1] != '\n')
+            return off + 1;
+        // up to a newline that isn't escaped by an odd number of backslashes
+        for (p = off; ; p++) {
+            const char *nl = (const char *) memchr(&buf[p], '\n', len - p);
+            size_t n = 0;
+            if (!nl)
+                return len;
+            p = nl - buf;
+            while (p - n > off && buf[p - n - 1] == '\\')
+                n++;
+            if (!(n & 1))
+                break;
+        }
+        break;
+    case '<':
+        *is_cand = next == ':' || next == '%';
+        p += *is_cand ? 2 : 1;
+        break;
+    case '%':
+        *is_cand = next == '>';
+        p += *is_cand ? 2 : 1;
+        break;
+    default:
+        p++;
+        break;
+    }
+
+    return p > len ? len : p;
+}
+
+static unsigned scan_scalar(Scanner *s, unsigned *offsets, unsigned n,
+                            unsigned max)
+{
+    const char *buf = s->buf;
+    size_t len = s->len, pos = s->pos;
+
+    while (pos < len && n < max) {
+        int type = candidate_type[(unsigned char) buf[pos]];
+        if (type == 1) {
+            offsets[n++] = (unsigned) pos++;
+        } else if (type == 2) {
+            int is_cand;
+            size_t next = skip_special(buf, len, pos, &is_cand);
+            if (is_cand)
+                offsets[n++] = (unsigned) pos;
+            pos = next;
+        } else {
+            pos++;
+        }
+    }
+    s->pos = pos;
+
+    return n;
+}
+
+/*
+ * The vector loops find the candidate bytes of a whole vector at once and
+ * walk the resulting bit mask; the rest of the buffer, shorter than a
+ * vector, is left to scan_scalar.
+ */
+#define SCAN_VECTORS(vec_size, candidate_mask)                              \
+    while (s->pos + vec_size <= s->len) {                                   \
+        size_t pos = s->pos, end = pos + vec_size;                          \
+        unsigned mask = candidate_mask(&s->buf[pos]);                       \
+        while (mask) {                                                      \
+            size_t off = pos + ctz(mask);                                   \
+            mask &= mask - 1;                                               \
+            if (candidate_type[(unsigned char) s->buf[off]] == 2) {         \
+                int is_cand;                                                \
+                size_t next = skip_special(s->buf, s->len, off, &is_cand);  \
+                if (is_cand)                                                \
+                    offsets[n++] = (unsigned) off;                          \
+                if (next - pos >= vec_size) {                               \
+                    end = next;                                             \
+                    mask = 0;                                               \
+                } else {                                                    \
+                    mask &= ~0U << (next - pos);                            \
+                }                                                           \
+                off = next - 1;                                             \
+            } else {                                                        \
+                offsets[n++] = (unsigned) off;                              \
+            }                                                               \
+            if (n == max) {                                                 \
+                s->pos = off + 1;                                           \
+                return n;                                                   \
+            }                                                               \
+        }                                                                   \
+        s->pos = end;                                                       \
+    }
+
+#ifdef HAVE_SSE2
+static unsigned candidate_mask_sse2(const char *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i fe = _mm_and_si128(v, _mm_set1_epi8((char) 0xFE));
+    __m128i fd = _mm_and_si128(v, _mm_set1_epi8((char) 0xFD));
+    __m128i df = _mm_and_si128(v, _mm_set1_epi8((char) 0xDF));
+    __m128i m;
+
+    m = _mm_cmpeq_epi8(fe, _mm_set1_epi8('('));                       // ( )
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(fe, _mm_set1_epi8(':')));      // : ;
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(fe, _mm_set1_epi8('"')));      // " #
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(fd, _mm_set1_epi8(',')));      // , .
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(df, _mm_set1_epi8('[')));      // [ {
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(df, _mm_set1_epi8(']')));      // ] }
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('%')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+
+    return (unsigned) _mm_movemask_epi8(m);
+}
+
+static unsigned scan_sse2(Scanner *s, unsigned *offsets, unsigned n,
+                          unsigned max)
+{
+    SCAN_VECTORS(16, candidate_mask_sse2)
+
+    return scan_scalar(s, offsets, n, max);
+}
+#endif
+
+#ifdef HAVE_AVX2
+static TARGET_AVX2 unsigned candidate_mask_avx2(const char *p)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    __m256i fe = _mm256_and_si256(v, _mm256_set1_epi8((char) 0xFE));
+    __m256i fd = _mm256_and_si256(v, _mm256_set1_epi8((char) 0xFD));
+    __m256i df = _mm256_and_si256(v, _mm256_set1_epi8((char) 0xDF));
+    __m256i m;
+
+    m = _mm256_cmpeq_epi8(fe, _mm256_set1_epi8('('));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(fe, _mm256_set1_epi8(':')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(fe, _mm256_set1_epi8('"')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(fd, _mm256_set1_epi8(',')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(df, _mm256_set1_epi8('[')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(df, _mm256_set1_epi8(']')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('%')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+
+    return (unsigned) _mm256_movemask_epi8(m);
+}
+
+static TARGET_AVX2 unsigned scan_avx2(Scanner *s, unsigned *offsets,
+                                      unsigned n, unsigned max)
+{
+    SCAN_VECTORS(32, candidate_mask_avx2)
+
+    return scan_scalar(s, offsets, n, max);
+}
+
+static int cpu_has_avx2(void)
+{
+#ifdef _MSC_VER
+    int info[4];
+
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return 0;
+    // the OS has to save the ymm registers
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) ||
+        (_xgetbv(0) & 6) != 6)
+        return 0;
+    __cpuidex(info, 7, 0);
+
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+int init_scanner(Scanner *s, const char *buf, size_t len, enum ScanImpl impl)
+{
+    if (impl == SCAN_AUTO) {
+        impl = SCAN_SCALAR;
+#ifdef HAVE_SSE2
+        impl = SCAN_SSE2;
+#endif
+#ifdef HAVE_AVX2
+        if (cpu_has_avx2())
+            impl = SCAN_AVX2;
+#endif
+    }
+#ifndef HAVE_SSE2
+    if (impl == SCAN_SSE2)
+        return 1;
+#endif
+#ifdef HAVE_AVX2
+    if (impl == SCAN_AVX2 && !cpu_has_avx2())
+        return 1;
+#else
+    if (impl == SCAN_AVX2)
+        return 1;
+#endif
+
+    s->buf = buf;
+    s->len = len;
+    s->pos = 0;
+    s->impl = impl;
+
+    return 0;
+}
+
+unsigned scan_candidates(Scanner *s, unsigned *offsets, unsigned max)
+{
+    switch (s->impl) {
+#ifdef HAVE_AVX2
+    case SCAN_AVX2:
+        return scan_avx2(s, offsets, 0, max);
+#endif
+#ifdef HAVE_SSE2
+    case SCAN_SSE2:
+        return scan_sse2(s, offsets, 0, max);
+#endif
+    default:
+        return scan_scalar(s, offsets, 0, max);
+    }
+}
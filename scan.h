@@ -0,0 +1,64 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef C99CONV_SCAN_H
+#define C99CONV_SCAN_H
+
+#include <stddef.h>
+
+/*
+ * Candidate scanner: finds the offsets of the structural characters
+ *
+ *   { } ( ) [ ] ; , . :   and the digraphs <: <% %>
+ *
+ * in preprocessed source, skipping string and character literals,
+ * comments and preprocessor lines. A candidate at a digraph points at its
+ * first character, and :> is reported as :. Everything between two
+ * candidates is identifiers, numbers, literals and operators, which the
+ * pre-scan only lexes where it needs to.
+ */
+
+enum ScanImpl {
+    SCAN_AUTO,
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2,
+};
+
+typedef struct Scanner {
+    const char *buf;
+    size_t len;
+    size_t pos;
+    enum ScanImpl impl;
+} Scanner;
+
+/*
+ * Prepare scanning buf with impl, or the fastest one the CPU supports for
+ * SCAN_AUTO. Returns 1 if impl isn't available in this build or on this
+ * CPU.
+ */
+int init_scanner(Scanner *s, const char *buf, size_t len, enum ScanImpl impl);
+
+/*
+ * Store the offsets of up to max following candidates in offsets. Returns
+ * the number stored, 0 at the end of the buffer.
+ */
+unsigned scan_candidates(Scanner *s, unsigned *offsets, unsigned max);
+
+#endif /* C99CONV_SCAN_H */
@@ -0,0 +1,368 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "c99conv.h"
+#include "server.h"
+
+#ifdef _WIN32
+int run_server(const char *path, int trace_level, unsigned n_workers)
+{
+    fprintf(stderr, "--server is not supported on Windows\n");
+    return 1;
+}
+#else
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// a client that stalls for this long gets disconnected
+#define SERVER_IO_TIMEOUT 30
+
+static volatile sig_atomic_t stop_server;
+
+static void handle_stop_signal(int sig)
+{
+    stop_server = 1;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    char *ptr = (char *) buf;
+
+    while (len) {
+        ssize_t n = read(fd, ptr, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        ptr += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *ptr = (const char *) buf;
+
+    while (len) {
+        ssize_t n = write(fd, ptr, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        ptr += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+typedef struct Worker {
+    C99ConvContext *ctx;
+    int trace_level;
+    int log_fd;  // the server's own stderr
+    int diag_fd; // stderr while converting, sent back to the client
+    unsigned n_requests;
+} Worker;
+
+/* log a line to the server's stderr */
+static void log_server(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "c99conv[%d]: ", (int) getpid());
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static void handle_request(Worker *w, int conn)
+{
+    unsigned char header[SERVER_RESPONSE_SIZE];
+    C99ConvOptions opts;
+    struct timeval start, end;
+    char *in = NULL, *out = NULL, *diag = NULL;
+    size_t len, outlen = 0;
+    off_t diaglen;
+    unsigned elapsed;
+    int res;
+
+    if (read_full(conn, header, SERVER_REQUEST_SIZE) ||
+        get_u32(header) != SERVER_MAGIC ||
+        get_u32(header + 8) > SERVER_MAX_INPUT) {
+        log_server("malformed request header, dropping connection\n");
+        return;
+    }
+    memset(&opts, 0, sizeof(opts));
+    opts.ms_compat = !!(get_u32(header + 4) & SERVER_FLAG_MS);
+    opts.trace_level = w->trace_level;
+    len = get_u32(header + 8);
+    in = (char *) malloc(len + 1);
+    if (!in) {
+        log_server("out of memory for a %u byte request\n", (unsigned) len);
+        return;
+    }
+    if (read_full(conn, in, len)) {
+        log_server("truncated request, dropping connection\n");
+        free(in);
+        return;
+    }
+
+    // collect everything the conversion prints, for the client
+    fflush(stderr);
+    if (ftruncate(w->diag_fd, 0) || lseek(w->diag_fd, 0, SEEK_SET)) {
+        log_server("unable to reset the diagnostics file\n");
+        free(in);
+        return;
+    }
+    dup2(w->diag_fd, STDERR_FILENO);
+    gettimeofday(&start, NULL);
+    res = c99conv_convert_buffer(w->ctx, in, len, &opts, &out, &outlen);
+    gettimeofday(&end, NULL);
+    fflush(stderr);
+    dup2(w->log_fd, STDERR_FILENO);
+    elapsed = (unsigned) ((end.tv_sec - start.tv_sec) * 1000000 +
+                          (end.tv_usec - start.tv_usec));
+
+    diaglen = lseek(w->diag_fd, 0, SEEK_END);
+    if (diaglen > 0) {
+        diag = (char *) malloc(diaglen);
+        if (!diag || pread(w->diag_fd, diag, diaglen, 0) != diaglen)
+            diaglen = 0;
+    } else {
+        diaglen = 0;
+    }
+
+    put_u32(header, res);
+    put_u32(header + 4, outlen);
+    put_u32(header + 8, diaglen);
+    put_u32(header + 12, elapsed);
+    if (write_full(conn, header, SERVER_RESPONSE_SIZE) ||
+        write_full(conn, out, outlen) ||
+        write_full(conn, diag, diaglen))
+        log_server("unable to send the response\n");
+
+    w->n_requests++;
+    log_server("request %u: %u bytes%s -> %u bytes in %.1f ms%s\n",
+               w->n_requests, (unsigned) len, opts.ms_compat ? " (-ms)" : "",
+               (unsigned) outlen, elapsed / 1000.0, res ? ", failed" : "");
+
+    c99conv_free(out);
+    free(diag);
+    free(in);
+}
+
+static void run_worker(int listen_fd, int trace_level)
+{
+    Worker w;
+    FILE *diag_file = tmpfile();
+
+    memset(&w, 0, sizeof(w));
+    w.trace_level = trace_level;
+    w.ctx = c99conv_create_context();
+    w.log_fd = dup(STDERR_FILENO);
+    if (!w.ctx || !diag_file || w.log_fd < 0) {
+        log_server("unable to set up a worker\n");
+        exit(1);
+    }
+    w.diag_fd = fileno(diag_file);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    for (;;) {
+        struct timeval timeout;
+        int conn = accept(listen_fd, NULL, NULL);
+
+        if (conn < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                log_server("accept: %s\n", strerror(errno));
+            continue;
+        }
+        timeout.tv_sec = SERVER_IO_TIMEOUT;
+        timeout.tv_usec = 0;
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        handle_request(&w, conn);
+        close(conn);
+    }
+}
+
+static pid_t start_worker(int listen_fd, int trace_level)
+{
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        log_server("fork: %s\n", strerror(errno));
+    } else if (!pid) {
+        run_worker(listen_fd, trace_level);
+        exit(0);
+    }
+
+    return pid;
+}
+
+/* bind to path, replacing a stale socket left behind by a dead server */
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd, res;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (!connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        fprintf(stderr, "A server is already running at %s\n", path);
+        close(fd);
+        return -1;
+    }
+    if (errno == ECONNREFUSED)
+        unlink(path);
+    close(fd);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    // only the user running the server may connect
+    mask = umask(077);
+    res = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+    if (res || listen(fd, 128)) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int run_server(const char *path, int trace_level, unsigned n_workers)
+{
+    struct sigaction sa;
+    pid_t *workers;
+    time_t *started;
+    unsigned n;
+    int listen_fd;
+
+    if (!n_workers) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_workers = n_cpus > 0 ? n_cpus : 1;
+    }
+    workers = (pid_t *) calloc(n_workers, sizeof(*workers));
+    started = (time_t *) calloc(n_workers, sizeof(*started));
+    if (!workers || !started) {
+        fprintf(stderr, "Out of memory\n");
+        free(workers);
+        free(started);
+        return 1;
+    }
+
+    listen_fd = open_socket(path);
+    if (listen_fd < 0) {
+        free(workers);
+        free(started);
+        return 1;
+    }
+
+    // no SA_RESTART, so that waitpid() below returns when told to stop
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /*
+     * Conversions run in worker processes, each with its own warm context,
+     * so that an input that crashes the converter only takes down one
+     * worker, which is then replaced.
+     */
+    for (n = 0; n < n_workers; n++) {
+        workers[n] = start_worker(listen_fd, trace_level);
+        started[n] = time(NULL);
+    }
+    log_server("serving %s with %u workers\n", path, n_workers);
+
+    while (!stop_server) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid < 0) {
+            if (errno == ECHILD)
+                break;
+            continue;
+        }
+        for (n = 0; n < n_workers; n++) {
+            if (workers[n] != pid)
+                continue;
+            if (WIFSIGNALED(status))
+                log_server("worker %d died from signal %d\n", (int) pid,
+                           WTERMSIG(status));
+            else
+                log_server("worker %d exited with status %d\n", (int) pid,
+                           WEXITSTATUS(status));
+            // don't spin if workers die right away
+            if (time(NULL) - started[n] < 1)
+                sleep(1);
+            workers[n] = start_worker(listen_fd, trace_level);
+            started[n] = time(NULL);
+        }
+    }
+
+    for (n = 0; n < n_workers; n++) {
+        if (workers[n] > 0)
+            kill(workers[n], SIGTERM);
+    }
+    for (n = 0; n < n_workers; n++) {
+        if (workers[n] > 0)
+            waitpid(workers[n], NULL, 0);
+    }
+    close(listen_fd);
+    unlink(path);
+    log_server("stopped\n");
+    free(workers);
+    free(started);
+
+    return 0;
+}
+#endif
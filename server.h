@@ -0,0 +1,65 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef C99CONV_SERVER_H
+#define C99CONV_SERVER_H
+
+/*
+ * Protocol between c99wrap and a c99conv --server, over a Unix domain
+ * socket. All header fields are 32 bit unsigned, big endian.
+ *
+ * request:  magic, flags, input length, input
+ * response: status (0 on success), output length, diagnostics length,
+ *           conversion time in microseconds, output, diagnostics
+ *
+ * One request is handled per connection. The diagnostics are whatever
+ * the conversion printed to stderr.
+ */
+#define SERVER_MAGIC          0x43393943 // "C99C"
+#define SERVER_FLAG_MS        1          // like c99conv -ms
+#define SERVER_MAX_INPUT      (1U << 30)
+#define SERVER_REQUEST_SIZE   12
+#define SERVER_RESPONSE_SIZE  16
+
+// c99wrap uses the server at $C99CONV_SOCKET, or else at the default path
+#define SERVER_SOCKET_ENV     "C99CONV_SOCKET"
+#define SERVER_DEFAULT_SOCKET "/tmp/c99conv-%u.sock" // %u is the user id
+
+#ifndef _WIN32
+// inline, as not everything including this header uses them
+static inline void put_u32(unsigned char *buf, unsigned val)
+{
+    buf[0] = val >> 24;
+    buf[1] = val >> 16;
+    buf[2] = val >> 8;
+    buf[3] = val;
+}
+
+static inline unsigned get_u32(const unsigned char *buf)
+{
+    return ((unsigned) buf[0] << 24) | ((unsigned) buf[1] << 16) |
+           ((unsigned) buf[2] << 8) | buf[3];
+}
+#endif
+
+/*
+ * Serve conversions at socket path with n_workers worker processes, until
+ * interrupted. Returns non-zero if the server couldn't be started.
+ */
+int run_server(const char *path, int trace_level, unsigned n_workers);
+
+#endif /* C99CONV_SERVER_H */
@@ -0,0 +1,142 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "c99conv.h"
+#include "stats.h"
+
+static const char *phase_names[C99CONV_N_PHASES] = {
+    "prescan", "parse", "tokenize", "walk", "emit", "cleanup",
+};
+
+// in the order of enum CLType in convert.c
+static const char *literal_names[C99CONV_N_LITERAL_TYPES] = {
+    "unknown", "omit_cast", "temp_assign", "const_decl", "new_context",
+    "loop_context",
+};
+
+void get_clocks(double *wall, double *cpu)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    FILETIME created, exited, kernel, user;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    *wall = (double) count.QuadPart / freq.QuadPart;
+    *cpu = 0;
+    if (GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) {
+        // in units of 100 ns
+        *cpu = ((double) kernel.dwHighDateTime + user.dwHighDateTime) *
+               429.4967296 +
+               ((double) kernel.dwLowDateTime + user.dwLowDateTime) * 1e-7;
+    }
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *wall = ts.tv_sec + ts.tv_nsec * 1e-9;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    *cpu = ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+void c99conv_add_stats(C99ConvStats *sum, const C99ConvStats *add)
+{
+    int n;
+
+    for (n = 0; n < C99CONV_N_PHASES; n++) {
+        sum->wall[n] += add->wall[n];
+        sum->cpu[n] += add->cpu[n];
+    }
+    sum->files += add->files;
+    sum->passed_through += add->passed_through;
+    sum->bytes_in += add->bytes_in;
+    sum->bytes_out += add->bytes_out;
+    sum->tokens += add->tokens;
+    sum->cursors += add->cursors;
+    sum->clang_tokenize_calls += add->clang_tokenize_calls;
+    sum->struct_array_lists += add->struct_array_lists;
+    for (n = 0; n < C99CONV_N_LITERAL_TYPES; n++)
+        sum->literals[n] += add->literals[n];
+    sum->end_scopes += add->end_scopes;
+    sum->gap_fillers += add->gap_fillers;
+}
+
+static void print_json(FILE *f, const C99ConvStats *s)
+{
+    int n;
+
+    fprintf(f, "{\"phases\":{");
+    for (n = 0; n < C99CONV_N_PHASES; n++) {
+        fprintf(f, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", n ? "," : "",
+                phase_names[n], s->wall[n], s->cpu[n]);
+    }
+    fprintf(f, "},\"files\":%lu,\"passed_through\":%lu,\"bytes_in\":%llu,"
+            "\"bytes_out\":%llu,\"tokens\":%llu,\"cursors\":%llu,"
+            "\"clang_tokenize_calls\":%lu,\"struct_array_lists\":%lu,"
+            "\"literals\":{", s->files, s->passed_through, s->bytes_in,
+            s->bytes_out, s->tokens, s->cursors, s->clang_tokenize_calls,
+            s->struct_array_lists);
+    for (n = 0; n < C99CONV_N_LITERAL_TYPES; n++) {
+        fprintf(f, "%s\"%s\":%lu", n ? "," : "", literal_names[n],
+                s->literals[n]);
+    }
+    fprintf(f, "},\"end_scopes\":%lu,\"gap_fillers\":%lu}\n", s->end_scopes,
+            s->gap_fillers);
+}
+
+void c99conv_print_stats(FILE *f, const C99ConvStats *s, int json)
+{
+    double wall = 0, cpu = 0;
+    int n;
+
+    if (json) {
+        print_json(f, s);
+        return;
+    }
+
+    fprintf(f, "%-10s %10s %10s\n", "phase", "wall (ms)", "cpu (ms)");
+    for (n = 0; n < C99CONV_N_PHASES; n++) {
+        fprintf(f, "%-10s %10.2f %10.2f\n", phase_names[n],
+                s->wall[n] * 1000, s->cpu[n] * 1000);
+        wall += s->wall[n];
+        cpu += s->cpu[n];
+    }
+    fprintf(f, "%-10s %10.2f %10.2f\n", "total", wall * 1000, cpu * 1000);
+    fprintf(f, "files: %lu, %lu passed through unchanged\n", s->files,
+            s->passed_through);
+    fprintf(f, "bytes: %llu in, %llu out\n", s->bytes_in, s->bytes_out);
+    fprintf(f, "tokens: %llu, clang_tokenize calls: %lu\n", s->tokens,
+            s->clang_tokenize_calls);
+    fprintf(f, "cursors visited: %llu\n", s->cursors);
+    fprintf(f, "initializer lists: %lu, gap fillers: %lu\n",
+            s->struct_array_lists, s->gap_fillers);
+    fprintf(f, "compound literals and declarations:");
+    for (n = 0; n < C99CONV_N_LITERAL_TYPES; n++)
+        fprintf(f, " %s %lu", literal_names[n], s->literals[n]);
+    fprintf(f, "\nend scopes: %lu\n", s->end_scopes);
+}
@@ -0,0 +1,80 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Sources the pre-scan has to get right: it may only let sources through
+ * unconverted if they certainly need no conversion.
+ *
+ *   make test-prescan
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "prescan.h"
+
+static const struct {
+    const char *src;
+    int needs_conversion;
+} tests[] = {
+    { "int x; void f(void) { int y; y = x; }", 0 },
+    { "void f(void) { int x; x = 1; x = x * 2; }", 0 },
+    { "void f(void) { int x; x = 1; int y = 2; }", 1 },
+    { "typedef int T; void f(void) { f(); T y = 0; }", 1 },
+    { "typedef int T; void f(void) { f(); T *y = 0; }", 1 },
+    // declarators in parentheses and arrays after a typedef name
+    { "typedef int T; void f(void) { f(); T (*fp)(void) = 0; }", 1 },
+    { "typedef int T; void f(void) { int x; x = 1; T (y) = 2; }", 1 },
+    { "typedef int T; void f(void) { int x; x = 1; T y[2]; }", 1 },
+    { "typedef int T; void f(void) { int x; x = 1; T [2]; }", 1 },
+    // a type the pre-scan never saw declared
+    { "void f(void) { int x; x = 1; unknown_t *y = 0; }", 1 },
+    // builtin types
+    { "void f(void) { int x; x = 1; __uint128_t *y = 0; }", 1 },
+    { "void f(void) { int x; x = 1; __int128 y = 0; }", 1 },
+    { "void f(void) { int x; x = 1; _Float16 y = 0; }", 1 },
+    { "void f(void) { int x; x = 1; __bf16 y; }", 1 },
+    // function bodies that don't follow a )
+    { "int f(a) int a; { g(); int b = a; return b; }", 1 },
+    { "int (*get(void))[2] { g(); int x; return 0; }", 1 },
+    { "int f(a) int a; { int b = a; g(); return b; }", 0 },
+    // struct, union and enum bodies and initializers at file scope
+    { "struct S { int a; int b; }; union { int c; } u; enum E { A, B };", 0 },
+    { "typedef struct S S; struct S { int a; }; int v[2] = { 1, 2 };", 0 },
+    { "int a[] = { [1] = 2 };", 1 },
+    { "void f(void) { for (int i = 0; i < 2; i++); }", 1 },
+};
+
+int main(void)
+{
+    unsigned n, failed = 0;
+
+    for (n = 0; n < sizeof(tests) / sizeof(tests[0]); n++) {
+        int res = prescan_needs_conversion(tests[n].src, strlen(tests[n].src));
+
+        if (!res != !tests[n].needs_conversion) {
+            fprintf(stderr, "%s: expected %d, got %d\n", tests[n].src,
+                    tests[n].needs_conversion, res);
+            failed++;
+        }
+    }
+    printf("%u of %u pre-scan tests passed\n", n - failed, n);
+
+    return failed != 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#endif
+
+#include "trace.h"
+
+int trace_open(Trace *trace, const char *source, const char *output)
+{
+    const char *file = getenv(TRACE_FILE_ENV);
+
+    memset(trace, 0, sizeof(*trace));
+    if (!file || !*file)
+        return 1;
+    if (strlen(file) >= sizeof(trace->file)) {
+        fprintf(stderr, "%s is too long\n", TRACE_FILE_ENV);
+        return 1;
+    }
+    strcpy(trace->file, file);
+    trace->source = source;
+    trace->output = output;
+#ifdef _WIN32
+    trace->pid = GetCurrentProcessId();
+#else
+    trace->pid = getpid();
+#endif
+    return 0;
+}
+
+double trace_now(void)
+{
+#ifdef _WIN32
+    FILETIME ft;
+
+    // in units of 100 ns since 1601
+    GetSystemTimeAsFileTime(&ft);
+    return ((double) ft.dwHighDateTime * 4294967296.0 + ft.dwLowDateTime) /
+           10 - 11644473600000000.0;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* copy str to dst as the contents of a JSON string, truncated to fit */
+static void escape_json(char *dst, size_t size, const char *str)
+{
+    size_t pos = 0;
+
+    for (; *str && pos + 7 < size; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            dst[pos++] = '\\';
+            dst[pos++] = c;
+        } else if (c < 0x20) {
+            sprintf(dst + pos, "\\u%04x", c);
+            pos += 6;
+        } else {
+            dst[pos++] = c;
+        }
+    }
+    dst[pos] = '\0';
+}
+
+/*
+ * Append record to the trace file while holding a lock on it. The first
+ * writer opens the JSON array; it is never closed, which the trace viewers
+ * accept, so that every record can simply be appended.
+ */
+static void append_record(const char *file, const char *record)
+{
+    size_t len = strlen(record);
+#ifdef _WIN32
+    HANDLE h;
+    OVERLAPPED ov;
+    LARGE_INTEGER size, zero;
+    DWORD written;
+
+    h = CreateFileA(file, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                    NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Unable to open %s\n", file);
+        return;
+    }
+    memset(&ov, 0, sizeof(ov));
+    if (!LockFileEx(h, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &ov)) {
+        fprintf(stderr, "Unable to lock %s\n", file);
+        CloseHandle(h);
+        return;
+    }
+    zero.QuadPart = 0;
+    if (GetFileSizeEx(h, &size) && SetFilePointerEx(h, zero, NULL, FILE_END)) {
+        if (!size.QuadPart)
+            WriteFile(h, "[\n", 2, &written, NULL);
+        if (!WriteFile(h, record, (DWORD) len, &written, NULL) ||
+            written != len)
+            fprintf(stderr, "Unable to write to %s\n", file);
+    }
+    UnlockFileEx(h, 0, MAXDWORD, MAXDWORD, &ov);
+    CloseHandle(h);
+#else
+    struct stat st;
+    int fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0666);
+
+    if (fd < 0) {
+        perror(file);
+        return;
+    }
+    if (flock(fd, LOCK_EX)) {
+        perror(file);
+        close(fd);
+        return;
+    }
+    if (!fstat(fd, &st)) {
+        if (!st.st_size && write(fd, "[\n", 2) != 2)
+            perror(file);
+        if (write(fd, record, len) != (ssize_t) len)
+            perror(file);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+#endif
+}
+
+void trace_event(const Trace *trace, const char *name, double start,
+                 int exit_code, const char *via)
+{
+    char source[1024], output[1024], record[3072];
+    double end;
+
+    if (!trace->file[0])
+        return;
+    end = trace_now();
+    escape_json(source, sizeof(source), trace->source);
+    escape_json(output, sizeof(output), trace->output);
+    snprintf(record, sizeof(record),
+             "{\"name\":\"%s\",\"cat\":\"c99wrap\",\"ph\":\"X\","
+             "\"ts\":%.0f,\"dur\":%.0f,\"pid\":%lu,\"tid\":%lu,"
+             "\"args\":{\"source\":\"%s\",\"output\":\"%s\",\"exit\":%d%s%s%s}"
+             "},\n",
+             name, start, end - start, trace->pid, trace->pid,
+             source, output, exit_code, via ? ",\"via\":\"" : "",
+             via ? via : "", via ? "\"" : "");
+    append_record(trace->file, record);
+}
@@ -0,0 +1,53 @@
+/*
+ * C99-to-MSVC-compatible-C89 syntax converter
+ * Copyright (c) 2012 Ronald S. Bultje <rsbultje@gmail.com>
+ * Copyright (c) 2012 Derek Buitenhuis <derek.buitenhuis@gmail.com>
+ * Copyright (c) 2012 Martin Storsjo <martin@martin.st>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef C99CONV_TRACE_H
+#define C99CONV_TRACE_H
+
+/*
+ * Build traces from c99wrap. With $C99CONV_TRACE_FILE set, each wrapper
+ * appends a complete event ("ph":"X") in the Chrome trace event format for
+ * every stage of its compile, which chrome://tracing and Perfetto load
+ * directly. Wrappers running concurrently lock the file while appending,
+ * so records never interleave.
+ */
+#define TRACE_FILE_ENV "C99CONV_TRACE_FILE"
+
+typedef struct Trace {
+    char file[512];
+    const char *source;
+    const char *output;
+    unsigned long pid;
+} Trace;
+
+/* returns nonzero if tracing is disabled */
+int trace_open(Trace *trace, const char *source, const char *output);
+
+/* the wall clock in microseconds, the same for all processes */
+double trace_now(void);
+
+/*
+ * Append an event for the stage name, which ran from start until now. The
+ * exit code of the stage and via, how it ran (may be NULL), are added as
+ * arguments along with the source and output.
+ */
+void trace_event(const Trace *trace, const char *name, double start,
+                 int exit_code, const char *via);
+
+#endif /* C99CONV_TRACE_H */